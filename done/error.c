@@ -22,5 +22,7 @@ const char* const ERR_MESSAGES[] = {
     "Existing image ID",
     "Image manipulation library error",
     "Debug",
+    "Too much work in progress, try again later",
+    "Image too similar to an existing one",
     "no error (shall not be displayed)" // ERR_LAST
 };
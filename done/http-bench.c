@@ -0,0 +1,238 @@
+/*
+ * @file http-bench.c
+ * @brief Load generator measuring the throughput of an HTTP server on localhost
+ *
+ * Each connection sends its share of the GET requests one after the other
+ * and reads every response entirely before sending the next one. All the
+ * connections are opened before the first request, so that with as many
+ * connections as requests, they all reach the server at once.
+ * With -reconnect, each request is sent on a connection of its own instead,
+ * to measure the rate at which the server takes new connections.
+ */
+
+#include "error.h"
+#include "http_prot.h"
+#include "socket_layer.h"
+#include "util.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define LOCAL_IP "127.0.0.1"
+#define RESPONSE_BUF_SIZE 65536
+#define REQUEST_BUF_SIZE 1024
+
+static uint16_t port;
+static char request[REQUEST_BUF_SIZE];
+static size_t request_len;
+static bool reconnect = false; // a new connection for each request
+
+// the workers wait for all the connections to be opened before sending
+static pthread_mutex_t start_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t start_cond = PTHREAD_COND_INITIALIZER;
+static bool started = false;
+
+struct bench_worker {
+    pthread_t thread;
+    unsigned requests;   // number of requests to send
+    unsigned failed;     // number of requests without a complete 2xx response
+    uint64_t body_bytes; // total size of the received bodies
+    double max_latency;  // slowest request, in seconds
+};
+
+static double elapsed(const struct timespec* start, const struct timespec* end)
+{
+    return (double) (end->tv_sec - start->tv_sec) + (double) (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static int connect_local(void)
+{
+    int socket_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (socket_fd == -1) {
+        perror("socket() in connect_local()");
+        return ERR_IO;
+    }
+    struct sockaddr_in server_addr;
+    zero_init_var(server_addr);
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, LOCAL_IP, &server_addr.sin_addr) <= 0 ||
+        connect(socket_fd, (struct sockaddr*) &server_addr, sizeof(server_addr)) == -1) {
+        perror("connect() in connect_local()");
+        close(socket_fd);
+        return ERR_IO;
+    }
+    return socket_fd;
+}
+
+// read one whole response, return its body length or a negative error
+static long read_response(int socket_fd, char* buf, bool* success)
+{
+    size_t filled = 0;
+    const char* body = NULL;
+    while (body == NULL) {
+        if (filled == RESPONSE_BUF_SIZE - 1) {
+            return ERR_IO;
+        }
+        ssize_t ret = tcp_read(socket_fd, buf + filled, RESPONSE_BUF_SIZE - 1 - filled);
+        if (ret <= 0) {
+            return ERR_IO;
+        }
+        filled += (size_t) ret;
+        buf[filled] = '\0';
+        body = strstr(buf, HTTP_HDR_END_DELIM);
+    }
+    body += strlen(HTTP_HDR_END_DELIM);
+    *success = strncmp(buf, HTTP_PROTOCOL_ID "2", strlen(HTTP_PROTOCOL_ID) + 1) == 0;
+
+    const char* length = strstr(buf, "Content-Length" HTTP_HDR_KV_DELIM);
+    if (length == NULL || length > body) {
+        return ERR_IO;
+    }
+    const long content_len = atol(length + strlen("Content-Length" HTTP_HDR_KV_DELIM));
+    long remaining = content_len - (long) (filled - (size_t) (body - buf));
+    while (remaining > 0) {
+        ssize_t ret = tcp_read(socket_fd, buf, (size_t) MIN(remaining, RESPONSE_BUF_SIZE));
+        if (ret <= 0) {
+            return ERR_IO;
+        }
+        remaining -= ret;
+    }
+    return content_len;
+}
+
+static void* run_worker(void* arg)
+{
+    struct bench_worker* worker = arg;
+    char* buf = malloc(RESPONSE_BUF_SIZE);
+    int socket_fd = reconnect ? -1 : connect_local();
+
+    pthread_mutex_lock(&start_mutex);
+    while (!started) {
+        pthread_cond_wait(&start_cond, &start_mutex);
+    }
+    pthread_mutex_unlock(&start_mutex);
+
+    if (buf == NULL || (!reconnect && socket_fd < 0)) {
+        worker->failed = worker->requests;
+        free(buf);
+        return NULL;
+    }
+    for (unsigned i = 0; i < worker->requests; ++i) {
+        bool success = false;
+        long body_len = -1;
+        struct timespec sent, received;
+        clock_gettime(CLOCK_MONOTONIC, &sent);
+        if (reconnect) {
+            socket_fd = connect_local();
+        }
+        if (socket_fd >= 0 && tcp_send(socket_fd, request, request_len) == (ssize_t) request_len) {
+            body_len = read_response(socket_fd, buf, &success);
+        }
+        if (reconnect && socket_fd >= 0) {
+            close(socket_fd);
+            socket_fd = -1;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &received);
+        worker->max_latency = MAX(worker->max_latency, elapsed(&sent, &received));
+        if (body_len < 0 && reconnect) {
+            ++worker->failed;
+            continue;
+        }
+        if (body_len < 0) {
+            // the connection is unusable: count the remaining requests as failed
+            worker->failed += worker->requests - i;
+            break;
+        }
+        if (!success) {
+            ++worker->failed;
+        }
+        worker->body_bytes += (uint64_t) body_len;
+    }
+    if (socket_fd >= 0) {
+        close(socket_fd);
+    }
+    free(buf);
+    return NULL;
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc > 1 && strcmp(argv[1], "-reconnect") == 0) {
+        reconnect = true;
+        --argc;
+        ++argv;
+    }
+    if (argc < 4 || argc > 5) {
+        fprintf(stderr, "Usage: %s [-reconnect] <port> <uri> <requests> [connections]\n", argv[0]);
+        return ERR_NOT_ENOUGH_ARGUMENTS;
+    }
+    port = atouint16(argv[1]);
+    const unsigned requests = atouint32(argv[3]);
+    const unsigned connections = argc == 5 ? atouint32(argv[4]) : 1;
+    if (port == 0 || requests == 0 || connections == 0 || connections > requests) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    int len = snprintf(request, REQUEST_BUF_SIZE, "GET %s HTTP/1.1" HTTP_LINE_DELIM
+                       "Host: localhost" HTTP_HDR_END_DELIM, argv[2]);
+    if (len < 0 || len >= REQUEST_BUF_SIZE) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    request_len = (size_t) len;
+
+    struct bench_worker* workers = calloc(connections, sizeof(struct bench_worker));
+    if (workers == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    for (unsigned i = 0; i < connections; ++i) {
+        workers[i].requests = requests / connections + (i < requests % connections ? 1 : 0);
+        if (pthread_create(&workers[i].thread, NULL, run_worker, &workers[i])) {
+            workers[i].failed = workers[i].requests;
+            workers[i].requests = 0;
+        }
+    }
+    // give the workers time to connect
+    const struct timespec connect_delay = { 0, 100 * 1000 * 1000 };
+    nanosleep(&connect_delay, NULL);
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pthread_mutex_lock(&start_mutex);
+    started = true;
+    pthread_cond_broadcast(&start_cond);
+    pthread_mutex_unlock(&start_mutex);
+
+    unsigned failed = 0;
+    uint64_t body_bytes = 0;
+    double max_latency = 0;
+    for (unsigned i = 0; i < connections; ++i) {
+        if (workers[i].requests > 0) {
+            pthread_join(workers[i].thread, NULL);
+        }
+        failed += workers[i].failed;
+        body_bytes += workers[i].body_bytes;
+        max_latency = MAX(max_latency, workers[i].max_latency);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    free(workers);
+
+    const double seconds = elapsed(&start, &end);
+    if (reconnect) {
+        printf("%u requests, each on a new connection, %u at a time, in %.3f s (%u failed)\n",
+               requests, connections, seconds, failed);
+    } else {
+        printf("%u requests over %u connection(s) in %.3f s (%u failed)\n", requests, connections, seconds, failed);
+    }
+    printf("%.1f requests/s, %.1f MB/s, slowest request %.1f ms\n", (double) requests / seconds,
+           (double) body_bytes / seconds / 1e6, max_latency * 1e3);
+    return failed == 0 ? ERR_NONE : ERR_IO;
+}
@@ -13,150 +13,585 @@
 #include <stdint.h>
 #include <sys/types.h>
 #include <unistd.h>
-#include <signal.h>
 #include <stdbool.h>
 #include <limits.h>
 #include <pthread.h>
+#include <errno.h>
+#include <fcntl.h> // O_NONBLOCK
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <time.h>
+#include <sys/time.h> // struct timeval
 
 #include "http_prot.h"
 #include "http_net.h"
+#include "http_workers.h"
 #include "socket_layer.h"
+#include "socket_uring.h"
 #include "util.h"
 #include "error.h"
 
 static int passive_socket = -1;
+static int epoll_fd = -1;
 static EventCallback cb;
+static const struct http_body_handler* body_handler = NULL;
+static size_t nb_workers = 0; // threads serving the connections, 0 for one per CPU
+static uint64_t idle_timeout_ms = DEFAULT_IDLE_TIMEOUT * 1000;
+static size_t max_body_len = (size_t) DEFAULT_MAX_BODY << 20;
+static bool use_io_uring = false; // for the I/O of the connections, rather than a system call each
 
-#define MK_OUR_ERR(X) \
-static int our_ ## X = X
+#define MAX_EVENTS 64 // handled by each call to http_receive()
 
-MK_OUR_ERR(ERR_NONE);
-MK_OUR_ERR(ERR_INVALID_ARGUMENT);
-MK_OUR_ERR(ERR_OUT_OF_MEMORY);
-MK_OUR_ERR(ERR_IO);
-MK_OUR_ERR(ERR_RUNTIME);
+/*
+ * A connection, owned by the event loop of http_receive() while a request is
+ * read, then by a worker until it is answered. The connection is only watched
+ * (once, EPOLLONESHOT) or received from (io_uring) while owned by the event loop.
+ */
+struct http_conn {
+    int socket;
+    char* rcvbuf;      // NULL between requests, MAX_HEADER_SIZE bytes (and a null byte) else
+    size_t read_bytes;
+    struct http_conn* next; // among those handed back to the event loop of io_uring
+    // among those waiting for bytes
+    bool is_waiting;
+    uint64_t waiting_since;
+    struct http_conn* prev_waiting;
+    struct http_conn* next_waiting;
+};
+
+// the connections waiting for (the rest of) a request, from the one waiting for the longest
+static struct {
+    pthread_mutex_t lock;
+    struct http_conn* first;
+    struct http_conn* last;
+} waiting = { PTHREAD_MUTEX_INITIALIZER, NULL, NULL };
+
+// receive buffers kept for the next requests, rather than freed after each one and allocated again
+#define SPARE_BUFFERS 64
+static struct {
+    pthread_mutex_t lock;
+    char* buffers[SPARE_BUFFERS];
+    size_t nb;
+} spare = { PTHREAD_MUTEX_INITIALIZER, { NULL }, 0 };
+
+// the connections handed back by the workers to the event loop of io_uring, which alone submits to its ring
+static struct {
+    pthread_mutex_t lock;
+    struct http_conn* first;
+} handed_back = { PTHREAD_MUTEX_INITIALIZER, NULL };
+
+static const char CONTENT_LENGTH[] = "Content-Length";
+
+#define REPLY_HEADER_SIZE 1024 // on the stack, enough for the headers of most replies
+
+
+// a receive buffer: the parser looks for the end of the headers in a null-terminated string
+static char* get_rcvbuf(void)
+{
+    char* buf = NULL;
+    pthread_mutex_lock(&spare.lock);
+    if (spare.nb > 0) {
+        buf = spare.buffers[--spare.nb];
+    }
+    pthread_mutex_unlock(&spare.lock);
+    return buf != NULL ? buf : malloc(MAX_HEADER_SIZE + 1);
+}
+
+static void put_rcvbuf(char* buf)
+{
+    if (buf == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&spare.lock);
+    if (spare.nb < SPARE_BUFFERS) {
+        spare.buffers[spare.nb++] = buf;
+        buf = NULL;
+    }
+    pthread_mutex_unlock(&spare.lock);
+    free(buf);
+}
+
+static uint64_t now_ms(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000 + (uint64_t) now.tv_nsec / 1000000;
+}
+
+// the connection waits for bytes, in the event loop, from now on
+static void start_waiting(struct http_conn* conn)
+{
+    pthread_mutex_lock(&waiting.lock);
+    conn->is_waiting = true;
+    conn->waiting_since = now_ms();
+    conn->prev_waiting = waiting.last;
+    conn->next_waiting = NULL;
+    if (waiting.last != NULL) {
+        waiting.last->next_waiting = conn;
+    } else {
+        waiting.first = conn;
+    }
+    waiting.last = conn;
+    pthread_mutex_unlock(&waiting.lock);
+}
 
-static const size_t HTTP_HDR_END_DELIM_SIZE = sizeof(HTTP_HDR_END_DELIM) - 1;
-static const size_t HTTP_LINE_DELIM_SIZE    = sizeof(HTTP_LINE_DELIM) - 1;
-static const size_t HTTP_PROTOCOL_ID_SIZE   = sizeof(HTTP_PROTOCOL_ID) - 1;
-static const size_t HTTP_HDR_KV_DELIM_SIZE  = sizeof(HTTP_HDR_KV_DELIM) - 1;
-static const char CONTENT_LENGTH[]          = "Content-Length";
-static const size_t CONTENT_LENGTH_SIZE     = sizeof(CONTENT_LENGTH) - 1;
+// with the lock of the waiting connections
+static void unlink_waiting(struct http_conn* conn)
+{
+    if (conn->prev_waiting != NULL) {
+        conn->prev_waiting->next_waiting = conn->next_waiting;
+    } else {
+        waiting.first = conn->next_waiting;
+    }
+    if (conn->next_waiting != NULL) {
+        conn->next_waiting->prev_waiting = conn->prev_waiting;
+    } else {
+        waiting.last = conn->prev_waiting;
+    }
+    conn->is_waiting = false;
+}
 
-#define PARSING_BUF_MAX 20
+static void stop_waiting(struct http_conn* conn)
+{
+    pthread_mutex_lock(&waiting.lock);
+    if (conn->is_waiting) {
+        unlink_waiting(conn);
+    }
+    pthread_mutex_unlock(&waiting.lock);
+}
 
+/*******************************************************************
+ * Shut down the connections which waited for longer than the idle
+ * timeout: the event loop then closes them as if their peer did, as
+ * they are watched (or received from). Returns the time until the
+ * next one times out, in milliseconds.
+ */
+static int reap_idle_connections(void)
+{
+    const uint64_t now = now_ms();
+    uint64_t next_timeout = idle_timeout_ms;
+    pthread_mutex_lock(&waiting.lock);
+    while (waiting.first != NULL) {
+        struct http_conn* const conn = waiting.first;
+        if (now - conn->waiting_since < idle_timeout_ms) {
+            next_timeout = conn->waiting_since + idle_timeout_ms - now;
+            break;
+        }
+        unlink_waiting(conn);
+        shutdown(conn->socket, SHUT_RDWR);
+    }
+    pthread_mutex_unlock(&waiting.lock);
+    return next_timeout > INT_MAX ? INT_MAX : (int) next_timeout;
+}
 
-// close the buffer and the socker.
-// if error is one of our standard errors return a pointer to it else return a pointer to ERR_IO
-static int* free_close_all(char* buf, int* active_socket, int err)
+// free the buffer and close the socket: the connection is done
+static bool close_connection(char* buf, struct http_conn* conn)
 {
     free(buf);
-    if (close(*active_socket) == -1) {
-        perror("close() in free_close_all()");
-        free(active_socket);
-        return &our_ERR_IO;
-    }
-    free(active_socket);
-    switch (err) {
-    case ERR_NONE:
-        return &our_ERR_NONE;
-    case ERR_INVALID_ARGUMENT:
-        return &our_ERR_INVALID_ARGUMENT;
-    case ERR_OUT_OF_MEMORY:
-        return &our_ERR_OUT_OF_MEMORY;
-    case ERR_RUNTIME:
-        return &our_ERR_RUNTIME;
-    default:
-        return &our_ERR_IO;
+    put_rcvbuf(conn->rcvbuf);
+    stop_waiting(conn);
+    if (close(conn->socket) == -1) {
+        perror("close() in close_connection()");
     }
+    free(conn);
+    return false;
+}
+
+// (re)watch a connection for its next bytes, reported once even if they are already there
+static int watch(struct http_conn* conn, int op)
+{
+    start_waiting(conn);
+    struct epoll_event event;
+    zero_init_var(event);
+    event.events = EPOLLIN | EPOLLRDHUP | EPOLLET | EPOLLONESHOT;
+    event.data.ptr = conn;
+    return epoll_ctl(epoll_fd, op, conn->socket, &event) == -1 ? ERR_IO : ERR_NONE;
+}
+
+// wait until the socket is ready, as the non-blocking ones are used by the workers as if they were not;
+// a peer which neither sends nor receives for the idle timeout is given up, rather than holding the worker
+static int wait_socket(int active_socket, short events)
+{
+    struct pollfd ready = { .fd = active_socket, .events = events, .revents = 0 };
+    const int timeout = idle_timeout_ms > INT_MAX ? INT_MAX : (int) idle_timeout_ms;
+    int ret = 0;
+    do {
+        ret = poll(&ready, 1, timeout);
+    } while (ret == -1 && errno == EINTR);
+    if (ret == 0) {
+        errno = ETIMEDOUT;
+    }
+    return ret == 1 ? ERR_NONE : ERR_IO;
+}
+
+// tcp_read() and tcp_sendv() on the connections given to the workers, or their io_uring versions
+static ssize_t conn_read(int active_socket, char* buf, size_t len)
+{
+    return use_io_uring ? uring_read(active_socket, buf, len) : tcp_read(active_socket, buf, len);
+}
+
+static ssize_t conn_sendv(int active_socket, const struct iovec* iov, int iovcnt, bool more)
+{
+    return use_io_uring ? uring_sendv(active_socket, iov, iovcnt, more) : tcp_sendv(active_socket, iov, iovcnt, more);
+}
+
+// conn_read(), waiting for the data
+static ssize_t read_waiting(int active_socket, char* buf, size_t len)
+{
+    for (;;) {
+        const ssize_t ret = conn_read(active_socket, buf, len);
+        if (ret >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+            return ret;
+        }
+        if (errno != EINTR && wait_socket(active_socket, POLLIN) != ERR_NONE) {
+            return -1;
+        }
+    }
+}
+
+// whether the headers of a request are in the buffer of a connection, for a worker to serve it
+static bool request_ready(const struct http_conn* conn)
+{
+    struct http_message msg;
+    int content_len = 0;
+    // an invalid request is for the worker to refuse too
+    return http_parse_message(conn->rcvbuf, conn->read_bytes, &msg, &content_len) != 0 || content_len > 0;
 }
 
 /*******************************************************************
- * Handle connection
+ * After a request of request_len bytes out of the read_bytes of rcvbuf,
+ * the connection goes back to the event loop. The bytes that followed
+ * the request are kept for the next ones: if one of them is complete
+ * already (pipelined), the connection is queued again instead, to serve
+ * it in turn.
  */
-static void *handle_connection(void *arg)
+static bool next_request(struct http_conn* conn, char* rcvbuf, size_t read_bytes, size_t request_len, bool extended)
 {
-    sigset_t mask;
-    sigemptyset(&mask);
-    sigaddset(&mask, SIGINT );
-    sigaddset(&mask, SIGTERM);
-    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+    const size_t leftover = read_bytes - request_len;
+    // the end of a body that did not fit in a receive buffer is read exactly, with nothing more
+    if (extended || leftover == 0) {
+        if (extended) {
+            free(rcvbuf);
+        } else {
+            put_rcvbuf(rcvbuf);
+        }
+    } else {
+        memmove(rcvbuf, rcvbuf + request_len, leftover);
+        rcvbuf[leftover] = '\0';
+        conn->rcvbuf = rcvbuf;
+        conn->read_bytes = leftover;
+        if (request_ready(conn)) {
+            return true;
+        }
+    }
+
+    if (use_io_uring) {
+        pthread_mutex_lock(&handed_back.lock);
+        // woken once for all the connections handed back until it takes them
+        const bool wake = handed_back.first == NULL;
+        conn->next = handed_back.first;
+        handed_back.first = conn;
+        pthread_mutex_unlock(&handed_back.lock);
+        if (wake && uring_loop_wake() != ERR_NONE) {
+            perror("uring_loop_wake() in next_request()");
+        }
+        return false;
+    }
+    if (watch(conn, EPOLL_CTL_MOD) != ERR_NONE) {
+        return close_connection(NULL, conn);
+    }
+    return false;
+}
 
-    if (arg == NULL) return &our_ERR_INVALID_ARGUMENT;
-    int* active_socket = (int*)arg;
-    char* rcvbuf = malloc(MAX_HEADER_SIZE);
-    if (rcvbuf == NULL) {
-        return free_close_all(rcvbuf, active_socket, ERR_OUT_OF_MEMORY);
+// give the body of msg to the body handler as it arrives, msg->body.len bytes of it being already received
+static int stream_body(int active_socket, const struct http_message* msg, size_t content_len, void* body_ctx)
+{
+    char* chunk = malloc(BODY_CHUNK_SIZE);
+    if (chunk == NULL) {
+        body_handler->abort(body_ctx);
+        return ERR_OUT_OF_MEMORY;
+    }
+    size_t received = msg->body.len;
+    int ret = body_handler->chunk(body_ctx, msg->body.val, msg->body.len);
+    while (ret == ERR_NONE && received < content_len) {
+        ssize_t read_len = read_waiting(active_socket, chunk, MIN(BODY_CHUNK_SIZE, content_len - received));
+        if (read_len <= 0) {
+            ret = ERR_IO;
+        } else {
+            received += (size_t) read_len;
+            ret = body_handler->chunk(body_ctx, chunk, (size_t) read_len);
+        }
     }
+    free(chunk);
+    if (ret != ERR_NONE) {
+        body_handler->abort(body_ctx);
+    }
+    return ret;
+}
+
+/*******************************************************************
+ * Handle a request of a connection, as an http_worker_task: its
+ * headers are received, its body may still have to be
+ */
+static bool handle_connection(void* arg)
+{
+    struct http_conn* const conn = arg;
+    const int active_socket = conn->socket;
+    char* rcvbuf = conn->rcvbuf;
+    size_t read_bytes = conn->read_bytes;
+    conn->rcvbuf = NULL;
+    conn->read_bytes = 0;
 
     ssize_t ret = 0;
-    char* where_to_read = rcvbuf;
-    size_t read_bytes = 0;
+    char* where_to_read = rcvbuf + read_bytes;
     bool extended_message = false;
     struct http_message msg;
+    zero_init_var(msg);
     int content_len = 0;
     size_t how_much_to_read = 0;
 
+    size_t request_len = 0; // what the request takes of rcvbuf, once its headers are there
     while(true) {
-        how_much_to_read = !extended_message ? MAX_HEADER_SIZE - read_bytes : (size_t) content_len - msg.body.len;
-        ret = tcp_read(*active_socket, where_to_read, how_much_to_read);
-        // case of an error or socket is closed
-        if (ret <= 0) {
-            if (ret < 0) fprintf(stderr, "handle_connection: tcp_read error\n");
-            else fprintf(stderr, "handle_connection: Connection closed by client\n");
-            return free_close_all(rcvbuf, active_socket, (int) ret);
-        }
-        read_bytes += (size_t) ret;
-        where_to_read += ret;
-
         int parse_result = http_parse_message(rcvbuf, read_bytes, &msg, &content_len);
         if (parse_result < 0) {
             fprintf(stderr, "handle_connection: http_parse_message error\n");
-            return free_close_all(rcvbuf, active_socket, parse_result);
+            return close_connection(rcvbuf, conn);
+        }
+        // what follows the body belongs to the next requests
+        if (parse_result > 0 || content_len > 0) {
+            msg.body.len = MIN(msg.body.len, (size_t) content_len);
+            request_len = (size_t) (msg.body.val - rcvbuf) + msg.body.len;
+        }
+        // refused before anything is reserved for it
+        if ((size_t) content_len > max_body_len) {
+            fprintf(stderr, "handle_connection: body of %d bytes refused\n", content_len);
+            http_reply(active_socket, HTTP_CONTENT_TOO_LARGE, "Connection: close" HTTP_LINE_DELIM, "", 0);
+            return close_connection(rcvbuf, conn);
         }
-        if (parse_result == 0 && !extended_message && content_len > 0 && read_bytes < MAX_HEADER_SIZE + (size_t) content_len) {
-            char* temp = realloc(rcvbuf, MAX_HEADER_SIZE + (size_t) content_len);
+        void* body_ctx = NULL;
+        if (parse_result == 0 && !extended_message && content_len > 0 && body_handler != NULL &&
+            body_handler->begin(&msg, (size_t) content_len, &body_ctx) > 0) {
+            int stream_result = stream_body(active_socket, &msg, (size_t) content_len, body_ctx);
+            if (stream_result != ERR_NONE) {
+                fprintf(stderr, "handle_connection: error while streaming the body\n");
+                return close_connection(rcvbuf, conn);
+            }
+            msg.body.len = 0;
+            msg.body_ctx = body_ctx;
+            parse_result = 1;
+        } else if (parse_result == 0 && !extended_message && content_len > 0 && read_bytes < MAX_HEADER_SIZE + (size_t) content_len) {
+            char* temp = realloc(rcvbuf, MAX_HEADER_SIZE + (size_t) content_len + 1);
             if (temp == NULL) {
                 fprintf(stderr, "handle_connection: Out of memory during realloc\n");
-                return free_close_all(rcvbuf, active_socket, ERR_OUT_OF_MEMORY);
+                return close_connection(rcvbuf, conn);
             }
             rcvbuf = temp;
             where_to_read = rcvbuf + read_bytes;
             extended_message = true;
-            // go back and read till the end of the body
-        }
-
-        // check if we exceeded the header size constrain
-        if (parse_result == 0 && content_len == 0 && read_bytes == MAX_HEADER_SIZE) {
-            fprintf(stderr, "handle_connection: Header size exceeded MAX_HEADER_SIZE\n");
-            return free_close_all(rcvbuf, active_socket, ERR_IO);
+            // go on and read till the end of the body
         }
 
         if (parse_result > 0) {
-            int callback_result = cb(&msg, *active_socket);
+            const bool keep_alive = !http_header_has_token(&msg, "Connection", "close");
+            int callback_result = cb(&msg, active_socket);
             if (callback_result < 0) {
                 fprintf(stderr, "handle_connection: EventCallback error\n");
-                return free_close_all(rcvbuf, active_socket, callback_result);
+                return close_connection(rcvbuf, conn);
+            }
+            if (!keep_alive) {
+                return close_connection(rcvbuf, conn);
             }
+            return next_request(conn, rcvbuf, read_bytes, request_len, extended_message);
+        }
 
-            // reset variables and garbage collect
-            read_bytes = 0;
-            extended_message = false;
-            content_len = 0;
-            free(rcvbuf);
-            rcvbuf = malloc(MAX_HEADER_SIZE);
-            if (rcvbuf == NULL) {
-                fprintf(stderr, "handle_connection: Out of memory during reset\n");
-                return free_close_all(rcvbuf, active_socket, ERR_OUT_OF_MEMORY);
+        how_much_to_read = (size_t) content_len - msg.body.len;
+        ret = read_waiting(active_socket, where_to_read, how_much_to_read);
+        // case of an error or socket is closed
+        if (ret <= 0) {
+            if (ret < 0) fprintf(stderr, "handle_connection: tcp_read error\n");
+            else fprintf(stderr, "handle_connection: Connection closed by client\n");
+            return close_connection(rcvbuf, conn);
+        }
+        read_bytes += (size_t) ret;
+        where_to_read += ret;
+        rcvbuf[read_bytes] = '\0';
+    }
+}
+
+// bytes were added to the buffer of a connection: true if it is done with,
+// as it went to a worker once the headers of a request are there, or was closed
+static bool request_received(struct http_conn* conn)
+{
+    struct http_message msg;
+    int content_len = 0;
+    const int parse_result = http_parse_message(conn->rcvbuf, conn->read_bytes, &msg, &content_len);
+    if (parse_result < 0) {
+        fprintf(stderr, "receive_request: http_parse_message error\n");
+        close_connection(NULL, conn);
+        return true;
+    }
+    // a body that is not there yet is read by the worker, as it may be streamed
+    if (parse_result > 0 || content_len > 0) {
+        if (http_workers_submit(conn) != ERR_NONE) {
+            close_connection(NULL, conn);
+        }
+        return true;
+    }
+    // check if we exceeded the header size constrain
+    if (conn->read_bytes == MAX_HEADER_SIZE) {
+        fprintf(stderr, "receive_request: Header size exceeded MAX_HEADER_SIZE\n");
+        close_connection(NULL, conn);
+        return true;
+    }
+    return false;
+}
+
+// the buffer of a connection, allocated as its bytes arrive
+static bool has_rcvbuf(struct http_conn* conn)
+{
+    if (conn->rcvbuf == NULL) {
+        conn->rcvbuf = get_rcvbuf();
+        if (conn->rcvbuf == NULL) {
+            fprintf(stderr, "receive_request: Out of memory\n");
+            close_connection(NULL, conn);
+            return false;
+        }
+    }
+    return true;
+}
+
+/*******************************************************************
+ * Read what arrived on a connection, in the event loop: once the
+ * headers of a request are there, it goes to a worker
+ */
+static void receive_request(struct http_conn* conn)
+{
+    stop_waiting(conn);
+    if (!has_rcvbuf(conn)) {
+        return;
+    }
+    // edge-triggered: everything there is read, until the socket would block
+    for (;;) {
+        const ssize_t ret = tcp_read(conn->socket, conn->rcvbuf + conn->read_bytes, MAX_HEADER_SIZE - conn->read_bytes);
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            // an idle connection keeps no buffer
+            if (conn->read_bytes == 0) {
+                put_rcvbuf(conn->rcvbuf);
+                conn->rcvbuf = NULL;
             }
-            where_to_read = rcvbuf;
+            if (watch(conn, EPOLL_CTL_MOD) != ERR_NONE) {
+                close_connection(NULL, conn);
+            }
+            return;
+        }
+        if (ret <= 0) {
+            if (ret < 0) fprintf(stderr, "receive_request: tcp_read error\n");
+            else if (conn->read_bytes > 0) fprintf(stderr, "receive_request: Connection closed by client\n");
+            close_connection(NULL, conn);
+            return;
+        }
+        conn->read_bytes += (size_t) ret;
+        conn->rcvbuf[conn->read_bytes] = '\0';
+        if (request_received(conn)) {
+            return;
         }
+    }
+}
 
+// receive the next bytes of a connection through the ring of the event loop
+static void receive_uring(struct http_conn* conn)
+{
+    start_waiting(conn);
+    if (uring_loop_recv(conn->socket, MAX_HEADER_SIZE - conn->read_bytes, conn) != ERR_NONE) {
+        close_connection(NULL, conn);
     }
-    // should never be reached
-    return free_close_all(rcvbuf, active_socket, ERR_NONE);
 }
 
+/*******************************************************************
+ * Take what the ring received on a connection: its bytes are only
+ * copied out of the buffers of the ring once they are there, so that
+ * the connections waiting for a request keep no buffer
+ */
+static void uring_received(struct http_conn* conn, int result, const char* data)
+{
+    stop_waiting(conn);
+    // more receives completed at once than there are buffers: the others are back for this one
+    if (result == -ENOBUFS) {
+        receive_uring(conn);
+        return;
+    }
+    if (result <= 0 || data == NULL) {
+        if (result < 0) fprintf(stderr, "receive_request: %s\n", strerror(-result));
+        else if (conn->read_bytes > 0) fprintf(stderr, "receive_request: Connection closed by client\n");
+        close_connection(NULL, conn);
+        return;
+    }
+    if (!has_rcvbuf(conn)) {
+        return;
+    }
+    memcpy(conn->rcvbuf + conn->read_bytes, data, (size_t) result);
+    conn->read_bytes += (size_t) result;
+    conn->rcvbuf[conn->read_bytes] = '\0';
+    if (!request_received(conn)) {
+        receive_uring(conn);
+    }
+}
+
+static struct http_conn* new_connection(int active_socket)
+{
+    struct http_conn* const conn = calloc(1, sizeof(struct http_conn));
+    if (conn == NULL) {
+        close(active_socket);
+        return NULL;
+    }
+    conn->socket = active_socket;
+    return conn;
+}
+
+// accept all the pending connections, until the passive socket would block
+static int accept_connections(void)
+{
+    for (;;) {
+        const int active_socket = tcp_accept_nonblocking(passive_socket);
+        if (active_socket < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return ERR_NONE;
+            }
+            // the client gave up before it was accepted
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            return ERR_IO;
+        }
+        struct http_conn* const conn = new_connection(active_socket);
+        if (conn == NULL) {
+            return ERR_OUT_OF_MEMORY;
+        }
+        if (watch(conn, EPOLL_CTL_ADD) != ERR_NONE) {
+            close_connection(NULL, conn);
+        }
+    }
+}
+
+// the event loop of epoll watches the passive socket, made non-blocking
+static int start_epoll(void)
+{
+    const int flags = fcntl(passive_socket, F_GETFL);
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event event;
+    zero_init_var(event);
+    event.events = EPOLLIN | EPOLLET;
+    event.data.ptr = NULL; // the passive socket
+    if (flags == -1 || fcntl(passive_socket, F_SETFL, flags | O_NONBLOCK) == -1 || epoll_fd == -1 ||
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, passive_socket, &event) == -1) {
+        return ERR_IO;
+    }
+    return ERR_NONE;
+}
 
 /*******************************************************************
  * Init connection
@@ -165,9 +600,63 @@ int http_init(uint16_t port, EventCallback callback)
 {
     passive_socket = tcp_server_init(port);
     cb = callback;
+    if (passive_socket < 0) {
+        return passive_socket;
+    }
+    // the workers wait for their connections no longer than the event loop does
+    uring_set_timeout(idle_timeout_ms > INT_MAX ? INT_MAX : (int) idle_timeout_ms);
+    int ret = use_io_uring ? uring_loop_start(passive_socket) : start_epoll();
+    if (ret == ERR_NONE) {
+        ret = http_workers_start(nb_workers, handle_connection);
+    }
+    if (ret != ERR_NONE) {
+        http_close();
+        return ret;
+    }
     return passive_socket;
 }
 
+/*******************************************************************
+ * Set the number of threads serving the connections
+ */
+void http_set_workers(size_t nb_threads)
+{
+    nb_workers = nb_threads;
+}
+
+/*******************************************************************
+ * Set how long a connection may wait for its next request
+ */
+void http_set_idle_timeout(unsigned seconds)
+{
+    idle_timeout_ms = (uint64_t) seconds * 1000;
+}
+
+void http_set_max_body(unsigned mb)
+{
+    max_body_len = (size_t) mb << 20;
+}
+
+/*******************************************************************
+ * Do the I/O of the connections with io_uring
+ */
+int http_set_io_uring(void)
+{
+    const int ret = uring_probe();
+    if (ret == ERR_NONE) {
+        use_io_uring = true;
+    }
+    return ret;
+}
+
+/*******************************************************************
+ * Set the hooks used to stream request bodies
+ */
+void http_set_body_handler(const struct http_body_handler* handler)
+{
+    body_handler = handler;
+}
+
 /*******************************************************************
  * Close connection
  */
@@ -179,45 +668,75 @@ void http_close(void)
         else
             passive_socket = -1;
     }
+    // the connections are left to the end of the process, with the workers that may be serving them
+    if (epoll_fd >= 0) {
+        close(epoll_fd);
+        epoll_fd = -1;
+    }
+}
+
+// one round of the event loop of io_uring
+static int receive_events_uring(void)
+{
+    struct uring_event events[MAX_EVENTS];
+    size_t nb_events = 0;
+    int ret = uring_loop_wait(events, MAX_EVENTS, &nb_events, reap_idle_connections());
+    for (size_t i = 0; i < nb_events; ++i) {
+        const struct uring_event* const event = &events[i];
+        if (event->type == URING_ACCEPTED) {
+            if (event->result >= 0) {
+                // blocking, they may still block in sendfile(): no longer than the workers wait on the ring
+                struct timeval send_timeout = { .tv_sec = (time_t) (idle_timeout_ms / 1000),
+                                                .tv_usec = (suseconds_t) (idle_timeout_ms % 1000) * 1000 };
+                setsockopt(event->result, SOL_SOCKET, SO_SNDTIMEO, &send_timeout, sizeof(send_timeout));
+                struct http_conn* const conn = new_connection(event->result);
+                if (conn != NULL) {
+                    receive_uring(conn);
+                }
+            } else if (event->result != -ECONNABORTED && event->result != -EINTR) {
+                // the client gave up before it was accepted, or else the server cannot accept any more
+                ret = ERR_IO;
+            }
+        } else if (event->type == URING_WOKEN) {
+            pthread_mutex_lock(&handed_back.lock);
+            struct http_conn* conn = handed_back.first;
+            handed_back.first = NULL;
+            pthread_mutex_unlock(&handed_back.lock);
+            while (conn != NULL) {
+                struct http_conn* const next = conn->next;
+                receive_uring(conn);
+                conn = next;
+            }
+        } else {
+            uring_received(event->ctx, event->result, event->data);
+        }
+    }
+    return ret;
 }
 
 /*******************************************************************
- * Receive content
+ * Receive content: one round of the event loop, accepting the new
+ * connections and reading the requests arrived on the others
  */
 int http_receive(void)
 {
-    int active_socket_ = tcp_accept(passive_socket);
-    // valid socket case
-    if (active_socket_ >= 0) {
-        int* active_socket = malloc(sizeof(int));
-        if (active_socket == NULL) {
-            return ERR_OUT_OF_MEMORY;
-        }
-        *active_socket = active_socket_;
-        pthread_attr_t thread_attr;
-        pthread_t thread;
-        if (pthread_attr_init(&thread_attr)) {
-            free(active_socket);
-            return ERR_THREADING;
-        }
-        if (pthread_attr_setdetachstate(&thread_attr, PTHREAD_CREATE_DETACHED)) {
-            free(active_socket);
-            pthread_attr_destroy(&thread_attr);
-            return ERR_THREADING;
-        }
-        if (pthread_create(&thread, &thread_attr, handle_connection, active_socket)) {
-            free(active_socket);
-            pthread_attr_destroy(&thread_attr);
-            return ERR_THREADING;
-        }
-        if (pthread_attr_destroy(&thread_attr)) {
-            free(active_socket);
-            return ERR_THREADING;
+    if (use_io_uring) {
+        return receive_events_uring();
+    }
+    struct epoll_event events[MAX_EVENTS];
+    const int nb_events = epoll_wait(epoll_fd, events, MAX_EVENTS, reap_idle_connections());
+    if (nb_events == -1) {
+        return errno == EINTR ? ERR_NONE : ERR_IO;
+    }
+    int ret = ERR_NONE;
+    for (int i = 0; i < nb_events; ++i) {
+        if (events[i].data.ptr == NULL) {
+            ret = accept_connections();
+        } else {
+            receive_request(events[i].data.ptr);
         }
-        return ERR_NONE;
-    } else {
-        return ERR_IO;
     }
+    return ret;
 }
 
 /*******************************************************************
@@ -272,61 +791,200 @@ int http_serve_file(int connection, const char* filename)
     return ret;
 }
 
-// return nbr of digits of a number and (0) in case of an error 
-static size_t nbr_of_digits (size_t n)
+// format the header of a reply in the size bytes of buf if it fits, else in an allocated
+// buffer; *header_len is set to its length
+static char* format_reply_header(char* buf, size_t size, size_t* header_len, const char* status,
+                                 const char* headers, size_t body_len)
 {
-    char buf[PARSING_BUF_MAX + 1];
-    if (snprintf(buf, PARSING_BUF_MAX + 1, "%zu", n) <= 0){
-        return 0;
+    char* header = buf;
+    for (int attempt = 0; attempt < 2; ++attempt) {
+        const int len = snprintf(header, size, "%s%s%s%s%s%s%zu%s",
+                                 HTTP_PROTOCOL_ID, status, HTTP_LINE_DELIM, headers, CONTENT_LENGTH,
+                                 HTTP_HDR_KV_DELIM, body_len, HTTP_HDR_END_DELIM);
+        if (len < 0 || len == INT_MAX) {
+            break;
+        }
+        if ((size_t) len < size) {
+            *header_len = (size_t) len;
+            return header;
+        }
+        size = (size_t) len + 1;
+        header = malloc(size);
+        if (header == NULL) {
+            break;
+        }
+    }
+    if (header != buf) {
+        free(header);
     }
-    return strlen(buf);
+    return NULL;
+}
+
+// send the buffers of iov (which is updated), whatever the number of conn_sendv() it takes;
+// the socket may be non-blocking
+static int send_all_iov(int connection, struct iovec* iov, int iovcnt, bool more)
+{
+    for (;;) {
+        while (iovcnt > 0 && iov->iov_len == 0) {
+            ++iov;
+            --iovcnt;
+        }
+        if (iovcnt == 0) {
+            return ERR_NONE;
+        }
+        const ssize_t ret = conn_sendv(connection, iov, iovcnt, more);
+        if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+            if (errno != EINTR && wait_socket(connection, POLLOUT) != ERR_NONE) {
+                return ERR_IO;
+            }
+            continue;
+        }
+        if (ret <= 0) {
+            return ERR_IO;
+        }
+        // a short send goes on from where it stopped
+        size_t sent = (size_t) ret;
+        while (sent >= iov->iov_len) {
+            sent -= iov->iov_len;
+            ++iov;
+            --iovcnt;
+            if (iovcnt == 0) {
+                return ERR_NONE;
+            }
+        }
+        iov->iov_base = (char*) iov->iov_base + sent;
+        iov->iov_len -= sent;
+    }
+}
+
+static int send_all(int connection, const char* buf, size_t len)
+{
+    struct iovec iov = { .iov_base = (void*) (uintptr_t) buf, .iov_len = len };
+    return send_all_iov(connection, &iov, 1, false);
+}
+
+// send len bytes of fd from offset through a user space buffer, when sendfile() cannot be used
+static int reply_file_by_copy(int connection, int fd, uint64_t offset, size_t len)
+{
+    char* buffer = malloc(BODY_CHUNK_SIZE);
+    if (buffer == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    int ret = ERR_NONE;
+    while (ret == ERR_NONE && len > 0) {
+        ssize_t read_len = pread(fd, buffer, MIN(BODY_CHUNK_SIZE, len), (off_t) offset);
+        if (read_len <= 0) {
+            ret = ERR_IO;
+        } else {
+            ret = send_all(connection, buffer, (size_t) read_len);
+            offset += (uint64_t) read_len;
+            len -= (size_t) read_len;
+        }
+    }
+    free(buffer);
+    return ret;
 }
 
 /*******************************************************************
- * Create and send HTTP reply
+ * Create and send HTTP reply: the header is formatted on the stack
+ * and sent with the body of the caller, as they are
  */
 int http_reply(int connection, const char* status, const char* headers, const char *body, size_t body_len)
 {
     if ((body == NULL && body_len != 0) || headers == NULL || status == NULL) {
         return ERR_INVALID_COMMAND;
     }
-    // case of empty body
-    if (body == NULL) {
-        body = "";
+
+    char buf[REPLY_HEADER_SIZE];
+    size_t header_len = 0;
+    char* const header = format_reply_header(buf, sizeof(buf), &header_len, status, headers, body_len);
+    if (header == NULL) {
+        return ERR_OUT_OF_MEMORY;
     }
+    struct iovec iov[2] = {
+        { .iov_base = header, .iov_len = header_len },
+        { .iov_base = (void*) (uintptr_t) body, .iov_len = body_len }
+    };
+    const int ret = send_all_iov(connection, iov, body_len > 0 ? 2 : 1, false);
+    if (header != buf) {
+        free(header);
+    }
+    return ret;
+}
 
-    // compute number of digits of body_len and no errors occured 
-    size_t body_len_digits = nbr_of_digits(body_len);
-    if (body_len_digits == 0){
-        return ERR_IO;
+/*******************************************************************
+ * Format once the header of a reply sent over and over
+ */
+char* http_format_reply_header(const char* status, const char* headers, size_t body_len, size_t* header_len)
+{
+    if (headers == NULL || status == NULL || header_len == NULL) {
+        return NULL;
     }
+    // there is no room in a NULL buffer: the header is always allocated
+    return format_reply_header(NULL, 0, header_len, status, headers, body_len);
+}
 
-    size_t http_response_len = HTTP_PROTOCOL_ID_SIZE + strlen(status) + HTTP_LINE_DELIM_SIZE+ strlen(headers) +
-                               CONTENT_LENGTH_SIZE + HTTP_HDR_KV_DELIM_SIZE + body_len_digits +
-                               HTTP_HDR_END_DELIM_SIZE + body_len;
-    size_t http_response_without_body_len = http_response_len - body_len;
-    if (http_response_len > INT_MAX) {
-        return ERR_IO;
+/*******************************************************************
+ * Send HTTP reply with a header formatted beforehand
+ */
+int http_reply_prebuilt(int connection, const char* header, size_t header_len, const char* body, size_t body_len)
+{
+    if ((body == NULL && body_len != 0) || header == NULL || header_len == 0) {
+        return ERR_INVALID_COMMAND;
     }
-    char* http_response = malloc(http_response_len + 1);
-    if (http_response == NULL) {
+    struct iovec iov[2] = {
+        { .iov_base = (void*) (uintptr_t) header, .iov_len = header_len },
+        { .iov_base = (void*) (uintptr_t) body, .iov_len = body_len }
+    };
+    return send_all_iov(connection, iov, body_len > 0 ? 2 : 1, false);
+}
+
+/*******************************************************************
+ * Send HTTP reply with a body taken from a file descriptor
+ */
+int http_reply_file(int connection, const char* status, const char* headers, int fd, uint64_t offset, size_t len)
+{
+    if (headers == NULL || status == NULL || fd < 0) {
+        return ERR_INVALID_COMMAND;
+    }
+
+    char buf[REPLY_HEADER_SIZE];
+    size_t header_len = 0;
+    char* const header = format_reply_header(buf, sizeof(buf), &header_len, status, headers, len);
+    if (header == NULL) {
         return ERR_OUT_OF_MEMORY;
     }
-    int joint_len = snprintf(http_response, http_response_without_body_len + 1, "%s%s%s%s%s%s%zu%s",
-                             HTTP_PROTOCOL_ID, status, HTTP_LINE_DELIM, headers, CONTENT_LENGTH,
-                             HTTP_HDR_KV_DELIM, body_len, HTTP_HDR_END_DELIM);
-    if ((size_t) joint_len != http_response_without_body_len) {
-        free(http_response);
-        return ERR_IO;
+    // held back until the body follows it, rather than sent in a segment of its own
+    struct iovec iov = { .iov_base = header, .iov_len = header_len };
+    int ret = send_all_iov(connection, &iov, 1, len > 0);
+    if (header != buf) {
+        free(header);
+    }
+    if (ret != ERR_NONE) {
+        return ret;
     }
-    memcpy(http_response + http_response_without_body_len, body, body_len);
-
 
-    ssize_t ret = tcp_send(connection, http_response, http_response_len);
-    if (ret < 0 || (size_t) ret != http_response_len) {
-        free(http_response);
-        return ERR_IO;
+    // the kernel copies straight from the file to the socket, without moving the file position
+    off_t file_offset = (off_t) offset;
+    while (len > 0) {
+        ssize_t sent = sendfile(connection, fd, &file_offset, len);
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        }
+        if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            // a blocking socket (io_uring) only gets there once its send timeout is over
+            if (use_io_uring || wait_socket(connection, POLLOUT) != ERR_NONE) {
+                return ERR_IO;
+            }
+            continue;
+        }
+        if (sent < 0 && (errno == EINVAL || errno == ENOSYS)) {
+            return reply_file_by_copy(connection, fd, (uint64_t) file_offset, len);
+        }
+        if (sent <= 0) {
+            return ERR_IO;
+        }
+        len -= (size_t) sent;
     }
-    free(http_response);
     return ERR_NONE;
 }
@@ -12,15 +12,90 @@
 
 #define MAX_REQUEST_SIZE 8388608 // 2^23 -> to handle images up to 8MB
 #define MAX_HEADER_SIZE    16384 // 2^14 -> to handle http headers
+#define BODY_CHUNK_SIZE    65536 // 2^16 -> size of the pieces of a streamed body
+#define DEFAULT_IDLE_TIMEOUT  30 // seconds a connection may wait for its next request
+#define DEFAULT_MAX_BODY      64 // MB of the largest request body accepted
 
 typedef int (*EventCallback) (struct http_message*, int);
 
+/**
+ * @brief Optional hooks to consume a request body while it arrives, instead
+ *        of having the whole of it stored in memory.
+ *
+ * begin() is called once the headers are parsed; a positive return value
+ * claims the body. The part already received, then every later piece, is
+ * given to chunk(). The EventCallback is finally called with an empty body
+ * and the context in msg->body_ctx, and becomes responsible for it.
+ * If the connection fails before, abort() is called instead.
+ */
+struct http_body_handler {
+    int  (*begin) (const struct http_message* msg, size_t content_len, void** ctx);
+    int  (*chunk) (void* ctx, const char* data, size_t len);
+    void (*abort) (void* ctx);
+};
+
 int http_init(uint16_t port, EventCallback cb);
 
+void http_set_body_handler(const struct http_body_handler* handler);
+
+/**
+ * @brief Sets the number of threads serving the connections, to be called
+ *        before http_init(); 0 (the default) for one per CPU.
+ *
+ * A connection only takes a thread while one of its requests is read and
+ * answered: between requests, it waits in http_receive() with the others.
+ */
+void http_set_workers(size_t nb_threads);
+
+/**
+ * @brief Sets how long a connection may wait for (the rest of) its next
+ *        request, in seconds, before it is closed; DEFAULT_IDLE_TIMEOUT
+ *        otherwise.
+ */
+void http_set_idle_timeout(unsigned seconds);
+
+/**
+ * @brief Sets the largest request body accepted, in MB; DEFAULT_MAX_BODY
+ *        otherwise. A request announcing a larger one is answered
+ *        "413 Content Too Large" before its body is read or given to the
+ *        body handler, and its connection is closed.
+ */
+void http_set_max_body(unsigned mb);
+
+/**
+ * @brief Makes the connections do their I/O with io_uring (see
+ *        socket_uring.h) rather than with a system call per operation, to be
+ *        called before http_init().
+ *
+ * @return Some error code. 0 if no error; ERR_IO if io_uring cannot be used.
+ */
+int http_set_io_uring(void);
+
 int http_receive(void);
 
 int http_serve_file(int connection, const char* filename);
 
 int http_reply(int connection, const char* status, const char* headers, const char* body, size_t body_len);
 
+/**
+ * @brief Formats the header http_reply() sends before a body of body_len
+ *        bytes, for a reply sent many times with http_reply_prebuilt().
+ *
+ * @return The header, to be freed by the caller, its length in *header_len;
+ *         NULL if out of memory
+ */
+char* http_format_reply_header(const char* status, const char* headers, size_t body_len, size_t* header_len);
+
+/**
+ * @brief Sends a header formatted by http_format_reply_header() with its body.
+ */
+int http_reply_prebuilt(int connection, const char* header, size_t header_len, const char* body, size_t body_len);
+
+/**
+ * @brief Sends an HTTP reply whose body is the len bytes found at offset in
+ *        the file fd, copied by the kernel (sendfile(2)) rather than through
+ *        a user space buffer.
+ */
+int http_reply_file(int connection, const char* status, const char* headers, int fd, uint64_t offset, size_t len);
+
 void http_close(void);
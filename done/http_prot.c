@@ -6,6 +6,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h> // strncasecmp
 #include <stdbool.h>
 #include <stdbool.h>
 
@@ -57,6 +58,24 @@ static_unless_test int get_value_from_key(const char* key, struct http_message*
     }
 }
 
+// parse the decimal digits of [begin, end) to a uint64_t
+// false in case of an empty, too long or invalid number
+static_unless_test bool parse_uint64(const char* begin, const char* end, uint64_t* out)
+{
+    if (begin >= end || end - begin > PARSING_BUF_MAX) {
+        return false;
+    }
+    uint64_t parsed = 0;
+    for (; begin < end; ++begin) {
+        if (*begin < '0' || *begin > '9' || parsed > (UINT64_MAX - 9) / 10) {
+            return false;
+        }
+        parsed = parsed * 10 + (uint64_t) (*begin - '0');
+    }
+    *out = parsed;
+    return true;
+}
+
 static_unless_test const char* get_next_token(const char* message, const char* delimiter, struct http_string* output)
 {
     size_t delimiter_len = strlen(delimiter);
@@ -244,3 +263,177 @@ int http_parse_message(const char *stream, size_t bytes_received, struct http_me
     }
     return 1;
 }
+
+int http_get_header(const struct http_message* message, const char* key, struct http_string* value)
+{
+    M_REQUIRE_NON_NULL(message);
+    M_REQUIRE_NON_NULL(key);
+    M_REQUIRE_NON_NULL(value);
+
+    const size_t key_len = strlen(key);
+    const struct http_header* header = message->headers;
+    const struct http_header* const last_header = header + message->num_headers;
+    for (; header < last_header; ++header) {
+        if (header->key.len == key_len && strncasecmp(header->key.val, key, key_len) == 0) {
+            *value = header->value;
+            return true;
+        }
+    }
+    return false;
+}
+
+// tells whether the parameters of an item of an Accept(-Encoding) header give it a zero quality
+static bool zero_quality(const char* params, const char* end)
+{
+    while (params < end) {
+        while (params < end && (*params == ';' || *params == ' ' || *params == '\t')) {
+            ++params;
+        }
+        const char* param_end = memchr(params, ';', (size_t) (end - params));
+        if (param_end == NULL) {
+            param_end = end;
+        }
+        if (param_end - params >= 3 && strncasecmp(params, "q=", 2) == 0) {
+            const char* value = params + 2;
+            if (*value != '0') {
+                return false;
+            }
+            for (++value; value < param_end && (*value == '.' || *value == '0'); ++value);
+            return value == param_end || *value == ' ' || *value == '\t';
+        }
+        params = param_end;
+    }
+    return false;
+}
+
+// tells whether the list of the header named key explicitly includes media_type without a zero quality
+static bool list_accepts(const struct http_message* message, const char* key, const char* media_type)
+{
+    struct http_string accept;
+    if (!http_get_header(message, key, &accept)) {
+        return false;
+    }
+    const size_t type_len = strlen(media_type);
+    const char* item = accept.val;
+    const char* const end = accept.val + accept.len;
+    while (item < end) {
+        const char* item_end = memchr(item, ',', (size_t) (end - item));
+        if (item_end == NULL) {
+            item_end = end;
+        }
+        while (item < item_end && (*item == ' ' || *item == '\t')) {
+            ++item;
+        }
+        const char* params = memchr(item, ';', (size_t) (item_end - item));
+        if (params == NULL) {
+            params = item_end;
+        }
+        const char* type_end = params;
+        while (type_end > item && (type_end[-1] == ' ' || type_end[-1] == '\t')) {
+            --type_end;
+        }
+        if ((size_t) (type_end - item) == type_len && strncasecmp(item, media_type, type_len) == 0) {
+            return !zero_quality(params, item_end);
+        }
+        item = item_end + 1;
+    }
+    return false;
+}
+
+int http_accepts(const struct http_message* message, const char* media_type)
+{
+    M_REQUIRE_NON_NULL(message);
+    M_REQUIRE_NON_NULL(media_type);
+    return list_accepts(message, "Accept", media_type);
+}
+
+int http_accepts_encoding(const struct http_message* message, const char* coding)
+{
+    M_REQUIRE_NON_NULL(message);
+    M_REQUIRE_NON_NULL(coding);
+    return list_accepts(message, "Accept-Encoding", coding);
+}
+
+int http_header_has_token(const struct http_message* message, const char* key, const char* token)
+{
+    M_REQUIRE_NON_NULL(message);
+    M_REQUIRE_NON_NULL(key);
+    M_REQUIRE_NON_NULL(token);
+
+    struct http_string value;
+    if (!http_get_header(message, key, &value)) {
+        return false;
+    }
+    const size_t token_len = strlen(token);
+    const char* item = value.val;
+    const char* const end = value.val + value.len;
+    while (item < end) {
+        const char* item_end = memchr(item, ',', (size_t) (end - item));
+        if (item_end == NULL) {
+            item_end = end;
+        }
+        const char* last = item_end;
+        while (item < last && (*item == ' ' || *item == '\t')) {
+            ++item;
+        }
+        while (last > item && (last[-1] == ' ' || last[-1] == '\t')) {
+            --last;
+        }
+        if ((size_t) (last - item) == token_len && strncasecmp(item, token, token_len) == 0) {
+            return true;
+        }
+        item = item_end + 1;
+    }
+    return false;
+}
+
+int http_parse_range(const struct http_string* value, uint64_t total_len, uint64_t* start, uint64_t* len)
+{
+    M_REQUIRE_NON_NULL(value);
+    M_REQUIRE_NON_NULL(start);
+    M_REQUIRE_NON_NULL(len);
+
+    static const char BYTES_UNIT[] = "bytes=";
+    const size_t unit_len = sizeof(BYTES_UNIT) - 1;
+    if (value->len <= unit_len || strncmp(value->val, BYTES_UNIT, unit_len) != 0) {
+        return false;
+    }
+    const char* const spec = value->val + unit_len;
+    const char* const spec_end = value->val + value->len;
+    const char* const dash = memchr(spec, '-', (size_t) (spec_end - spec));
+    // several ranges are allowed to be answered by the whole content
+    if (dash == NULL || memchr(spec, ',', (size_t) (spec_end - spec)) != NULL) {
+        return false;
+    }
+
+    uint64_t first = 0;
+    uint64_t last = 0;
+    if (dash == spec) {
+        // suffix: the last bytes of the content
+        uint64_t suffix_len = 0;
+        if (!parse_uint64(dash + 1, spec_end, &suffix_len)) {
+            return false;
+        }
+        if (suffix_len == 0 || total_len == 0) {
+            return ERR_INVALID_ARGUMENT;
+        }
+        first = total_len - MIN(suffix_len, total_len);
+        last = total_len - 1;
+    } else {
+        if (!parse_uint64(spec, dash, &first)) {
+            return false;
+        }
+        if (dash + 1 == spec_end) {
+            last = UINT64_MAX;
+        } else if (!parse_uint64(dash + 1, spec_end, &last) || last < first) {
+            return false;
+        }
+        if (first >= total_len) {
+            return ERR_INVALID_ARGUMENT;
+        }
+        last = MIN(last, total_len - 1);
+    }
+    *start = first;
+    *len = last - first + 1;
+    return true;
+}
@@ -15,8 +15,15 @@
 #define HTTP_PROTOCOL_ID   "HTTP/1.1 "
 #define HTTP_OK            "200 OK"
 #define HTTP_BAD_REQUEST   "400 Bad Request"
+#define HTTP_PARTIAL_CONTENT         "206 Partial Content"
+#define HTTP_CONFLICT                "409 Conflict"
+#define HTTP_CONTENT_TOO_LARGE       "413 Content Too Large"
+#define HTTP_RANGE_NOT_SATISFIABLE   "416 Range Not Satisfiable"
+#define HTTP_UNPROCESSABLE_CONTENT   "422 Unprocessable Content"
+#define HTTP_SERVICE_UNAVAILABLE     "503 Service Unavailable"
 
 #include <stddef.h>
+#include <stdint.h>
 
 struct http_string {
     const char *val; // Warning! This is *NOT* null-terminated (thus len field below)
@@ -34,6 +41,7 @@ struct http_message {
     struct http_header headers[MAX_HEADERS];
     size_t num_headers;
     struct http_string body;
+    void *body_ctx; // set by the network layer when the body was streamed instead of stored in body
 };
 
 /**
@@ -72,3 +80,51 @@ int http_get_var(const struct http_string* url, const char* name, char* out, siz
  * @brief Compare method with verb and return 1 if they are equal, 0 otherwise
  */
 int http_match_verb(const struct http_string* method, const char* verb);
+
+/**
+ * @brief Finds the header named `key` (case insensitive) in `message` and points value to its value.
+ *
+ * Returns: 1 if the header is present, 0 if it is not.
+ */
+int http_get_header(const struct http_message* message, const char* key, struct http_string* value);
+
+/**
+ * @brief Tells whether the "Accept" header of `message` explicitly lists `media_type`
+ *        (case insensitive) without refusing it with a zero quality ("q=0").
+ *
+ * Media ranges with wildcards are not taken into account.
+ *
+ * Returns: 1 if the media type is accepted, 0 if not.
+ */
+int http_accepts(const struct http_message* message, const char* media_type);
+
+/**
+ * @brief Tells whether the "Accept-Encoding" header of `message` explicitly
+ *        lists the content coding `coding` (e.g. "gzip", case insensitive)
+ *        without refusing it with a zero quality, as http_accepts() does.
+ *
+ * Returns: 1 if the coding is accepted, 0 if not.
+ */
+int http_accepts_encoding(const struct http_message* message, const char* coding);
+
+/**
+ * @brief Tells whether the comma-separated list of the header named `key` of
+ *        `message` includes `token` (both case insensitive), as "close" in
+ *        "Connection: close".
+ *
+ * Returns: 1 if it does, 0 if it does not or if there is no such header.
+ */
+int http_header_has_token(const struct http_message* message, const char* key, const char* token);
+
+/**
+ * @brief Parses the value of a "Range" header for a content of total_len bytes.
+ *
+ * Only single ranges of bytes are supported ("bytes=first-last", "bytes=first-"
+ * and "bytes=-suffix_len"); the last position is clamped to the end of the content.
+ *
+ * Returns:
+ *  1 and sets start and len if the range can be served
+ *  0 if the header must be ignored (malformed or several ranges): the whole content is to be sent
+ *  a negative int if the range is outside the content
+ */
+int http_parse_range(const struct http_string* value, uint64_t total_len, uint64_t* start, uint64_t* len);
@@ -33,6 +33,9 @@
 #define VAR_PARAM2_STRING "img_id"
 #define VAR_VALUE2_STRING "mure.jpg"
 
+// for range_test
+#define IMAGE_LEN 1000
+
 static void http_string_print(struct http_string* s){
   printf("HTTP string: %.*s\n", (int) s->len, s->val);
 }
@@ -282,6 +285,174 @@ START_TEST(test_http_get_var_param_before_question_mark){
 } END_TEST
 
 
+// TEST : http_get_header
+// ==================================================
+START_TEST(test_http_get_header_case_insensitive){
+  struct http_message msg;
+  struct http_string value;
+
+  construct_http_string("range", &msg.headers[0].key);
+  construct_http_string("bytes=0-99", &msg.headers[0].value);
+  msg.num_headers = 1;
+  int res = http_get_header(&msg, "Range", &value);
+  ck_assert_int_eq(res, 1);
+  ck_assert_int_eq(value.len, strlen("bytes=0-99"));
+  res = http_get_header(&msg, "Content-Length", &value);
+  ck_assert_int_eq(res, 0);
+  msg.num_headers = 0;
+  res = http_get_header(&msg, "Range", &value);
+  ck_assert_int_eq(res, 0);
+  destruct_http_string(&msg.headers[0].key);
+  destruct_http_string(&msg.headers[0].value);
+} END_TEST
+
+
+// TEST : http_accepts
+// ==================================================
+static int accepts(const char* accept, const char* media_type){
+  struct http_message msg;
+  construct_http_string("Accept", &msg.headers[0].key);
+  construct_http_string(accept, &msg.headers[0].value);
+  msg.num_headers = 1;
+  int res = http_accepts(&msg, media_type);
+  destruct_http_string(&msg.headers[0].key);
+  destruct_http_string(&msg.headers[0].value);
+  return res;
+}
+
+START_TEST(test_http_accepts_trivial_cases){
+  const char* browser = "image/avif,image/webp,image/apng,image/svg+xml,image/*,*/*;q=0.8";
+  ck_assert_int_eq(accepts(browser, "image/webp"), 1);
+  ck_assert_int_eq(accepts(browser, "image/avif"), 1);
+  ck_assert_int_eq(accepts(browser, "image/jxl"), 0);
+  ck_assert_int_eq(accepts("image/webp", "image/webp"), 1);
+  ck_assert_int_eq(accepts("text/html, Image/WebP ;q=0.5", "image/webp"), 1);
+  ck_assert_int_eq(accepts("image/webpx", "image/webp"), 0);
+  ck_assert_int_eq(accepts("image/*", "image/webp"), 0);
+} END_TEST
+
+START_TEST(test_http_accepts_zero_quality){
+  ck_assert_int_eq(accepts("image/webp;q=0", "image/webp"), 0);
+  ck_assert_int_eq(accepts("image/webp; q=0.000, image/avif", "image/webp"), 0);
+  ck_assert_int_eq(accepts("image/webp;q=0.001", "image/webp"), 1);
+  ck_assert_int_eq(accepts("image/webp;level=1;q=1", "image/webp"), 1);
+} END_TEST
+
+START_TEST(test_http_accepts_no_header){
+  struct http_message msg;
+  msg.num_headers = 0;
+  ck_assert_int_eq(http_accepts(&msg, "image/webp"), 0);
+  ck_assert_int_eq(http_accepts(NULL, "image/webp"), ERR_INVALID_ARGUMENT);
+} END_TEST
+
+
+static int accepts_encoding(const char* accept_encoding, const char* coding){
+  struct http_message msg;
+  construct_http_string("Accept-Encoding", &msg.headers[0].key);
+  construct_http_string(accept_encoding, &msg.headers[0].value);
+  msg.num_headers = 1;
+  int res = http_accepts_encoding(&msg, coding);
+  destruct_http_string(&msg.headers[0].key);
+  destruct_http_string(&msg.headers[0].value);
+  return res;
+}
+
+START_TEST(test_http_accepts_encoding){
+  ck_assert_int_eq(accepts_encoding("gzip, deflate, br, zstd", "br"), 1);
+  ck_assert_int_eq(accepts_encoding("gzip, deflate, br, zstd", "gzip"), 1);
+  ck_assert_int_eq(accepts_encoding("gzip;q=1.0, identity; q=0.5", "br"), 0);
+  ck_assert_int_eq(accepts_encoding("br;q=0, gzip", "br"), 0);
+  ck_assert_int_eq(accepts_encoding("*", "gzip"), 0);
+} END_TEST
+
+
+// TEST : http_header_has_token
+// ==================================================
+static int connection_has(const char* connection, const char* token){
+  struct http_message msg;
+  construct_http_string("Connection", &msg.headers[0].key);
+  construct_http_string(connection, &msg.headers[0].value);
+  msg.num_headers = 1;
+  int res = http_header_has_token(&msg, "connection", token);
+  destruct_http_string(&msg.headers[0].key);
+  destruct_http_string(&msg.headers[0].value);
+  return res;
+}
+
+START_TEST(test_http_header_has_token_trivial_cases){
+  ck_assert_int_eq(connection_has("close", "close"), 1);
+  ck_assert_int_eq(connection_has("Close", "close"), 1);
+  ck_assert_int_eq(connection_has("keep-alive", "close"), 0);
+  ck_assert_int_eq(connection_has("Keep-Alive , close ", "close"), 1);
+  ck_assert_int_eq(connection_has("closed", "close"), 0);
+  ck_assert_int_eq(connection_has("", "close"), 0);
+} END_TEST
+
+START_TEST(test_http_header_has_token_no_header){
+  struct http_message msg;
+  msg.num_headers = 0;
+  ck_assert_int_eq(http_header_has_token(&msg, "Connection", "close"), 0);
+  ck_assert_int_eq(http_header_has_token(NULL, "Connection", "close"), ERR_INVALID_ARGUMENT);
+} END_TEST
+
+// TEST : http_parse_range
+// ==================================================
+static int parse_range(const char* s, uint64_t* start, uint64_t* len){
+  struct http_string value;
+  construct_http_string(s, &value);
+  int res = http_parse_range(&value, IMAGE_LEN, start, len);
+  destruct_http_string(&value);
+  return res;
+}
+
+START_TEST(test_http_parse_range_trivial_cases){
+  uint64_t start = 0;
+  uint64_t len = 0;
+
+  ck_assert_int_eq(parse_range("bytes=0-99", &start, &len), 1);
+  ck_assert_int_eq(start, 0);
+  ck_assert_int_eq(len, 100);
+  ck_assert_int_eq(parse_range("bytes=500-", &start, &len), 1);
+  ck_assert_int_eq(start, 500);
+  ck_assert_int_eq(len, 500);
+  ck_assert_int_eq(parse_range("bytes=-100", &start, &len), 1);
+  ck_assert_int_eq(start, 900);
+  ck_assert_int_eq(len, 100);
+} END_TEST
+
+START_TEST(test_http_parse_range_clamped){
+  uint64_t start = 0;
+  uint64_t len = 0;
+
+  ck_assert_int_eq(parse_range("bytes=900-5000", &start, &len), 1);
+  ck_assert_int_eq(start, 900);
+  ck_assert_int_eq(len, 100);
+  ck_assert_int_eq(parse_range("bytes=-5000", &start, &len), 1);
+  ck_assert_int_eq(start, 0);
+  ck_assert_int_eq(len, IMAGE_LEN);
+} END_TEST
+
+START_TEST(test_http_parse_range_ignored){
+  uint64_t start = 0;
+  uint64_t len = 0;
+
+  ck_assert_int_eq(parse_range(JUNK, &start, &len), 0);
+  ck_assert_int_eq(parse_range("items=0-99", &start, &len), 0);
+  ck_assert_int_eq(parse_range("bytes=", &start, &len), 0);
+  ck_assert_int_eq(parse_range("bytes=99-0", &start, &len), 0);
+  ck_assert_int_eq(parse_range("bytes=a-b", &start, &len), 0);
+  ck_assert_int_eq(parse_range("bytes=0-9,20-29", &start, &len), 0);
+} END_TEST
+
+START_TEST(test_http_parse_range_not_satisfiable){
+  uint64_t start = 0;
+  uint64_t len = 0;
+
+  ck_assert_int_eq(parse_range("bytes=1000-", &start, &len), ERR_INVALID_ARGUMENT);
+  ck_assert_int_eq(parse_range("bytes=-0", &start, &len), ERR_INVALID_ARGUMENT);
+} END_TEST
+
+
 // TEST : get_next_token 
 // ==================================================
 START_TEST(test_get_next_token_trivial_cases){
@@ -331,6 +502,35 @@ Suite* http_var_tests(void) {
     return s;
 }
 
+Suite* http_range_tests(void) {
+    Suite *s = suite_create("HTTP Range Tests");
+    TCase *tc_range = tcase_create("Range");
+
+    tcase_add_test(tc_range, test_http_get_header_case_insensitive);
+    tcase_add_test(tc_range, test_http_parse_range_trivial_cases);
+    tcase_add_test(tc_range, test_http_parse_range_clamped);
+    tcase_add_test(tc_range, test_http_parse_range_ignored);
+    tcase_add_test(tc_range, test_http_parse_range_not_satisfiable);
+    suite_add_tcase(s, tc_range);
+
+    return s;
+}
+
+Suite* http_accept_tests(void) {
+    Suite *s = suite_create("HTTP Accept Tests");
+    TCase *tc_accept = tcase_create("Accept");
+
+    tcase_add_test(tc_accept, test_http_accepts_trivial_cases);
+    tcase_add_test(tc_accept, test_http_accepts_zero_quality);
+    tcase_add_test(tc_accept, test_http_accepts_no_header);
+    tcase_add_test(tc_accept, test_http_accepts_encoding);
+    tcase_add_test(tc_accept, test_http_header_has_token_trivial_cases);
+    tcase_add_test(tc_accept, test_http_header_has_token_no_header);
+    suite_add_tcase(s, tc_accept);
+
+    return s;
+}
+
 int main(void) {
     int number_failed = 0;
     Suite *s = http_uri_tests();
@@ -351,5 +551,17 @@ int main(void) {
     number_failed += srunner_ntests_failed(sr);
     srunner_free(sr);
 
+    s = http_range_tests();
+    sr = srunner_create(s);
+    srunner_run_all(sr, CK_NORMAL);
+    number_failed += srunner_ntests_failed(sr);
+    srunner_free(sr);
+
+    s = http_accept_tests();
+    sr = srunner_create(s);
+    srunner_run_all(sr, CK_NORMAL);
+    number_failed += srunner_ntests_failed(sr);
+    srunner_free(sr);
+
     return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
 }
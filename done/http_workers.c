@@ -0,0 +1,187 @@
+/*
+ * @file http_workers.c
+ * @brief Fixed pool of threads serving the HTTP connections.
+ */
+
+#include "http_workers.h"
+#include "error.h"
+#include "util.h"
+
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h> // sysconf
+
+#define INITIAL_DEQUE_SIZE 16
+
+// the connections of a thread, in a ring buffer, oldest first
+struct deque {
+    pthread_mutex_t mutex;
+    void** connections;
+    size_t capacity;
+    size_t first;
+    size_t count;
+};
+
+struct http_worker {
+    pthread_t thread;
+    struct deque deque;
+};
+
+static struct {
+    struct http_worker* workers;
+    size_t nb_workers;
+    http_worker_task serve;
+    atomic_size_t next;         // thread the next connection submitted goes to
+    atomic_long nb_queued;      // over all the deques; briefly negative when taken as soon as pushed
+    atomic_size_t nb_sleeping;
+    pthread_mutex_t mutex;      // only to sleep and be woken up
+    pthread_cond_t not_empty;
+} pool = { .mutex = PTHREAD_MUTEX_INITIALIZER, .not_empty = PTHREAD_COND_INITIALIZER };
+
+static int deque_push(struct deque* deque, void* connection)
+{
+    pthread_mutex_lock(&deque->mutex);
+    if (deque->count == deque->capacity) {
+        const size_t capacity = deque->capacity == 0 ? INITIAL_DEQUE_SIZE : 2 * deque->capacity;
+        void** const connections = calloc(capacity, sizeof(void*));
+        if (connections == NULL) {
+            pthread_mutex_unlock(&deque->mutex);
+            return ERR_OUT_OF_MEMORY;
+        }
+        for (size_t i = 0; i < deque->count; ++i) {
+            connections[i] = deque->connections[(deque->first + i) % deque->capacity];
+        }
+        free(deque->connections);
+        deque->connections = connections;
+        deque->capacity = capacity;
+        deque->first = 0;
+    }
+    deque->connections[(deque->first + deque->count) % deque->capacity] = connection;
+    ++deque->count;
+    pthread_mutex_unlock(&deque->mutex);
+    return ERR_NONE;
+}
+
+// the oldest connection if oldest, else the newest; NULL if none
+static void* deque_take(struct deque* deque, bool oldest)
+{
+    void* connection = NULL;
+    pthread_mutex_lock(&deque->mutex);
+    if (deque->count > 0) {
+        if (oldest) {
+            connection = deque->connections[deque->first];
+            deque->first = (deque->first + 1) % deque->capacity;
+        } else {
+            connection = deque->connections[(deque->first + deque->count - 1) % deque->capacity];
+        }
+        --deque->count;
+    }
+    pthread_mutex_unlock(&deque->mutex);
+    return connection;
+}
+
+static int push(struct http_worker* worker, void* connection)
+{
+    const int ret = deque_push(&worker->deque, connection);
+    if (ret != ERR_NONE) {
+        return ret;
+    }
+    atomic_fetch_add(&pool.nb_queued, 1);
+    // a thread about to sleep has already counted itself, and sees nb_queued once it waits
+    if (atomic_load(&pool.nb_sleeping) > 0) {
+        pthread_mutex_lock(&pool.mutex);
+        pthread_cond_signal(&pool.not_empty);
+        pthread_mutex_unlock(&pool.mutex);
+    }
+    return ERR_NONE;
+}
+
+// a connection of the thread, or stolen from the others; NULL if none
+static void* take(size_t self)
+{
+    void* connection = deque_take(&pool.workers[self].deque, true);
+    for (size_t i = 1; connection == NULL && i < pool.nb_workers; ++i) {
+        connection = deque_take(&pool.workers[(self + i) % pool.nb_workers].deque, false);
+    }
+    if (connection != NULL) {
+        atomic_fetch_sub(&pool.nb_queued, 1);
+    }
+    return connection;
+}
+
+static void* worker_thread(void* arg)
+{
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT );
+    sigaddset(&mask, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+    const size_t self = (size_t) ((struct http_worker*) arg - pool.workers);
+    for (;;) {
+        void* const connection = take(self);
+        if (connection != NULL) {
+            // the next request of the connection waits behind the ones already queued
+            while (pool.serve(connection) && push(&pool.workers[self], connection) != ERR_NONE) {
+                // served at once if it cannot be queued
+            }
+            continue;
+        }
+        pthread_mutex_lock(&pool.mutex);
+        atomic_fetch_add(&pool.nb_sleeping, 1);
+        while (atomic_load(&pool.nb_queued) <= 0) {
+            pthread_cond_wait(&pool.not_empty, &pool.mutex);
+        }
+        atomic_fetch_sub(&pool.nb_sleeping, 1);
+        pthread_mutex_unlock(&pool.mutex);
+    }
+    return NULL;
+}
+
+int http_workers_start(size_t nb_workers, http_worker_task serve)
+{
+    M_REQUIRE_NON_NULL(serve);
+    if (pool.workers != NULL) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    if (nb_workers == 0) {
+        nb_workers = (size_t) MAX(sysconf(_SC_NPROCESSORS_ONLN), 1);
+    }
+    pool.workers = calloc(nb_workers, sizeof(struct http_worker));
+    if (pool.workers == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    pool.serve = serve;
+    for (size_t i = 0; i < nb_workers; ++i) {
+        if (pthread_mutex_init(&pool.workers[i].deque.mutex, NULL)) {
+            return ERR_THREADING;
+        }
+    }
+    // the threads live as long as the process, as did the ones of each connection before
+    pthread_attr_t thread_attr;
+    if (pthread_attr_init(&thread_attr)) {
+        return ERR_THREADING;
+    }
+    int ret = pthread_attr_setdetachstate(&thread_attr, PTHREAD_CREATE_DETACHED) ? ERR_THREADING : ERR_NONE;
+    pool.nb_workers = nb_workers;
+    for (size_t i = 0; ret == ERR_NONE && i < nb_workers; ++i) {
+        if (pthread_create(&pool.workers[i].thread, &thread_attr, worker_thread, &pool.workers[i])) {
+            ret = ERR_THREADING;
+        }
+    }
+    pthread_attr_destroy(&thread_attr);
+    return ret;
+}
+
+int http_workers_submit(void* connection)
+{
+    M_REQUIRE_NON_NULL(connection);
+    if (pool.nb_workers == 0) {
+        return ERR_THREADING;
+    }
+    const size_t worker = atomic_fetch_add(&pool.next, 1) % pool.nb_workers;
+    return push(&pool.workers[worker], connection);
+}
@@ -0,0 +1,49 @@
+/**
+ * @file http_workers.h
+ * @brief Fixed pool of threads serving the HTTP connections.
+ *
+ * Each thread has its own deque of connections with a request ready to be
+ * read. It takes the oldest of its own, and when it has none, steals the
+ * newest of another thread, the one that would wait the longest there.
+ * The threads only share a lock to sleep and be woken up.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h> // for size_t
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Serves a request of a connection.
+ *
+ * @param connection The connection, with a request ready to be read
+ * @return true if another request of the connection is ready already, for
+ *         it to be queued again; false if the task is done with it (it was
+ *         closed or handed back to be watched)
+ */
+typedef bool (*http_worker_task)(void* connection);
+
+/**
+ * @brief Starts the threads.
+ *
+ * @param nb_workers Number of threads, 0 for one per CPU
+ * @param serve What they do with each connection
+ * @return Some error code. 0 if no error.
+ */
+int http_workers_start(size_t nb_workers, http_worker_task serve);
+
+/**
+ * @brief Queues a connection to one of the threads, in turn.
+ *
+ * @param connection A connection with a request ready to be read
+ * @return Some error code. 0 if no error.
+ */
+int http_workers_submit(void* connection);
+
+#ifdef __cplusplus
+}
+#endif
@@ -1,16 +1,558 @@
 #include "image_content.h"
 #include "error.h"
 #include "util.h"
-#include <stdlib.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h> // for qsort()
+#include <string.h> // for memcpy(), memcmp()
+#include <unistd.h> // for pread()
 #include <vips/vips.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h> // SSE2 and AVX2
+#endif
 
 //
 static void free_all(void* buffer_in, void* buffer_out, VipsImage* image_in, VipsImage* image_out)
 {
     free(buffer_in);
     free(buffer_out);
-    g_object_unref(VIPS_OBJECT(image_in));
-    g_object_unref(VIPS_OBJECT(image_out));
+    if (image_in != NULL) {
+        g_object_unref(VIPS_OBJECT(image_in));
+    }
+    if (image_out != NULL) {
+        g_object_unref(VIPS_OBJECT(image_out));
+    }
+}
+
+// snapshot of the image, without any resolution to create yet
+static int prepare_job(struct imgfs_file* imgfs_file, size_t index, struct resize_job* job)
+{
+    const struct img_metadata* const metadata = imgfs_file->metadata + index;
+
+    if (index >= imgfs_file->header.max_files || metadata->is_valid == EMPTY) {
+        return ERR_INVALID_IMGID;
+    }
+    // the source is read from the file descriptor, bypassing the stream buffer
+    if (fflush(imgfs_file->file)) {
+        return ERR_IO;
+    }
+    zero_init_ptr(job);
+    job->index      = index;
+    memcpy(job->SHA, metadata->SHA, SHA256_DIGEST_LENGTH);
+    job->fd         = fileno(imgfs_file->file);
+    job->src_offset = metadata->offset[ORIG_RES];
+    job->src_size   = metadata->size[ORIG_RES];
+    // recreated as before, if ever
+    for (int res = 0; res < ORIG_RES; ++res) {
+        job->encoding[res] = (uint8_t) GET_ENCODING(metadata, res);
+    }
+    return ERR_NONE;
+}
+
+static void want_resolution(const struct imgfs_header* header, int resolution, struct resize_job* job)
+{
+    job->width [resolution] = header->resized_res[2 * resolution];
+    job->height[resolution] = header->resized_res[2 * resolution + 1];
+}
+
+// a thumbnail alone is much cheaper to make from the small version, when it exists and is larger
+static void choose_source(const struct imgfs_header* header, const struct img_metadata* metadata,
+                          struct resize_job* job)
+{
+    if (job->width[THUMB_RES] != 0 && job->width[SMALL_RES] == 0 && metadata->size[SMALL_RES] != 0 &&
+        header->resized_res[2 * SMALL_RES] >= job->width[THUMB_RES] &&
+        header->resized_res[2 * SMALL_RES + 1] >= job->height[THUMB_RES]) {
+        job->src_offset = metadata->offset[SMALL_RES];
+        job->src_size   = metadata->size[SMALL_RES];
+    }
+}
+
+int resize_prepare(int resolution, struct imgfs_file* imgfs_file, size_t index, struct resize_job* job)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(job);
+
+    if (!(0 <= resolution && resolution < ORIG_RES)) {
+        return ERR_RESOLUTIONS;
+    }
+    int ret = prepare_job(imgfs_file, index, job);
+    if (ret != ERR_NONE) {
+        return ret;
+    }
+    want_resolution(&imgfs_file->header, resolution, job);
+    choose_source(&imgfs_file->header, imgfs_file->metadata + index, job);
+    return ERR_NONE;
+}
+
+int resize_prepare_all(struct imgfs_file* imgfs_file, size_t index, struct resize_job* job)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(job);
+
+    int ret = prepare_job(imgfs_file, index, job);
+    if (ret != ERR_NONE) {
+        return ret;
+    }
+    for (int res = 0; res < ORIG_RES; ++res) {
+        if (imgfs_file->metadata[index].size[res] == 0) {
+            want_resolution(&imgfs_file->header, res, job);
+        }
+    }
+    choose_source(&imgfs_file->header, imgfs_file->metadata + index, job);
+    return ERR_NONE;
+}
+
+int resize_prepare_custom(uint16_t width, uint16_t height, int format, struct imgfs_file* imgfs_file,
+                          size_t index, struct resize_job* job)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(job);
+    const struct imgfs_header* const header   = &imgfs_file->header;
+    const struct img_metadata* const metadata = imgfs_file->metadata + index;
+
+    if (width == 0 || height == 0) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    int ret = prepare_job(imgfs_file, index, job);
+    if (ret != ERR_NONE) {
+        return ret;
+    }
+    job->width [CUSTOM_RES] = width;
+    job->height[CUSTOM_RES] = height;
+    job->format = format;
+    // from the smallest stored version that is large enough, and not lossy in another format
+    for (int res = SMALL_RES; res >= THUMB_RES; --res) {
+        const int stored_format = (int) GET_FORMAT(metadata, res);
+        if (metadata->size[res] != 0 && (stored_format == FORMAT_JPEG || stored_format == format) &&
+            header->resized_res[2 * res] >= width && header->resized_res[2 * res + 1] >= height) {
+            job->src_offset = metadata->offset[res];
+            job->src_size   = metadata->size[res];
+        }
+    }
+    return ERR_NONE;
+}
+
+// encodes an image in one of the FORMAT_*, a JPEG one with the given encoding if not 0
+static int save_buffer(VipsImage* image, int format, uint8_t encoding, void** buffer, size_t* len)
+{
+    switch (format) {
+    case FORMAT_WEBP:
+        return vips_webpsave_buffer(image, buffer, len, NULL);
+    case FORMAT_AVIF:
+        return vips_heifsave_buffer(image, buffer, len, "compression", VIPS_FOREIGN_HEIF_COMPRESSION_AV1, NULL);
+    default:
+        if (encoding == 0) {
+            return vips_jpegsave_buffer(image, buffer, len, NULL);
+        }
+        return vips_jpegsave_buffer(image, buffer, len, "Q", ENCODING_QUALITY(encoding),
+                                    "optimize_coding", TRUE,
+                                    "interlace", (encoding & ENCODING_PROGRESSIVE) != 0, NULL);
+    }
+}
+
+// encodes a JPEG image at a quality level, also progressive if baseline does not fit in budget
+static int save_level(VipsImage* image, int level, uint32_t budget, uint8_t* encoding, void** buffer, size_t* len)
+{
+    *encoding = (uint8_t) level;
+    if (save_buffer(image, FORMAT_JPEG, *encoding, buffer, len) == -1) {
+        return -1;
+    }
+    if (*len <= budget) {
+        return 0;
+    }
+    // progressive is often a few percent smaller
+    void* progressive = NULL;
+    size_t progressive_len = 0;
+    if (save_buffer(image, FORMAT_JPEG, *encoding | ENCODING_PROGRESSIVE, &progressive, &progressive_len) == -1) {
+        free(*buffer);
+        *buffer = NULL;
+        return -1;
+    }
+    if (progressive_len < *len) {
+        free(*buffer);
+        *buffer = progressive;
+        *len = progressive_len;
+        *encoding |= ENCODING_PROGRESSIVE;
+    } else {
+        free(progressive);
+    }
+    return 0;
+}
+
+// encodes a JPEG image with the highest quality level that fits in budget, the smallest if none does
+static int save_budget(VipsImage* image, uint32_t budget, uint8_t* encoding, void** buffer, size_t* len)
+{
+    *buffer = NULL;
+    int low = 1;
+    int high = ENCODING_LEVEL_MASK;
+    while (low <= high) {
+        const int level = (low + high) / 2;
+        void* candidate = NULL;
+        size_t candidate_len = 0;
+        uint8_t candidate_encoding = 0;
+        if (save_level(image, level, budget, &candidate_encoding, &candidate, &candidate_len) == -1) {
+            free(*buffer);
+            *buffer = NULL;
+            return -1;
+        }
+        if (candidate_len <= budget) {
+            free(*buffer);
+            *buffer = candidate;
+            *len = candidate_len;
+            *encoding = candidate_encoding;
+            low = level + 1;
+        } else {
+            free(candidate);
+            high = level - 1;
+        }
+    }
+    return *buffer != NULL ? 0 : save_level(image, 1, 0, encoding, buffer, len);
+}
+
+/**********************************************************************
+ * Box filter: each destination pixel is the average of the source pixels
+ * it covers. The rows are summed with SIMD instructions when available.
+ ********************************************************************** */
+#define BOX_MAX_ROWS (UINT16_MAX / UINT8_MAX) // rows that can be summed in 16 bits
+
+typedef void (*accumulate_fn)(uint16_t* sums, const uint8_t* row, size_t len);
+
+static void accumulate_scalar(uint16_t* sums, const uint8_t* row, size_t len)
+{
+    for (size_t i = 0; i < len; ++i) {
+        sums[i] = (uint16_t) (sums[i] + row[i]);
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2")))
+static void accumulate_sse2(uint16_t* sums, const uint8_t* row, size_t len)
+{
+    const __m128i zero = _mm_setzero_si128();
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        const __m128i bytes = _mm_loadu_si128((const __m128i*) (row + i));
+        __m128i* const out = (__m128i*) (sums + i);
+        _mm_storeu_si128(out,     _mm_add_epi16(_mm_loadu_si128(out),     _mm_unpacklo_epi8(bytes, zero)));
+        _mm_storeu_si128(out + 1, _mm_add_epi16(_mm_loadu_si128(out + 1), _mm_unpackhi_epi8(bytes, zero)));
+    }
+    accumulate_scalar(sums + i, row + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static void accumulate_avx2(uint16_t* sums, const uint8_t* row, size_t len)
+{
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        __m256i* const out = (__m256i*) (sums + i);
+        const __m256i low  = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*) (row + i)));
+        const __m256i high = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*) (row + i + 16)));
+        _mm256_storeu_si256(out,     _mm256_add_epi16(_mm256_loadu_si256(out),     low));
+        _mm256_storeu_si256(out + 1, _mm256_add_epi16(_mm256_loadu_si256(out + 1), high));
+    }
+    accumulate_sse2(sums + i, row + i, len - i);
+}
+#endif
+
+static accumulate_fn best_accumulate(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return accumulate_avx2;
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        return accumulate_sse2;
+    }
+#endif
+    return accumulate_scalar;
+}
+
+// the size of width x height pixels of bands bytes, 0 if it does not fit in a size_t
+static size_t pixels_len(size_t width, size_t height, size_t bands)
+{
+    size_t len = 0;
+    if (__builtin_mul_overflow(width, height, &len) || __builtin_mul_overflow(len, bands, &len)) {
+        return 0;
+    }
+    return len;
+}
+
+int box_downscale(const uint8_t* src, size_t src_width, size_t src_height, size_t bands,
+                  uint8_t* dst, size_t dst_width, size_t dst_height)
+{
+    M_REQUIRE_NON_NULL(src);
+    M_REQUIRE_NON_NULL(dst);
+    if (bands == 0 || dst_width == 0 || dst_height == 0 || dst_width > src_width || dst_height > src_height ||
+        (src_height + dst_height - 1) / dst_height > BOX_MAX_ROWS ||
+        pixels_len(src_width, src_height, bands) == 0 || pixels_len(src_width, bands, sizeof(uint16_t)) == 0) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    const size_t row_len = src_width * bands;
+    uint16_t* const sums = malloc(row_len * sizeof(uint16_t));
+    if (sums == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    const accumulate_fn accumulate = best_accumulate();
+
+    for (size_t y = 0; y < dst_height; ++y) {
+        // the source rows, then columns, the destination pixels cover
+        const size_t y0 = y * src_height / dst_height;
+        const size_t y1 = (y + 1) * src_height / dst_height;
+        memset(sums, 0, row_len * sizeof(uint16_t));
+        for (size_t row = y0; row < y1; ++row) {
+            accumulate(sums, src + row * row_len, row_len);
+        }
+        uint8_t* out = dst + y * dst_width * bands;
+        for (size_t x = 0; x < dst_width; ++x) {
+            const size_t x0 = x * src_width / dst_width;
+            const size_t x1 = (x + 1) * src_width / dst_width;
+            const uint32_t count = (uint32_t) ((x1 - x0) * (y1 - y0));
+            for (size_t band = 0; band < bands; ++band) {
+                uint32_t sum = 0;
+                for (size_t col = x0; col < x1; ++col) {
+                    sum += sums[col * bands + band];
+                }
+                *out++ = (uint8_t) ((sum + count / 2) / count);
+            }
+        }
+    }
+    free(sums);
+    return ERR_NONE;
+}
+
+// resizes an 8-bit grey or RGB image to fit in width x height with box_downscale()
+static int box_resize(VipsImage* image, uint16_t width, uint16_t height, VipsImage** out)
+{
+    const int src_width  = vips_image_get_width(image);
+    const int src_height = vips_image_get_height(image);
+    const int bands      = vips_image_get_bands(image);
+    if (vips_image_get_format(image) != VIPS_FORMAT_UCHAR || (bands != 1 && bands != 3)) {
+        return ERR_IMGLIB;
+    }
+    // fit inside, as vips_thumbnail_image() does
+    const double scale = MIN((double) width / src_width, (double) height / src_height);
+    if (scale >= 1) {
+        return ERR_IMGLIB;
+    }
+    const size_t dst_width  = (size_t) MAX(src_width  * scale + 0.5, 1);
+    const size_t dst_height = (size_t) MAX(src_height * scale + 0.5, 1);
+    const size_t dst_len    = pixels_len(dst_width, dst_height, (size_t) bands);
+    if (dst_len == 0) {
+        return ERR_IMGLIB;
+    }
+
+    size_t src_len = 0;
+    uint8_t* const src = vips_image_write_to_memory(image, &src_len);
+    uint8_t* const dst = malloc(dst_len);
+    int ret = src == NULL || dst == NULL ? ERR_OUT_OF_MEMORY :
+              src_len != pixels_len((size_t) src_width, (size_t) src_height, (size_t) bands) ? ERR_IMGLIB :
+              box_downscale(src, (size_t) src_width, (size_t) src_height, (size_t) bands, dst, dst_width, dst_height);
+    if (ret == ERR_NONE) {
+        *out = vips_image_new_from_memory_copy(dst, dst_len, (int) dst_width, (int) dst_height, bands, VIPS_FORMAT_UCHAR);
+        ret = *out == NULL ? ERR_IMGLIB : ERR_NONE;
+    }
+    g_free(src);
+    free(dst);
+    return ret;
+}
+
+// the largest factor by which the JPEG decoder can shrink a src_width x src_height image, keeping it larger than width x height
+static int dct_shrink(uint32_t src_width, uint32_t src_height, uint16_t width, uint16_t height)
+{
+    const double scale = MIN((double) width / src_width, (double) height / src_height);
+    int shrink = 8;
+    while (shrink > 1 && shrink * scale > 1) {
+        shrink /= 2;
+    }
+    return shrink;
+}
+
+// decodes a JPEG image only shrunk by the decoder, and turns it upright from its EXIF orientation,
+// as vips_thumbnail_buffer() does
+static int dct_load(void* buffer, size_t size, uint16_t width, uint16_t height, VipsImage** image)
+{
+    uint32_t src_height = 0;
+    uint32_t src_width = 0;
+    if (jpeg_header_resolution(&src_height, &src_width, buffer, size) != ERR_NONE) {
+        return ERR_IMGLIB;
+    }
+    // only the header is read until the pixels are needed
+    const int shrink = dct_shrink(src_width, src_height, width, height);
+    VipsImage* loaded = NULL;
+    if (vips_jpegload_buffer(buffer, size, &loaded, "shrink", shrink, NULL) == -1) {
+        return ERR_IMGLIB;
+    }
+    int orientation = 1;
+    if (vips_image_get_typeof(loaded, VIPS_META_ORIENTATION) != 0 &&
+        vips_image_get_int(loaded, VIPS_META_ORIENTATION, &orientation) == -1) {
+        orientation = 1;
+    }
+    // orientations 5 to 8 turn it by a quarter: the sides it must stay larger than are swapped
+    const int upright_shrink = orientation >= 5 ? dct_shrink(src_height, src_width, width, height) : shrink;
+    if (upright_shrink != shrink) {
+        g_object_unref(VIPS_OBJECT(loaded));
+        loaded = NULL;
+        if (vips_jpegload_buffer(buffer, size, &loaded, "shrink", upright_shrink, NULL) == -1) {
+            return ERR_IMGLIB;
+        }
+    }
+    const int ret = vips_autorot(loaded, image, NULL) == -1 ? ERR_IMGLIB : ERR_NONE;
+    g_object_unref(VIPS_OBJECT(loaded));
+    return ret;
+}
+
+int resize_run(struct resize_job* job)
+{
+    M_REQUIRE_NON_NULL(job);
+
+    // the largest resolution is decoded from the source, the others derived from it
+    int largest = -1;
+    int nb_wanted = 0;
+    bool search = false;
+    for (int res = 0; res < NB_RES; ++res) {
+        if (job->width[res] != 0) {
+            ++nb_wanted;
+            search |= job->format == FORMAT_JPEG && job->budget[res] != 0 && job->encoding[res] == 0;
+            if (largest < 0 || (size_t) job->width[res] * job->height[res] >
+                               (size_t) job->width[largest] * job->height[largest]) {
+                largest = res;
+            }
+        }
+    }
+    if (largest < 0) {
+        return ERR_NONE;
+    }
+
+    void* buffer_in = malloc(job->src_size);
+    if (buffer_in == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    for (size_t done = 0; done < job->src_size; ) {
+        const ssize_t ret = pread(job->fd, (char*) buffer_in + done, job->src_size - done,
+                                  (off_t) (job->src_offset + done));
+        if (ret <= 0) {
+            free(buffer_in);
+            return ERR_IO;
+        }
+        done += (size_t) ret;
+    }
+
+    // shrink-on-load: the JPEG decoder downscales in the DCT domain, far cheaper than a full decode;
+    // when the largest resolution is box filtered, it is then resized like the others
+    VipsImage* image = NULL;
+    const bool dct_only = job->box_filter[largest] &&
+                          dct_load(buffer_in, job->src_size, job->width[largest], job->height[largest], &image) == ERR_NONE;
+    if (!dct_only && vips_thumbnail_buffer(buffer_in, job->src_size, &image, job->width[largest],
+                                           "height", job->height[largest], NULL) == -1) {
+        free_all(buffer_in, NULL, NULL, image);
+        return ERR_IMGLIB;
+    }
+    if (nb_wanted > 1 || search) {
+        // decoded once, rather than once per resolution or per encoding tried
+        VipsImage* in_memory = vips_image_copy_memory(image);
+        g_object_unref(VIPS_OBJECT(image));
+        image = in_memory;
+        if (image == NULL) {
+            free(buffer_in);
+            return ERR_IMGLIB;
+        }
+    }
+
+    int ret = ERR_NONE;
+    for (int res = 0; ret == ERR_NONE && res < NB_RES; ++res) {
+        if (job->width[res] == 0) {
+            continue;
+        }
+        VipsImage* resized = image;
+        if ((res != largest || dct_only) &&
+            !(job->box_filter[res] && box_resize(image, job->width[res], job->height[res], &resized) == ERR_NONE) &&
+            vips_thumbnail_image(image, &resized, job->width[res], "height", job->height[res], NULL) == -1) {
+            ret = ERR_IMGLIB;
+        } else {
+            const int saved = job->format == FORMAT_JPEG && job->budget[res] != 0 && job->encoding[res] == 0 ?
+                              save_budget(resized, job->budget[res], &job->encoding[res],
+                                          &job->buffer_out[res], &job->buffer_out_len[res]) :
+                              save_buffer(resized, job->format, job->format == FORMAT_JPEG ? job->encoding[res] : 0,
+                                          &job->buffer_out[res], &job->buffer_out_len[res]);
+            if (saved == -1) {
+                ret = ERR_IMGLIB;
+            }
+            if (resized != image) {
+                g_object_unref(VIPS_OBJECT(resized));
+            }
+        }
+    }
+    free_all(buffer_in, NULL, NULL, image);
+    return ret;
+}
+
+void resize_release(struct resize_job* job)
+{
+    if (job != NULL) {
+        for (int res = 0; res < NB_RES; ++res) {
+            free(job->buffer_out[res]);
+            job->buffer_out[res] = NULL;
+            job->buffer_out_len[res] = 0;
+        }
+    }
+}
+
+int resize_commit(struct resize_job* job, struct imgfs_file* imgfs_file)
+{
+    M_REQUIRE_NON_NULL(job);
+    M_REQUIRE_NON_NULL(imgfs_file);
+    const struct imgfs_header* const header = &imgfs_file->header;
+    struct img_metadata* const metadata     = imgfs_file->metadata + job->index;
+
+    // the image may have been deleted, or its slot reused, while resizing
+    if (job->index >= header->max_files || metadata->is_valid == EMPTY ||
+        memcmp(metadata->SHA, job->SHA, SHA256_DIGEST_LENGTH) != 0) {
+        resize_release(job);
+        return ERR_IMAGE_NOT_FOUND;
+    }
+
+    // the resolutions may have been changed while resizing
+    for (int res = 0; res < ORIG_RES; ++res) {
+        if (job->buffer_out[res] != NULL &&
+            (header->resized_res[2 * res] != job->width[res] ||
+             header->resized_res[2 * res + 1] != job->height[res])) {
+            resize_release(job);
+            return ERR_IMAGE_NOT_FOUND;
+        }
+    }
+
+    int ret = ERR_NONE;
+    bool updated = false;
+    for (int res = 0; res < ORIG_RES; ++res) {
+        // another request may have created it in the meantime: keep the first one
+        if (job->buffer_out[res] == NULL || metadata->size[res] != 0) {
+            continue;
+        }
+        long end = 0;
+        if (fseek(imgfs_file->file, 0, SEEK_END) || (end = ftell(imgfs_file->file)) < 0 ||
+            fwrite(job->buffer_out[res], job->buffer_out_len[res], 1, imgfs_file->file) != 1) {
+            // the ones appended before are still recorded
+            ret = ERR_IO;
+            break;
+        }
+        metadata->offset[res] = (uint64_t) end;
+        metadata->size[res] = (uint32_t) job->buffer_out_len[res];
+        const int encoding_shift = ENCODING_SHIFT + ENCODING_BITS * res;
+        const uint8_t encoding = job->format == FORMAT_JPEG ? job->encoding[res] : 0;
+        metadata->unused_16 = (uint16_t) ((metadata->unused_16 & ~(FORMAT_MASK << (FORMAT_BITS * res)) &
+                                           ~(ENCODING_MASK << encoding_shift)) |
+                                          ((job->format & FORMAT_MASK) << (FORMAT_BITS * res)) |
+                                          ((encoding & ENCODING_MASK) << encoding_shift));
+        updated = true;
+    }
+    resize_release(job);
+    if (updated && (fseek(imgfs_file->file, (long) (sizeof(struct imgfs_header) + job->index * sizeof(struct img_metadata)), SEEK_SET) ||
+                    fwrite(metadata, sizeof(struct img_metadata), 1, imgfs_file->file) != 1 ||
+                    fflush(imgfs_file->file))) {
+        return ERR_IO;
+    }
+    return ret;
 }
 
 int lazily_resize(int resolution, struct imgfs_file *imgfs_file, size_t index)
@@ -19,13 +561,6 @@ int lazily_resize(int resolution, struct imgfs_file *imgfs_file, size_t index)
     // cache header and metadata
     struct imgfs_header* const header   = &imgfs_file->header;
     struct img_metadata* const metadata = imgfs_file->metadata + index;
-    // buffers to load image from disk and to store resized image
-    void* buffer_in = NULL;
-    void* buffer_out = NULL;
-    size_t buffer_out_len = 0;
-    // internal representation of image and resized image in vips
-    VipsImage* image_in = NULL;
-    VipsImage* image_out_resized = NULL;
 
     if (!(0 <= resolution && resolution < NB_RES)) {
         return ERR_RESOLUTIONS;
@@ -37,53 +572,248 @@ int lazily_resize(int resolution, struct imgfs_file *imgfs_file, size_t index)
         return ERR_NONE;
     }
 
-    uint32_t orig_res_size = metadata->size[ORIG_RES];
-    buffer_in = malloc(orig_res_size);
-    if (buffer_in == NULL) {
-        return ERR_OUT_OF_MEMORY;
+    struct resize_job job;
+    int ret = resize_prepare(resolution, imgfs_file, index, &job);
+    if (ret != ERR_NONE) {
+        return ret;
     }
-    if (fseek(imgfs_file->file, (long) metadata->offset[ORIG_RES], SEEK_SET) ||
-        fread(buffer_in, orig_res_size, 1, imgfs_file->file) != 1) {
-        free_all(buffer_in, buffer_out, image_in, image_out_resized);
-        return ERR_IO;
+    ret = resize_run(&job);
+    if (ret != ERR_NONE) {
+        resize_release(&job);
+        return ret;
     }
+    return resize_commit(&job, imgfs_file);
+}
 
-    if (vips_jpegload_buffer(buffer_in, orig_res_size, &image_in, NULL) == -1) {
-        free_all(buffer_in, buffer_out, image_in, image_out_resized);
-        return ERR_IMGLIB;
+// an image of do_reresize(); the images of a same content are sorted next to each other
+struct reresize_image {
+    const unsigned char* SHA;
+    size_t index;
+    int format; // of its resized versions, kept
+};
+
+// shared by the threads of do_reresize()
+struct reresize {
+    pthread_mutex_t mutex; // exclusive access to imgfs_file and to the fields below
+    struct imgfs_file* imgfs_file;
+    const struct reresize_image* images;
+    size_t nb_images;
+    size_t next;           // first image of the next content to resize
+    size_t nb_resized;
+    int ret;               // first error met
+};
+
+static int compare_images(const void* a, const void* b)
+{
+    const struct reresize_image* const image_a = a;
+    const struct reresize_image* const image_b = b;
+    const int cmp = memcmp(image_a->SHA, image_b->SHA, SHA256_DIGEST_LENGTH);
+    return cmp != 0 ? cmp : (image_a->index > image_b->index) - (image_a->index < image_b->index);
+}
+
+// the images with the same content share its resized versions
+static int share_resized(struct imgfs_file* imgfs_file, const struct reresize_image* images, size_t count)
+{
+    const struct img_metadata* const source = imgfs_file->metadata + images[0].index;
+    for (size_t i = 1; i < count; ++i) {
+        struct img_metadata* const metadata = imgfs_file->metadata + images[i].index;
+        for (int res = 0; res < ORIG_RES; ++res) {
+            metadata->offset[res] = source->offset[res];
+            metadata->size[res]   = source->size[res];
+        }
+        metadata->unused_16 = source->unused_16;
+        if (fseek(imgfs_file->file, (long) (sizeof(struct imgfs_header) + images[i].index * sizeof(struct img_metadata)), SEEK_SET) ||
+            fwrite(metadata, sizeof(struct img_metadata), 1, imgfs_file->file) != 1) {
+            return ERR_IO;
+        }
     }
-    if (vips_thumbnail_image(image_in, &image_out_resized, header->resized_res[2 * resolution],
-                             "height", header->resized_res[2 * resolution + 1], NULL) == -1) {
-        free_all(buffer_in, buffer_out, image_in, image_out_resized);
-        return ERR_IMGLIB;
+    return ERR_NONE;
+}
+
+static void* reresize_worker(void* arg)
+{
+    struct reresize* const reresize = arg;
+    struct imgfs_file* const imgfs_file = reresize->imgfs_file;
+
+    pthread_mutex_lock(&reresize->mutex);
+    while (reresize->next < reresize->nb_images) {
+        const struct reresize_image* const images = reresize->images + reresize->next;
+        size_t count = 1;
+        while (reresize->next + count < reresize->nb_images &&
+               memcmp(images[count].SHA, images[0].SHA, SHA256_DIGEST_LENGTH) == 0) {
+            ++count;
+        }
+        reresize->next += count;
+
+        // released below even if it is not prepared
+        struct resize_job job;
+        zero_init_var(job);
+        int ret = resize_prepare_all(imgfs_file, images[0].index, &job);
+        job.format = images[0].format;
+        pthread_mutex_unlock(&reresize->mutex);
+        if (ret == ERR_NONE) {
+            ret = resize_run(&job);
+        }
+        pthread_mutex_lock(&reresize->mutex);
+
+        if (ret == ERR_NONE) {
+            ret = resize_commit(&job, imgfs_file);
+        } else {
+            resize_release(&job);
+        }
+        if (ret == ERR_NONE) {
+            ret = share_resized(imgfs_file, images, count);
+        }
+        if (ret == ERR_NONE) {
+            reresize->nb_resized += count;
+        } else if (reresize->ret == ERR_NONE) {
+            reresize->ret = ret;
+        }
     }
+    pthread_mutex_unlock(&reresize->mutex);
+    return NULL;
+}
 
-    if (vips_jpegsave_buffer(image_out_resized, &buffer_out, &buffer_out_len, NULL) == -1) {
-        free_all(buffer_in, buffer_out, image_in, image_out_resized);
-        return ERR_IMGLIB;
+int do_reresize(const uint16_t resized_res[2 * (NB_RES - 1)], size_t nb_threads,
+                struct imgfs_file* imgfs_file, size_t* nb_images)
+{
+    M_REQUIRE_NON_NULL(resized_res);
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(nb_images);
+    struct imgfs_header* const header = &imgfs_file->header;
+
+    for (int i = 0; i < 2 * (NB_RES - 1); ++i) {
+        if (resized_res[i] == 0) {
+            return ERR_RESOLUTIONS;
+        }
     }
-    if (fseek(imgfs_file->file, 0, SEEK_END)) {
-        free_all(buffer_in, buffer_out, image_in, image_out_resized);
-        return ERR_IO;
+    struct reresize_image* images = calloc(MAX(header->nb_files, 1), sizeof(struct reresize_image));
+    if (images == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    size_t count = 0;
+    for (size_t i = 0; i < header->max_files && count < header->nb_files; ++i) {
+        struct img_metadata* const metadata = imgfs_file->metadata + i;
+        if (metadata->is_valid == EMPTY) {
+            continue;
+        }
+        images[count].SHA    = metadata->SHA;
+        images[count].index  = i;
+        images[count].format = (int) GET_FORMAT(metadata, metadata->size[SMALL_RES] != 0 ? SMALL_RES : THUMB_RES);
+        ++count;
+        for (int res = 0; res < ORIG_RES; ++res) {
+            metadata->offset[res] = 0;
+            metadata->size[res]   = 0;
+        }
+        // the encodings found for the former resolutions no longer apply
+        metadata->unused_16 &= (uint16_t) ~(((1 << (ENCODING_BITS * ORIG_RES)) - 1) << ENCODING_SHIFT);
     }
-    uint64_t offset = (uint64_t)imgfs_file->file->_offset;
+    qsort(images, count, sizeof(struct reresize_image), compare_images);
 
-    if (fwrite(buffer_out, buffer_out_len, 1, imgfs_file->file) != 1) {
-        free_all(buffer_in, buffer_out, image_in, image_out_resized);
+    // from now on, the resized versions missing are created on first read
+    memcpy(header->resized_res, resized_res, sizeof(header->resized_res));
+    if (fseek(imgfs_file->file, 0, SEEK_SET) ||
+        fwrite(header, sizeof(struct imgfs_header), 1, imgfs_file->file) != 1 ||
+        fwrite(imgfs_file->metadata, sizeof(struct img_metadata), header->max_files, imgfs_file->file) != header->max_files ||
+        fflush(imgfs_file->file)) {
+        free(images);
         return ERR_IO;
     }
-    free_all(buffer_in, buffer_out, image_in, image_out_resized);
-    metadata->offset[resolution] = offset;
-    metadata->size[resolution] = (uint32_t) buffer_out_len;
-    if (fseek(imgfs_file->file, (signed) (sizeof(struct imgfs_header) + index * sizeof(struct img_metadata)), SEEK_SET) ||
-        fwrite(metadata, sizeof(struct img_metadata), 1, imgfs_file->file) != 1) {
-        return ERR_IO;
+
+    struct reresize reresize = { .imgfs_file = imgfs_file, .images = images, .nb_images = count };
+    if (pthread_mutex_init(&reresize.mutex, NULL)) {
+        free(images);
+        return ERR_THREADING;
     }
-    return ERR_NONE;
+    // the calling thread is one of them
+    pthread_t* threads = calloc(MAX(nb_threads, 1), sizeof(pthread_t));
+    size_t nb_started = 0;
+    for (; threads != NULL && nb_started + 1 < nb_threads; ++nb_started) {
+        if (pthread_create(&threads[nb_started], NULL, reresize_worker, &reresize)) {
+            break;
+        }
+    }
+    reresize_worker(&reresize);
+    for (size_t i = 0; i < nb_started; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+    pthread_mutex_destroy(&reresize.mutex);
+    free(images);
 
+    *nb_images = reresize.nb_resized;
+    if (reresize.ret == ERR_NONE && fflush(imgfs_file->file)) {
+        return ERR_IO;
+    }
+    return reresize.ret;
 }
 
 
+// JPEG markers
+#define JPEG_MARKER 0xFF
+#define JPEG_SOI 0xD8   // start of image
+#define JPEG_EOI 0xD9   // end of image
+#define JPEG_SOS 0xDA   // start of scan: the image data follows
+#define JPEG_SOF0 0xC0  // start of frame, 0xC0 to 0xCF except the three below
+#define JPEG_SOF15 0xCF
+#define JPEG_DHT 0xC4
+#define JPEG_JPG 0xC8
+#define JPEG_DAC 0xCC
+#define JPEG_TEM 0x01   // markers without a segment: TEM and RST0 to RST7
+#define JPEG_RST0 0xD0
+#define JPEG_RST7 0xD7
+
+int jpeg_header_resolution(uint32_t *height, uint32_t *width,
+                           const char *image_buffer, size_t image_size)
+{
+    M_REQUIRE_NON_NULL(height);
+    M_REQUIRE_NON_NULL(width);
+    M_REQUIRE_NON_NULL(image_buffer);
+
+    const unsigned char* const buffer = (const unsigned char*) image_buffer;
+    if (image_size < 4 || buffer[0] != JPEG_MARKER || buffer[1] != JPEG_SOI) {
+        return ERR_IMGLIB;
+    }
+    size_t pos = 2;
+    while (pos + 4 <= image_size) {
+        if (buffer[pos] != JPEG_MARKER) {
+            return ERR_IMGLIB;
+        }
+        // any number of fill bytes may precede a marker
+        while (pos + 1 < image_size && buffer[pos + 1] == JPEG_MARKER) {
+            ++pos;
+        }
+        if (pos + 4 > image_size) {
+            break;
+        }
+        const unsigned char marker = buffer[pos + 1];
+        if (marker == JPEG_TEM || (marker >= JPEG_RST0 && marker <= JPEG_RST7)) {
+            pos += 2;
+            continue;
+        }
+        if (marker == JPEG_SOS || marker == JPEG_EOI || marker == JPEG_SOI) {
+            break;
+        }
+        const size_t segment_len = (size_t) buffer[pos + 2] << 8 | buffer[pos + 3];
+        if (segment_len < 2) {
+            break;
+        }
+        if (marker >= JPEG_SOF0 && marker <= JPEG_SOF15 &&
+            marker != JPEG_DHT && marker != JPEG_JPG && marker != JPEG_DAC) {
+            // length (2), sample precision (1), number of lines (2), samples per line (2)
+            if (segment_len < 7 || pos + 9 > image_size) {
+                break;
+            }
+            *height = (uint32_t) buffer[pos + 5] << 8 | buffer[pos + 6];
+            *width  = (uint32_t) buffer[pos + 7] << 8 | buffer[pos + 8];
+            // a height of 0 is only given later, after the first scan
+            return *height == 0 || *width == 0 ? ERR_IMGLIB : ERR_NONE;
+        }
+        pos += 2 + segment_len;
+    }
+    return ERR_IMGLIB;
+}
+
 int get_resolution(uint32_t *height, uint32_t *width,
                    const char *image_buffer, size_t image_size)
 {
@@ -91,6 +821,11 @@ int get_resolution(uint32_t *height, uint32_t *width,
     M_REQUIRE_NON_NULL(width);
     M_REQUIRE_NON_NULL(image_buffer);
 
+    // reading the frame header is enough for well-formed files; libvips handles the others
+    if (jpeg_header_resolution(height, width, image_buffer, image_size) == ERR_NONE) {
+        return ERR_NONE;
+    }
+
     VipsImage* original = NULL;
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wcast-qual"
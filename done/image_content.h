@@ -9,6 +9,7 @@
 
 #include "imgfs.h" // for struct imgfs_header, struct img_metadata, struct imgfs_file
 
+#include <stdbool.h>
 #include <stdio.h> // for FILE
 #include <stdint.h> // for uint16_t, uint32_t, uint64_t
 
@@ -26,6 +27,150 @@ extern "C" {
  */
 int get_resolution(uint32_t *height, uint32_t *width, const char *image_buffer, size_t image_size);
 
+/**
+ * @brief Gets the resolution of a JPEG image from its frame header (SOFn
+ *        marker segment), without decoding anything.
+ *
+ * @param height Where to put the image height.
+ * @param width Where to put the image width.
+ * @param image_buffer The JPEG content, or a prefix of it
+ * @param image_size Its size
+ * @return Some error code. 0 if no error; ERR_IMGLIB if no frame header
+ *         was found before the image data.
+ */
+int jpeg_header_resolution(uint32_t *height, uint32_t *width, const char *image_buffer, size_t image_size);
+
+/**
+ * @brief Downscales an 8-bit image by averaging the source pixels each
+ *        destination pixel covers (box filter), using SSE2 or AVX2 when
+ *        the CPU has them.
+ *
+ * Much cheaper than the kernels of libvips, and good enough for small
+ * thumbnails of an image already shrunk by the JPEG decoder.
+ *
+ * @param src The source pixels, bands bytes each, row after row
+ * @param src_width
+ * @param src_height
+ * @param bands Number of bytes per pixel
+ * @param dst Where to put the dst_width x dst_height pixels
+ * @param dst_width At most src_width
+ * @param dst_height At most src_height, and at least a 257th of it
+ * @return Some error code. 0 if no error.
+ */
+int box_downscale(const uint8_t* src, size_t src_width, size_t src_height, size_t bands,
+                  uint8_t* dst, size_t dst_width, size_t dst_height);
+
+// slot of a resize job for a resolution of any size, not stored in the imgFS file
+#define CUSTOM_RES ORIG_RES
+
+/**
+ * @brief Resized images being created, in three phases so that the image
+ *        library work needs no access to the in-memory structure:
+ *        resize_prepare() (snapshot of what is needed), resize_run() (read,
+ *        resize while decoding, and encode), then resize_commit() (append and
+ *        update the metadata). Several resolutions of an image are created
+ *        from a single decode.
+ */
+struct resize_job {
+    size_t index;                            // slot of the image in the metadata array
+    unsigned char SHA[SHA256_DIGEST_LENGTH]; // content the job was prepared for
+    int fd;                                  // imgFS file descriptor, to read the source
+    uint64_t src_offset;                     // image resized from: the original or a larger version
+    uint32_t src_size;
+    int format;                              // FORMAT_* of the created images (JPEG by default)
+    uint16_t width[NB_RES];                  // requested resolutions, 0 if not to be created
+    uint16_t height[NB_RES];                 //   (at CUSTOM_RES: any resolution, never stored)
+    uint32_t budget[NB_RES];                 // maximum size of the created JPEG images, 0 if none
+    uint8_t encoding[NB_RES];                // their encoding (see GET_ENCODING()): recorded, or
+                                             //   found by resize_run() to fit in the budget
+    bool box_filter[NB_RES];                 // resized with box_downscale() rather than by libvips
+    void* buffer_out[NB_RES];                // resized images, once run
+    size_t buffer_out_len[NB_RES];
+};
+
+/**
+ * @brief Snapshots what is needed to create a resized image.
+ *
+ * To be called with exclusive access to imgfs_file.
+ *
+ * @param resolution
+ * @param imgfs_file The main in-memory structure
+ * @param index The index of the image in the metadata array
+ * @param job The job to initialize
+ * @return Some error code. 0 if no error.
+ */
+int resize_prepare(int resolution, struct imgfs_file* imgfs_file, size_t index, struct resize_job* job);
+
+/**
+ * @brief Snapshots what is needed to create all the missing resized
+ *        images of an image at once.
+ *
+ * To be called with exclusive access to imgfs_file.
+ *
+ * @param imgfs_file The main in-memory structure
+ * @param index The index of the image in the metadata array
+ * @param job The job to initialize; it may have nothing to create
+ * @return Some error code. 0 if no error.
+ */
+int resize_prepare_all(struct imgfs_file* imgfs_file, size_t index, struct resize_job* job);
+
+/**
+ * @brief Snapshots what is needed to create a version of an image that
+ *        fits in width x height, not stored in the imgFS file: it is
+ *        left in job->buffer_out[CUSTOM_RES] by resize_run().
+ *
+ * It is made from the smallest stored version large enough, unless that
+ * version is neither JPEG nor of the given format: a JPEG fallback of a
+ * WebP or AVIF store is made from the original rather than transcoded.
+ *
+ * To be called with exclusive access to imgfs_file.
+ *
+ * @param width
+ * @param height
+ * @param format The FORMAT_* of the version made
+ * @param imgfs_file The main in-memory structure
+ * @param index The index of the image in the metadata array
+ * @param job The job to initialize
+ * @return Some error code. 0 if no error.
+ */
+int resize_prepare_custom(uint16_t width, uint16_t height, int format, struct imgfs_file* imgfs_file,
+                          size_t index, struct resize_job* job);
+
+/**
+ * @brief Reads the source image and creates the requested resized versions.
+ *
+ * A JPEG image with a budget and no recorded encoding gets the highest
+ * quality that fits in it, which is left in job->encoding.
+ *
+ * Does not use the in-memory structure: can run without any lock, as
+ * stored content never moves.
+ *
+ * @param job A prepared job
+ * @return Some error code. 0 if no error.
+ */
+int resize_run(struct resize_job* job);
+
+/**
+ * @brief Appends the resized images to the imgFS file and updates the
+ *        metadata on the disk, except for the ones created meanwhile, or
+ *        if the image changed. The job is released in all cases.
+ *
+ * To be called with exclusive access to imgfs_file.
+ *
+ * @param job A job that was run
+ * @param imgfs_file The main in-memory structure
+ * @return Some error code. 0 if no error (including when the resized
+ *         versions already existed).
+ */
+int resize_commit(struct resize_job* job, struct imgfs_file* imgfs_file);
+
+/**
+ * @brief Releases a job that will not be committed.
+ *
+ * @param job The job
+ */
+void resize_release(struct resize_job* job);
+
 /**
  * @brief Calls the create_resized_img function and updates the metadata on the disk
  *
@@ -36,6 +181,23 @@ int get_resolution(uint32_t *height, uint32_t *width, const char *image_buffer,
  */
 int lazily_resize(int resolution, struct imgfs_file* imgfs_file, size_t index);
 
+/**
+ * @brief Changes the resolutions of the thumbnails and small images, and
+ *        recreates all of them on several threads, decoding each distinct
+ *        content once and appending the results one after the other.
+ *
+ * The new resolutions are written first and the stored versions forgotten,
+ * so that the ones not recreated (e.g. on error) are created on first read.
+ *
+ * @param resized_res The new resolutions, as in struct imgfs_header
+ * @param nb_threads Number of threads resizing
+ * @param imgfs_file The main in-memory structure
+ * @param nb_images Where to put the number of images resized
+ * @return Some error code. 0 if no error.
+ */
+int do_reresize(const uint16_t resized_res[2 * (NB_RES - 1)], size_t nb_threads,
+                struct imgfs_file* imgfs_file, size_t* nb_images);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,416 @@
+#include "image_content.h"
+#include "util.h"
+#include "error.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <check.h>
+#include <vips/vips.h>
+
+// upright, 1200x800
+#define LANDSCAPE_JPEG "../provided/tests/data/papillon.jpg"
+#define THUMB_SIZE 64
+
+// the largest ratio of heights box_downscale() takes: that many rows of 255 sum to UINT16_MAX
+#define BOX_MAX_ROWS 257
+
+// EXIF orientations
+#define UPRIGHT 1
+#define QUARTER_TURN 6 // to be turned by 90 degrees clockwise: 800x1200 once upright
+
+// the content of LANDSCAPE_JPEG, saved again with the given EXIF orientation, in a temporary file
+static FILE* oriented_jpeg(int orientation, size_t* size){
+  VipsImage* image = NULL;
+  VipsImage* copy = NULL;
+  void* buffer = NULL;
+  ck_assert_int_eq(vips_jpegload(LANDSCAPE_JPEG, &image, NULL), 0);
+  ck_assert_int_eq(vips_copy(image, &copy, NULL), 0);
+  vips_image_set_int(copy, VIPS_META_ORIENTATION, orientation);
+  ck_assert_int_eq(vips_jpegsave_buffer(copy, &buffer, size, NULL), 0);
+
+  FILE* file = tmpfile();
+  ck_assert_ptr_nonnull(file);
+  ck_assert_int_eq(fwrite(buffer, *size, 1, file), 1);
+  ck_assert_int_eq(fflush(file), 0);
+  g_free(buffer);
+  g_object_unref(VIPS_OBJECT(copy));
+  g_object_unref(VIPS_OBJECT(image));
+  return file;
+}
+
+// the whole content of a file
+static char* read_file(const char* filename, size_t* size){
+  FILE* const file = fopen(filename, "rb");
+  ck_assert_ptr_nonnull(file);
+  ck_assert_int_eq(fseek(file, 0, SEEK_END), 0);
+  const long len = ftell(file);
+  ck_assert_int_lt(0, len);
+  rewind(file);
+  *size = (size_t) len;
+  char* const content = malloc(*size);
+  ck_assert_ptr_nonnull(content);
+  ck_assert_int_eq(fread(content, *size, 1, file), 1);
+  fclose(file);
+  return content;
+}
+
+// the resolution of the thumbnail resize_run() makes of an image of the given orientation
+static void thumb_resolution(int orientation, bool box_filter, int* width, int* height){
+  struct resize_job job;
+  zero_init_var(job);
+  size_t size = 0;
+  FILE* file = oriented_jpeg(orientation, &size);
+  job.fd = fileno(file);
+  job.src_size = (uint32_t) size;
+  job.format = FORMAT_JPEG;
+  job.width[THUMB_RES] = THUMB_SIZE;
+  job.height[THUMB_RES] = THUMB_SIZE;
+  job.box_filter[THUMB_RES] = box_filter;
+
+  ck_assert_int_eq(resize_run(&job), ERR_NONE);
+  VipsImage* thumb = NULL;
+  ck_assert_int_eq(vips_jpegload_buffer(job.buffer_out[THUMB_RES], job.buffer_out_len[THUMB_RES],
+                                        &thumb, NULL), 0);
+  *width = vips_image_get_width(thumb);
+  *height = vips_image_get_height(thumb);
+  g_object_unref(VIPS_OBJECT(thumb));
+  resize_release(&job);
+  fclose(file);
+}
+
+// the parts of a JPEG header: a frame header of 600x800 (then 3 components), and
+// other segments, which would give 256x256 if read as one
+#define SOI 0xFF, 0xD8
+#define APP0 0xFF, 0xE0, 0x00, 0x06, 'J', 'F', 'I', 'F'
+#define SOF(marker, height) 0xFF, marker, 0x00, 0x11, 0x08, height, 0x03, 0x20, 0x03
+#define SEGMENT(marker) 0xFF, marker, 0x00, 0x08, 0x08, 0x01, 0x00, 0x01, 0x00, 0x00
+#define SOS 0xFF, 0xDA, 0x00, 0x08
+#define JPEG_HEIGHT 600
+#define JPEG_WIDTH 800
+#define H600 0x02, 0x58 // 600 on two bytes
+#define H0 0x00, 0x00
+
+// jpeg_header_resolution() of an array
+#define HEADER_RESOLUTION(bytes, height, width) \
+  jpeg_header_resolution(height, width, (const char*) (bytes), sizeof(bytes))
+
+// the resolution read from a header, which must be valid
+static void check_resolution(const unsigned char* header, size_t size){
+  uint32_t height = 0;
+  uint32_t width = 0;
+  ck_assert_int_eq(jpeg_header_resolution(&height, &width, (const char*) header, size), ERR_NONE);
+  ck_assert_int_eq(height, JPEG_HEIGHT);
+  ck_assert_int_eq(width, JPEG_WIDTH);
+}
+
+// TEST : jpeg_header_resolution
+// ==================================================
+START_TEST(test_jpeg_header_frame){
+  const unsigned char baseline[] = { SOI, APP0, SOF(0xC0, H600), SOS };
+  const unsigned char extended[] = { SOI, SOF(0xC1, H600) };
+  const unsigned char progressive[] = { SOI, APP0, SOF(0xC2, H600), SOS };
+  check_resolution(baseline, sizeof(baseline));
+  check_resolution(extended, sizeof(extended));
+  check_resolution(progressive, sizeof(progressive));
+} END_TEST
+
+START_TEST(test_jpeg_header_not_frames){
+  // the markers among SOF0 to SOF15 that do not start a frame are skipped
+  const unsigned char tables[] = { SOI, SEGMENT(0xC4), SEGMENT(0xCC), SEGMENT(0xC8), SOF(0xC2, H600) };
+  check_resolution(tables, sizeof(tables));
+  // as are the markers without a segment
+  const unsigned char restart[] = { SOI, 0xFF, 0xD0, 0xFF, 0x01, SOF(0xC0, H600) };
+  check_resolution(restart, sizeof(restart));
+
+  uint32_t height = 0;
+  uint32_t width = 0;
+  const unsigned char no_frame[] = { SOI, SEGMENT(0xC4), SOS, SOF(0xC0, H600) };
+  ck_assert_int_eq(HEADER_RESOLUTION(no_frame, &height, &width), ERR_IMGLIB);
+} END_TEST
+
+START_TEST(test_jpeg_header_fill_bytes){
+  const unsigned char fill[] = { SOI, 0xFF, 0xFF, 0xFF, APP0, 0xFF, 0xFF, SOF(0xC0, H600) };
+  check_resolution(fill, sizeof(fill));
+
+  uint32_t height = 0;
+  uint32_t width = 0;
+  // nothing but fill bytes until the end
+  const unsigned char only_fill[] = { SOI, APP0, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF };
+  ck_assert_int_eq(HEADER_RESOLUTION(only_fill, &height, &width), ERR_IMGLIB);
+} END_TEST
+
+START_TEST(test_jpeg_header_zero_height){
+  uint32_t height = 0;
+  uint32_t width = 0;
+  // the height is then given by a DNL segment after the first scan
+  const unsigned char dnl[] = { SOI, SOF(0xC0, H0), SOS };
+  ck_assert_int_eq(HEADER_RESOLUTION(dnl, &height, &width), ERR_IMGLIB);
+} END_TEST
+
+START_TEST(test_jpeg_header_truncated){
+  uint32_t height = 0;
+  uint32_t width = 0;
+  const unsigned char header[] = { SOI, APP0, SOF(0xC0, H600) };
+  // cut anywhere before the end of the width of the frame header
+  for (size_t size = 0; size < sizeof(header) - 1; ++size) {
+    ck_assert_int_eq(jpeg_header_resolution(&height, &width, (const char*) header, size), ERR_IMGLIB);
+  }
+  check_resolution(header, sizeof(header) - 1);
+
+  // a segment longer than what is left
+  const unsigned char too_long[] = { SOI, 0xFF, 0xE0, 0x7F, 0xFF, SOF(0xC0, H600) };
+  ck_assert_int_eq(HEADER_RESOLUTION(too_long, &height, &width), ERR_IMGLIB);
+  // or that ends within the next one
+  const unsigned char hiding[] = { SOI, 0xFF, 0xE0, 0x00, 0x04, SOF(0xC0, H600) };
+  ck_assert_int_eq(HEADER_RESOLUTION(hiding, &height, &width), ERR_IMGLIB);
+  // a frame header too short for its resolution
+  const unsigned char short_frame[] = { SOI, 0xFF, 0xC0, 0x00, 0x05, 0x08, 0x02, 0x58, 0x03, 0x20 };
+  ck_assert_int_eq(HEADER_RESOLUTION(short_frame, &height, &width), ERR_IMGLIB);
+  // a length that does not even count itself
+  const unsigned char no_length[] = { SOI, 0xFF, 0xE0, 0x00, 0x01, SOF(0xC0, H600) };
+  ck_assert_int_eq(HEADER_RESOLUTION(no_length, &height, &width), ERR_IMGLIB);
+} END_TEST
+
+START_TEST(test_jpeg_header_not_jpeg){
+  uint32_t height = 0;
+  uint32_t width = 0;
+  const unsigned char png[] = { 0x89, 'P', 'N', 'G', 0x0D, 0x0A, 0x1A, 0x0A };
+  ck_assert_int_eq(HEADER_RESOLUTION(png, &height, &width), ERR_IMGLIB);
+  // garbage where a marker is expected
+  const unsigned char garbage[] = { SOI, 0x00, 0xE0, 0x00, 0x02, SOF(0xC0, H600) };
+  ck_assert_int_eq(HEADER_RESOLUTION(garbage, &height, &width), ERR_IMGLIB);
+  ck_assert_int_eq(jpeg_header_resolution(NULL, &width, (const char*) png, sizeof(png)), ERR_INVALID_ARGUMENT);
+} END_TEST
+
+START_TEST(test_jpeg_header_file){
+  size_t size = 0;
+  char* const content = read_file(LANDSCAPE_JPEG, &size);
+  uint32_t height = 0;
+  uint32_t width = 0;
+  ck_assert_int_eq(jpeg_header_resolution(&height, &width, content, size), ERR_NONE);
+  ck_assert_int_eq(height, 800);
+  ck_assert_int_eq(width, 1200);
+  free(content);
+} END_TEST
+
+Suite* jpeg_header_tests(void) {
+  Suite *s = suite_create("JPEG Header Tests");
+  TCase *tc_resolution = tcase_create("Resolution");
+
+  tcase_add_test(tc_resolution, test_jpeg_header_frame);
+  tcase_add_test(tc_resolution, test_jpeg_header_not_frames);
+  tcase_add_test(tc_resolution, test_jpeg_header_fill_bytes);
+  tcase_add_test(tc_resolution, test_jpeg_header_zero_height);
+  tcase_add_test(tc_resolution, test_jpeg_header_truncated);
+  tcase_add_test(tc_resolution, test_jpeg_header_not_jpeg);
+  tcase_add_test(tc_resolution, test_jpeg_header_file);
+  suite_add_tcase(s, tc_resolution);
+
+  return s;
+}
+
+// pixels of no particular pattern, the same at each run
+static uint8_t* random_pixels(size_t width, size_t height, size_t bands){
+  const size_t len = width * height * bands;
+  uint8_t* const pixels = malloc(len);
+  ck_assert_ptr_nonnull(pixels);
+  uint32_t state = 2463534242u;
+  for (size_t i = 0; i < len; ++i) {
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    pixels[i] = (uint8_t) state;
+  }
+  return pixels;
+}
+
+// box_downscale() pixel by pixel: the rounded mean of the source pixels each one covers
+static void naive_downscale(const uint8_t* src, size_t src_width, size_t src_height, size_t bands,
+                            uint8_t* dst, size_t dst_width, size_t dst_height){
+  for (size_t y = 0; y < dst_height; ++y) {
+    for (size_t x = 0; x < dst_width; ++x) {
+      const size_t y0 = y * src_height / dst_height;
+      const size_t y1 = (y + 1) * src_height / dst_height;
+      const size_t x0 = x * src_width / dst_width;
+      const size_t x1 = (x + 1) * src_width / dst_width;
+      const size_t count = (x1 - x0) * (y1 - y0);
+      for (size_t band = 0; band < bands; ++band) {
+        size_t sum = 0;
+        for (size_t row = y0; row < y1; ++row) {
+          for (size_t col = x0; col < x1; ++col) {
+            sum += src[(row * src_width + col) * bands + band];
+          }
+        }
+        dst[(y * dst_width + x) * bands + band] = (uint8_t) ((sum + count / 2) / count);
+      }
+    }
+  }
+}
+
+// box_downscale() gives the same pixels as naive_downscale()
+static void check_downscale(size_t src_width, size_t src_height, size_t bands,
+                            size_t dst_width, size_t dst_height){
+  uint8_t* const src = random_pixels(src_width, src_height, bands);
+  const size_t dst_len = dst_width * dst_height * bands;
+  uint8_t* const dst = malloc(dst_len);
+  uint8_t* const expected = malloc(dst_len);
+  ck_assert_ptr_nonnull(dst);
+  ck_assert_ptr_nonnull(expected);
+
+  ck_assert_int_eq(box_downscale(src, src_width, src_height, bands, dst, dst_width, dst_height), ERR_NONE);
+  naive_downscale(src, src_width, src_height, bands, expected, dst_width, dst_height);
+  for (size_t i = 0; i < dst_len; ++i) {
+    ck_assert_int_eq(dst[i], expected[i]);
+  }
+  free(expected);
+  free(dst);
+  free(src);
+}
+
+// TEST : box_downscale
+// ==================================================
+START_TEST(test_box_downscale_integer_ratio){
+  check_downscale(64, 48, 1, 16, 12);
+  check_downscale(64, 48, 3, 8, 6);
+} END_TEST
+
+START_TEST(test_box_downscale_non_integer_ratio){
+  check_downscale(37, 23, 1, 10, 7);
+  check_downscale(1200, 800, 3, 333, 222);
+  check_downscale(101, 99, 3, 100, 98);
+} END_TEST
+
+START_TEST(test_box_downscale_single_row_or_column){
+  check_downscale(1, 200, 1, 1, 13);
+  check_downscale(1, 200, 3, 1, 1);
+  check_downscale(200, 1, 1, 13, 1);
+  check_downscale(200, 1, 3, 1, 1);
+} END_TEST
+
+START_TEST(test_box_downscale_bands){
+  // the tails of the rows left to the scalar code, whatever the vector width
+  check_downscale(97, 61, 3, 31, 17);
+  check_downscale(97, 61, 4, 31, 17);
+  check_downscale(1, 1, 4, 1, 1);
+} END_TEST
+
+START_TEST(test_box_downscale_row_limit){
+  uint8_t* const src = malloc(2 * (BOX_MAX_ROWS + 1));
+  ck_assert_ptr_nonnull(src);
+  uint8_t dst[2];
+  // as many white rows as fit in the 16-bit sums
+  memset(src, UINT8_MAX, 2 * (BOX_MAX_ROWS + 1));
+  ck_assert_int_eq(box_downscale(src, 2, BOX_MAX_ROWS, 1, dst, 2, 1), ERR_NONE);
+  ck_assert_int_eq(dst[0], UINT8_MAX);
+  ck_assert_int_eq(dst[1], UINT8_MAX);
+  ck_assert_int_eq(box_downscale(src, 2, BOX_MAX_ROWS + 1, 1, dst, 2, 1), ERR_INVALID_ARGUMENT);
+  free(src);
+
+  check_downscale(3, 2 * BOX_MAX_ROWS, 3, 1, 2);
+} END_TEST
+
+START_TEST(test_box_downscale_invalid){
+  uint8_t src[4 * 4 * 3] = { 0 };
+  uint8_t dst[4 * 4 * 3];
+  ck_assert_int_eq(box_downscale(NULL, 4, 4, 3, dst, 2, 2), ERR_INVALID_ARGUMENT);
+  ck_assert_int_eq(box_downscale(src, 4, 4, 3, NULL, 2, 2), ERR_INVALID_ARGUMENT);
+  ck_assert_int_eq(box_downscale(src, 4, 4, 0, dst, 2, 2), ERR_INVALID_ARGUMENT);
+  ck_assert_int_eq(box_downscale(src, 4, 4, 3, dst, 0, 2), ERR_INVALID_ARGUMENT);
+  ck_assert_int_eq(box_downscale(src, 4, 4, 3, dst, 2, 0), ERR_INVALID_ARGUMENT);
+  // no upscaling
+  ck_assert_int_eq(box_downscale(src, 4, 4, 3, dst, 5, 2), ERR_INVALID_ARGUMENT);
+  ck_assert_int_eq(box_downscale(src, 4, 4, 3, dst, 2, 5), ERR_INVALID_ARGUMENT);
+} END_TEST
+
+Suite* box_downscale_tests(void) {
+  Suite *s = suite_create("Box Downscale Tests");
+  TCase *tc_naive = tcase_create("Naive");
+
+  tcase_add_test(tc_naive, test_box_downscale_integer_ratio);
+  tcase_add_test(tc_naive, test_box_downscale_non_integer_ratio);
+  tcase_add_test(tc_naive, test_box_downscale_single_row_or_column);
+  tcase_add_test(tc_naive, test_box_downscale_bands);
+  tcase_add_test(tc_naive, test_box_downscale_row_limit);
+  tcase_add_test(tc_naive, test_box_downscale_invalid);
+  suite_add_tcase(s, tc_naive);
+
+  return s;
+}
+
+// TEST : resize_run
+// ==================================================
+START_TEST(test_resize_run_upright){
+  int width = 0;
+  int height = 0;
+
+  thumb_resolution(UPRIGHT, false, &width, &height);
+  ck_assert_int_eq(width, THUMB_SIZE);
+  ck_assert_int_lt(height, THUMB_SIZE);
+  thumb_resolution(UPRIGHT, true, &width, &height);
+  ck_assert_int_eq(width, THUMB_SIZE);
+  ck_assert_int_lt(height, THUMB_SIZE);
+} END_TEST
+
+START_TEST(test_resize_run_orientation_libvips){
+  int width = 0;
+  int height = 0;
+
+  thumb_resolution(QUARTER_TURN, false, &width, &height);
+  ck_assert_int_lt(width, THUMB_SIZE);
+  ck_assert_int_eq(height, THUMB_SIZE);
+} END_TEST
+
+START_TEST(test_resize_run_orientation_box_filter){
+  int width = 0;
+  int height = 0;
+  int vips_width = 0;
+  int vips_height = 0;
+
+  // shrunk by the JPEG decoder, then box filtered: turned upright as by libvips
+  thumb_resolution(QUARTER_TURN, true, &width, &height);
+  thumb_resolution(QUARTER_TURN, false, &vips_width, &vips_height);
+  ck_assert_int_eq(width, vips_width);
+  ck_assert_int_eq(height, vips_height);
+} END_TEST
+
+Suite* resize_run_tests(void) {
+  Suite *s = suite_create("Resize Run Tests");
+  TCase *tc_orientation = tcase_create("Orientation");
+
+  tcase_add_test(tc_orientation, test_resize_run_upright);
+  tcase_add_test(tc_orientation, test_resize_run_orientation_libvips);
+  tcase_add_test(tc_orientation, test_resize_run_orientation_box_filter);
+  suite_add_tcase(s, tc_orientation);
+
+  return s;
+}
+
+int main(int argc, char* argv[]) {
+  (void) argc;
+  if (VIPS_INIT(argv[0])) {
+    vips_error_exit(NULL);
+  }
+  int number_failed = 0;
+  Suite *s = resize_run_tests();
+  SRunner *sr = srunner_create(s);
+  // libvips is not meant to be used across fork()
+  srunner_set_fork_status(sr, CK_NOFORK);
+  srunner_run_all(sr, CK_NORMAL);
+  number_failed += srunner_ntests_failed(sr);
+  srunner_free(sr);
+
+  s = jpeg_header_tests();
+  sr = srunner_create(s);
+  srunner_run_all(sr, CK_NORMAL);
+  number_failed += srunner_ntests_failed(sr);
+  srunner_free(sr);
+
+  s = box_downscale_tests();
+  sr = srunner_create(s);
+  srunner_run_all(sr, CK_NORMAL);
+  number_failed += srunner_ntests_failed(sr);
+  srunner_free(sr);
+
+  vips_shutdown();
+  return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -31,6 +31,7 @@ int do_name_and_content_dedup(struct imgfs_file *imgfs_file, uint32_t index)
                 target_metadata->size[THUMB_RES] = metadata->size[THUMB_RES];
                 target_metadata->size[SMALL_RES] = metadata->size[SMALL_RES];
                 target_metadata->size[ORIG_RES ] = metadata->size[ORIG_RES ];
+                target_metadata->unused_16 = metadata->unused_16; // formats of the resized images
             }
 
         }
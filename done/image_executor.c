@@ -0,0 +1,158 @@
+/*
+ * @file image_executor.c
+ * @brief Fixed pool of threads doing the image processing of the server.
+ */
+
+#include "image_executor.h"
+#include "error.h"
+#include "util.h"
+
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <unistd.h> // sysconf
+#include <vips/vips.h>
+
+// a job waiting for its result, on the stack of its caller
+struct executor_job {
+    executor_task task;
+    void* arg;
+    int ret;
+    bool done;
+    pthread_cond_t done_cond;
+    struct executor_job* next;
+};
+
+static struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t not_empty;
+    // the jobs waiting for a thread, oldest first
+    struct executor_job* first;
+    struct executor_job* last;
+    size_t count;
+    size_t max_queued;
+    pthread_t* threads;
+    size_t nb_threads;
+    bool started;
+    bool stopping;
+} executor = { .mutex = PTHREAD_MUTEX_INITIALIZER, .not_empty = PTHREAD_COND_INITIALIZER };
+
+static void* executor_thread(void* arg _unused)
+{
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT );
+    sigaddset(&mask, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+    pthread_mutex_lock(&executor.mutex);
+    for (;;) {
+        while (executor.count == 0 && !executor.stopping) {
+            pthread_cond_wait(&executor.not_empty, &executor.mutex);
+        }
+        // when stopping, the queued jobs are still done: their callers wait for them
+        if (executor.count == 0) {
+            break;
+        }
+        struct executor_job* const job = executor.first;
+        executor.first = job->next;
+        if (executor.first == NULL) {
+            executor.last = NULL;
+        }
+        --executor.count;
+        pthread_mutex_unlock(&executor.mutex);
+
+        const int ret = job->task(job->arg);
+
+        pthread_mutex_lock(&executor.mutex);
+        job->ret  = ret;
+        job->done = true;
+        pthread_cond_signal(&job->done_cond);
+    }
+    pthread_mutex_unlock(&executor.mutex);
+    return NULL;
+}
+
+int executor_start(size_t nb_threads, size_t max_queued)
+{
+    if (executor.started) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    const long nb_cpus = MAX(sysconf(_SC_NPROCESSORS_ONLN), 1);
+    if (nb_threads == 0) {
+        nb_threads = (size_t) nb_cpus;
+    }
+    executor.threads = calloc(nb_threads, sizeof(pthread_t));
+    if (executor.threads == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    // each job only gets its share of the CPUs, so that together they do not oversubscribe them
+    vips_concurrency_set((int) MAX((size_t) nb_cpus / nb_threads, 1));
+    executor.max_queued = max_queued == 0 ? nb_threads : max_queued;
+    executor.stopping = false;
+    executor.started  = true;
+    for (; executor.nb_threads < nb_threads; ++executor.nb_threads) {
+        if (pthread_create(&executor.threads[executor.nb_threads], NULL, executor_thread, NULL)) {
+            executor_stop();
+            return ERR_THREADING;
+        }
+    }
+    return ERR_NONE;
+}
+
+int executor_run(executor_task task, void* arg)
+{
+    M_REQUIRE_NON_NULL(task);
+
+    pthread_mutex_lock(&executor.mutex);
+    if (!executor.started) {
+        pthread_mutex_unlock(&executor.mutex);
+        return task(arg);
+    }
+    if (executor.stopping || executor.count >= executor.max_queued) {
+        pthread_mutex_unlock(&executor.mutex);
+        return ERR_BUSY;
+    }
+    struct executor_job job = { .task = task, .arg = arg, .ret = ERR_NONE, .done = false, .next = NULL };
+    if (pthread_cond_init(&job.done_cond, NULL)) {
+        pthread_mutex_unlock(&executor.mutex);
+        return ERR_THREADING;
+    }
+    if (executor.last != NULL) {
+        executor.last->next = &job;
+    } else {
+        executor.first = &job;
+    }
+    executor.last = &job;
+    ++executor.count;
+    pthread_cond_signal(&executor.not_empty);
+    while (!job.done) {
+        pthread_cond_wait(&job.done_cond, &executor.mutex);
+    }
+    pthread_mutex_unlock(&executor.mutex);
+    pthread_cond_destroy(&job.done_cond);
+    return job.ret;
+}
+
+void executor_stop(void)
+{
+    pthread_mutex_lock(&executor.mutex);
+    if (!executor.started) {
+        pthread_mutex_unlock(&executor.mutex);
+        return;
+    }
+    executor.stopping = true;
+    pthread_cond_broadcast(&executor.not_empty);
+    pthread_mutex_unlock(&executor.mutex);
+
+    for (size_t i = 0; i < executor.nb_threads; ++i) {
+        pthread_join(executor.threads[i], NULL);
+    }
+    pthread_mutex_lock(&executor.mutex);
+    free(executor.threads);
+    executor.threads = NULL;
+    executor.nb_threads = 0;
+    executor.started = false;
+    pthread_mutex_unlock(&executor.mutex);
+}
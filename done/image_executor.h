@@ -0,0 +1,56 @@
+/**
+ * @file image_executor.h
+ * @brief Fixed pool of threads doing the image processing of the server.
+ *
+ * The CPU-bound work of the requests (decoding, resizing, encoding) is
+ * queued to a fixed number of threads rather than done by the connection
+ * threads, and libvips is given as many threads per job as keep all the
+ * CPUs busy without oversubscribing them. The queue is bounded: when it is
+ * full, the work is refused at once rather than piling up.
+ */
+
+#pragma once
+
+#include <stddef.h> // for size_t
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Work done by the executor.
+ *
+ * @param arg As given to executor_run()
+ * @return Some error code. 0 if no error.
+ */
+typedef int (*executor_task)(void* arg);
+
+/**
+ * @brief Starts the threads and sets the concurrency of libvips to match.
+ *
+ * @param nb_threads Number of threads, 0 for one per CPU
+ * @param max_queued Number of jobs that may wait for a thread, 0 for as
+ *        many as there are threads
+ * @return Some error code. 0 if no error.
+ */
+int executor_start(size_t nb_threads, size_t max_queued);
+
+/**
+ * @brief Runs a task on one of the threads and waits for its result. It is
+ *        run by the caller itself if the executor is not started.
+ *
+ * @param task The work to do
+ * @param arg Its argument
+ * @return The result of the task, or ERR_BUSY without running it if the
+ *         queue is full
+ */
+int executor_run(executor_task task, void* arg);
+
+/**
+ * @brief Waits for the queued jobs to be done and stops the threads.
+ */
+void executor_stop(void);
+
+#ifdef __cplusplus
+}
+#endif
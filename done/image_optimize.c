@@ -0,0 +1,152 @@
+/*
+ * @file image_optimize.c
+ * @brief Lossless optimization of the JPEG images stored.
+ */
+
+#include "image_optimize.h"
+#include "error.h"
+#include "util.h"
+
+#include <setjmp.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h> // needed by jpeglib.h
+#include <stdlib.h>
+#include <string.h>
+#include <jpeglib.h>
+
+#define EXIF_ORIENTATION_TAG 0x0112
+#define EXIF_HEADER_SIZE 6 // "Exif\0\0", followed by a TIFF file
+#define EXIF_ENTRY_SIZE 12
+
+// libjpeg reports errors by calling error_exit(), which must not return
+struct optimize_state {
+    struct jpeg_error_mgr err;
+    jmp_buf error_jump;
+    unsigned char* out; // allocated by libjpeg as it is written
+    unsigned long out_len;
+};
+
+static void optimize_error_exit(j_common_ptr cinfo)
+{
+    longjmp(((struct optimize_state*) cinfo->err)->error_jump, 1);
+}
+
+// warnings about e.g. corrupt data are not worth a line on stderr
+static void optimize_output_message(j_common_ptr cinfo _unused)
+{
+}
+
+static unsigned read_16(const unsigned char* p, bool little_endian)
+{
+    return little_endian ? p[0] | (unsigned) p[1] << 8 : (unsigned) p[0] << 8 | p[1];
+}
+
+static uint32_t read_32(const unsigned char* p, bool little_endian)
+{
+    return little_endian ? read_16(p, true) | (uint32_t) read_16(p + 2, true) << 16
+           : (uint32_t) read_16(p, false) << 16 | read_16(p + 2, false);
+}
+
+// the orientation of the first image of an EXIF segment, 1 (as stored) if not given
+static unsigned exif_orientation(const unsigned char* exif, size_t len)
+{
+    if (len < EXIF_HEADER_SIZE + 8 || memcmp(exif, "Exif\0\0", EXIF_HEADER_SIZE) != 0) {
+        return 1;
+    }
+    const unsigned char* const tiff = exif + EXIF_HEADER_SIZE;
+    const size_t tiff_len = len - EXIF_HEADER_SIZE;
+    bool little_endian = false;
+    if (memcmp(tiff, "II", 2) == 0) {
+        little_endian = true;
+    } else if (memcmp(tiff, "MM", 2) != 0) {
+        return 1;
+    }
+    const uint32_t ifd = read_32(tiff + 4, little_endian);
+    if (ifd > tiff_len - 2) {
+        return 1;
+    }
+    const unsigned nb_entries = read_16(tiff + ifd, little_endian);
+    for (size_t i = 0; i < nb_entries; ++i) {
+        const size_t entry = ifd + 2 + i * EXIF_ENTRY_SIZE;
+        if (entry + EXIF_ENTRY_SIZE > tiff_len) {
+            break;
+        }
+        if (read_16(tiff + entry, little_endian) == EXIF_ORIENTATION_TAG) {
+            return read_16(tiff + entry + 8, little_endian);
+        }
+    }
+    return 1;
+}
+
+// an EXIF segment with nothing but an orientation: a big-endian TIFF header and one entry
+static void write_orientation(j_compress_ptr dst, unsigned orientation)
+{
+    const unsigned char exif[] = {
+        'E', 'x', 'i', 'f', 0, 0,
+        'M', 'M', 0, 42, 0, 0, 0, 8,                 // TIFF header, first IFD at 8
+        0, 1,                                        // one entry
+        EXIF_ORIENTATION_TAG >> 8, EXIF_ORIENTATION_TAG & 0xFF,
+        0, 3, 0, 0, 0, 1,                            // one SHORT
+        0, (unsigned char) orientation, 0, 0,
+        0, 0, 0, 0                                   // no next IFD
+    };
+    jpeg_write_marker(dst, JPEG_APP0 + 1, exif, sizeof(exif));
+}
+
+int optimize_jpeg(const char* image_buffer, size_t image_size, char** optimized, size_t* optimized_size)
+{
+    M_REQUIRE_NON_NULL(image_buffer);
+    M_REQUIRE_NON_NULL(optimized);
+    M_REQUIRE_NON_NULL(optimized_size);
+
+    struct optimize_state state;
+    struct jpeg_decompress_struct src;
+    struct jpeg_compress_struct dst;
+    zero_init_var(state);
+    zero_init_var(src);
+    zero_init_var(dst);
+    src.err = dst.err = jpeg_std_error(&state.err);
+    state.err.error_exit = optimize_error_exit;
+    state.err.output_message = optimize_output_message;
+    if (setjmp(state.error_jump)) {
+        jpeg_destroy_compress(&dst);
+        jpeg_destroy_decompress(&src);
+        free(state.out);
+        return ERR_IMGLIB;
+    }
+
+    jpeg_create_decompress(&src);
+    jpeg_mem_src(&src, (const unsigned char*) image_buffer, (unsigned long) image_size);
+    jpeg_save_markers(&src, JPEG_APP0 + 1, 0xFFFF); // EXIF
+    jpeg_save_markers(&src, JPEG_APP0 + 2, 0xFFFF); // ICC profile
+    jpeg_read_header(&src, TRUE);
+    jvirt_barray_ptr* const coefficients = jpeg_read_coefficients(&src);
+
+    jpeg_create_compress(&dst);
+    jpeg_mem_dest(&dst, &state.out, &state.out_len);
+    jpeg_copy_critical_parameters(&src, &dst);
+    dst.optimize_coding = TRUE;
+    if (jpeg_has_multiple_scans(&src)) {
+        jpeg_simple_progression(&dst);
+    }
+    jpeg_write_coefficients(&dst, coefficients);
+    for (jpeg_saved_marker_ptr marker = src.marker_list; marker != NULL; marker = marker->next) {
+        if (marker->marker == JPEG_APP0 + 2) {
+            jpeg_write_marker(&dst, marker->marker, marker->data, marker->data_length);
+        } else {
+            const unsigned orientation = exif_orientation(marker->data, marker->data_length);
+            if (orientation != 1) {
+                write_orientation(&dst, orientation);
+            }
+        }
+    }
+    jpeg_finish_compress(&dst);
+    jpeg_finish_decompress(&src);
+    jpeg_destroy_compress(&dst);
+    jpeg_destroy_decompress(&src);
+
+    *optimized = (char*) state.out;
+    *optimized_size = state.out_len;
+    return ERR_NONE;
+}
@@ -0,0 +1,34 @@
+/**
+ * @file image_optimize.h
+ * @brief Lossless optimization of the JPEG images stored.
+ */
+
+#pragma once
+
+#include <stddef.h> // for size_t
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Rewrites a JPEG image without decoding its pixels: the DCT
+ *        coefficients are kept as they are, and entropy coded again with
+ *        optimal Huffman tables. The metadata segments are left out, except
+ *        for the ICC profile and an EXIF orientation, which change how the
+ *        image is displayed.
+ *
+ * Its result can be given as the optimized content of an imgfs_insert_stream.
+ *
+ * @param image_buffer The JPEG content
+ * @param image_size Its size
+ * @param optimized Where to put the (allocated) optimized content
+ * @param optimized_size Its size
+ * @return Some error code. 0 if no error; ERR_IMGLIB if the content is not
+ *         a JPEG image that libjpeg can transcode.
+ */
+int optimize_jpeg(const char* image_buffer, size_t image_size, char** optimized, size_t* optimized_size);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,198 @@
+#include "image_optimize.h"
+#include "util.h"
+#include "error.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <check.h>
+#include <jpeglib.h>
+
+#define WIDTH 64
+#define HEIGHT 48
+#define NO_EXIF 1 // the orientation of an image without one
+
+// EXIF segments: "Exif\0\0", then a TIFF header (byte order, 42, offset of the first IFD)
+// and IFD entries (tag, type, count, value)
+#define EXIF_HEADER 'E', 'x', 'i', 'f', 0, 0
+#define TIFF_BE(ifd) 'M', 'M', 0, 42, (ifd) >> 24, ((ifd) >> 16) & 0xFF, ((ifd) >> 8) & 0xFF, (ifd) & 0xFF
+#define TIFF_LE(ifd) 'I', 'I', 42, 0, (ifd) & 0xFF, ((ifd) >> 8) & 0xFF, ((ifd) >> 16) & 0xFF, (ifd) >> 24
+#define ORIENTATION_BE(value) 0x01, 0x12, 0, 3, 0, 0, 0, 1, 0, value, 0, 0
+#define ORIENTATION_LE(value) 0x12, 0x01, 3, 0, 1, 0, 0, 0, value, 0, 0, 0
+#define MAKE_LE 0x0F, 0x01, 2, 0, 4, 0, 0, 0, 'A', 'B', 'C', 0 // an entry before it
+
+// a small JPEG image, with the given content as EXIF segment if not NULL
+static unsigned char* make_jpeg(const unsigned char* exif, size_t exif_len, size_t* size){
+  struct jpeg_compress_struct dst;
+  struct jpeg_error_mgr err;
+  dst.err = jpeg_std_error(&err);
+  jpeg_create_compress(&dst);
+  unsigned char* out = NULL;
+  unsigned long out_len = 0;
+  jpeg_mem_dest(&dst, &out, &out_len);
+  dst.image_width = WIDTH;
+  dst.image_height = HEIGHT;
+  dst.input_components = 3;
+  dst.in_color_space = JCS_RGB;
+  jpeg_set_defaults(&dst);
+  jpeg_start_compress(&dst, TRUE);
+  if (exif != NULL) {
+    jpeg_write_marker(&dst, JPEG_APP0 + 1, exif, (unsigned) exif_len);
+  }
+  JSAMPLE row[WIDTH * 3];
+  while (dst.next_scanline < HEIGHT) {
+    for (unsigned x = 0; x < WIDTH; ++x) {
+      row[3 * x] = (JSAMPLE) (x * 4);
+      row[3 * x + 1] = (JSAMPLE) (dst.next_scanline * 5);
+      row[3 * x + 2] = (JSAMPLE) ((x * dst.next_scanline) & 0xFF);
+    }
+    JSAMPROW rows[1] = { row };
+    jpeg_write_scanlines(&dst, rows, 1);
+  }
+  jpeg_finish_compress(&dst);
+  jpeg_destroy_compress(&dst);
+  *size = out_len;
+  return out;
+}
+
+// the pixels of a JPEG image, and the orientation of its EXIF segment as optimize_jpeg()
+// writes it: big-endian, with the orientation as only entry
+static unsigned char* decode_jpeg(const char* content, size_t size, unsigned* orientation){
+  struct jpeg_decompress_struct src;
+  struct jpeg_error_mgr err;
+  src.err = jpeg_std_error(&err);
+  jpeg_create_decompress(&src);
+  jpeg_mem_src(&src, (const unsigned char*) content, (unsigned long) size);
+  jpeg_save_markers(&src, JPEG_APP0 + 1, 0xFFFF);
+  jpeg_read_header(&src, TRUE);
+  *orientation = NO_EXIF;
+  for (jpeg_saved_marker_ptr marker = src.marker_list; marker != NULL; marker = marker->next) {
+    if (marker->data_length >= 26 && memcmp(marker->data, "Exif\0\0MM", 8) == 0) {
+      *orientation = marker->data[25];
+    }
+  }
+  jpeg_start_decompress(&src);
+  const size_t row_len = src.output_width * (size_t) src.output_components;
+  unsigned char* const pixels = malloc(row_len * src.output_height);
+  while (src.output_scanline < src.output_height) {
+    JSAMPROW rows[1] = { pixels + src.output_scanline * row_len };
+    jpeg_read_scanlines(&src, rows, 1);
+  }
+  jpeg_finish_decompress(&src);
+  jpeg_destroy_decompress(&src);
+  return pixels;
+}
+
+// optimize_jpeg() of an image with the given EXIF segment: the orientation it keeps,
+// with the pixels unchanged
+static unsigned optimized_orientation(const unsigned char* exif, size_t exif_len){
+  size_t size = 0;
+  unsigned char* const jpeg = make_jpeg(exif, exif_len, &size);
+  char* optimized = NULL;
+  size_t optimized_size = 0;
+  ck_assert_int_eq(optimize_jpeg((const char*) jpeg, size, &optimized, &optimized_size), ERR_NONE);
+
+  unsigned orientation = 0;
+  unsigned original_orientation = 0;
+  unsigned char* const pixels = decode_jpeg(optimized, optimized_size, &orientation);
+  unsigned char* const original = decode_jpeg((const char*) jpeg, size, &original_orientation);
+  ck_assert_int_eq(memcmp(pixels, original, WIDTH * HEIGHT * 3), 0);
+  free(original);
+  free(pixels);
+  free(optimized);
+  free(jpeg);
+  return orientation;
+}
+
+#define OPTIMIZED_ORIENTATION(exif) optimized_orientation(exif, sizeof(exif))
+
+// TEST : optimize_jpeg
+// ==================================================
+START_TEST(test_optimize_no_exif){
+  ck_assert_int_eq(optimized_orientation(NULL, 0), NO_EXIF);
+} END_TEST
+
+START_TEST(test_optimize_big_endian){
+  const unsigned char exif[] = { EXIF_HEADER, TIFF_BE(8), 0, 1, ORIENTATION_BE(6), 0, 0, 0, 0 };
+  ck_assert_int_eq(OPTIMIZED_ORIENTATION(exif), 6);
+  // as stored: not worth a segment
+  const unsigned char upright[] = { EXIF_HEADER, TIFF_BE(8), 0, 1, ORIENTATION_BE(1), 0, 0, 0, 0 };
+  ck_assert_int_eq(OPTIMIZED_ORIENTATION(upright), NO_EXIF);
+} END_TEST
+
+START_TEST(test_optimize_little_endian){
+  const unsigned char exif[] = { EXIF_HEADER, TIFF_LE(8), 2, 0, MAKE_LE, ORIENTATION_LE(8), 0, 0, 0, 0 };
+  ck_assert_int_eq(OPTIMIZED_ORIENTATION(exif), 8);
+  // the IFD anywhere in the segment
+  const unsigned char far_ifd[] = { EXIF_HEADER, TIFF_LE(12), 0, 0, 0, 0, 1, 0, ORIENTATION_LE(3) };
+  ck_assert_int_eq(OPTIMIZED_ORIENTATION(far_ifd), 3);
+} END_TEST
+
+START_TEST(test_optimize_ifd_past_segment){
+  const unsigned char far[] = { EXIF_HEADER, TIFF_BE(0x7FFFFFF0), 0, 1, ORIENTATION_BE(6) };
+  ck_assert_int_eq(OPTIMIZED_ORIENTATION(far), NO_EXIF);
+  // the number of entries itself one byte past the end
+  const unsigned char last_byte[] = { EXIF_HEADER, TIFF_BE(8), 0 };
+  ck_assert_int_eq(OPTIMIZED_ORIENTATION(last_byte), NO_EXIF);
+  // nothing but the TIFF header, cut
+  const unsigned char cut[] = { EXIF_HEADER, 'M', 'M', 0, 42 };
+  ck_assert_int_eq(OPTIMIZED_ORIENTATION(cut), NO_EXIF);
+} END_TEST
+
+START_TEST(test_optimize_entries_past_segment){
+  // many more entries than the segment holds: only the ones it holds are read
+  const unsigned char overrun[] = { EXIF_HEADER, TIFF_LE(8), 0xFF, 0xFF, MAKE_LE };
+  ck_assert_int_eq(OPTIMIZED_ORIENTATION(overrun), NO_EXIF);
+  const unsigned char first[] = { EXIF_HEADER, TIFF_LE(8), 0xFF, 0xFF, ORIENTATION_LE(6) };
+  ck_assert_int_eq(OPTIMIZED_ORIENTATION(first), 6);
+  // an orientation entry cut short
+  const unsigned char cut[] = { EXIF_HEADER, TIFF_BE(8), 0, 1, 0x01, 0x12, 0, 3, 0, 0, 0, 1, 0, 6 };
+  ck_assert_int_eq(OPTIMIZED_ORIENTATION(cut), NO_EXIF);
+} END_TEST
+
+START_TEST(test_optimize_not_exif){
+  const unsigned char xmp[] = { 'h', 't', 't', 'p', ':', '/', '/', 'n', 's', '.', 'a', 'd', 'o', 'b', 'e' };
+  ck_assert_int_eq(OPTIMIZED_ORIENTATION(xmp), NO_EXIF);
+  const unsigned char byte_order[] = { EXIF_HEADER, 'X', 'X', 0, 42, 0, 0, 0, 8, 0, 1, ORIENTATION_BE(6) };
+  ck_assert_int_eq(OPTIMIZED_ORIENTATION(byte_order), NO_EXIF);
+} END_TEST
+
+START_TEST(test_optimize_not_jpeg){
+  const char png[] = { (char) 0x89, 'P', 'N', 'G', 0x0D, 0x0A, 0x1A, 0x0A, 0, 0, 0, 0 };
+  char* optimized = NULL;
+  size_t optimized_size = 0;
+  ck_assert_int_eq(optimize_jpeg(png, sizeof(png), &optimized, &optimized_size), ERR_IMGLIB);
+  ck_assert_ptr_null(optimized);
+
+  // a JPEG image cut in its entropy coded data
+  size_t size = 0;
+  unsigned char* const jpeg = make_jpeg(NULL, 0, &size);
+  ck_assert_int_eq(optimize_jpeg((const char*) jpeg, size / 4, &optimized, &optimized_size), ERR_IMGLIB);
+  free(jpeg);
+} END_TEST
+
+Suite* optimize_jpeg_tests(void) {
+  Suite *s = suite_create("Optimize JPEG Tests");
+  TCase *tc_exif = tcase_create("EXIF");
+
+  tcase_add_test(tc_exif, test_optimize_no_exif);
+  tcase_add_test(tc_exif, test_optimize_big_endian);
+  tcase_add_test(tc_exif, test_optimize_little_endian);
+  tcase_add_test(tc_exif, test_optimize_ifd_past_segment);
+  tcase_add_test(tc_exif, test_optimize_entries_past_segment);
+  tcase_add_test(tc_exif, test_optimize_not_exif);
+  tcase_add_test(tc_exif, test_optimize_not_jpeg);
+  suite_add_tcase(s, tc_exif);
+
+  return s;
+}
+
+int main(void) {
+  int number_failed = 0;
+  Suite *s = optimize_jpeg_tests();
+  SRunner *sr = srunner_create(s);
+  srunner_run_all(sr, CK_NORMAL);
+  number_failed += srunner_ntests_failed(sr);
+  srunner_free(sr);
+
+  return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,126 @@
+/*
+ * @file image_placeholder.c
+ * @brief Placeholders of the images, see image_placeholder.h.
+ */
+
+#include "image_placeholder.h"
+#include "error.h"
+#include "util.h"
+
+#include <math.h> // cos(), pow()
+#include <stdint.h>
+#include <vips/vips.h>
+
+#define PLACEHOLDER_PIXELS 32 // longer side of the image transformed, at most
+#define COMPONENTS_LONG 4     // frequencies along the longer side, the average included
+#define COMPONENTS_SHORT 3
+#define NB_COMPONENTS (COMPONENTS_LONG * COMPONENTS_SHORT)
+
+static const char BASE83[] = "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz#$%*+,-.:;=?@[]^_{|}~";
+
+// the last length base 83 digits of value, after out
+static char* encode_83(unsigned value, int length, char* out)
+{
+    for (int i = length - 1; i >= 0; --i) {
+        out[i] = BASE83[value % 83];
+        value /= 83;
+    }
+    return out + length;
+}
+
+static double srgb_to_linear(uint8_t value)
+{
+    const double v = value / 255.0;
+    return v <= 0.04045 ? v / 12.92 : pow((v + 0.055) / 1.055, 2.4);
+}
+
+static unsigned linear_to_srgb(double value)
+{
+    const double v = value < 0 ? 0 : value > 1 ? 1 : value;
+    return (unsigned) (v <= 0.0031308 ? v * 12.92 * 255 + 0.5 : (1.055 * pow(v, 1 / 2.4) - 0.055) * 255 + 0.5);
+}
+
+// an AC component, relative to the largest one, on 19 levels
+static unsigned quantize(double value, double max_value)
+{
+    const double v = value / max_value;
+    const double q = floor((v < 0 ? -sqrt(-v) : sqrt(v)) * 9 + 9.5);
+    return q < 0 ? 0 : q > 18 ? 18 : (unsigned) q;
+}
+
+// the cosine transform of width x height pixels of bands bands, greys if fewer than 3
+static void transform(const uint8_t* pixels, int width, int height, int bands,
+                      int nx, int ny, double factors[NB_COMPONENTS][3])
+{
+    for (int j = 0; j < ny; ++j) {
+        for (int i = 0; i < nx; ++i) {
+            double sum[3] = { 0, 0, 0 };
+            for (int y = 0; y < height; ++y) {
+                const double cos_y = cos(M_PI * j * y / height);
+                for (int x = 0; x < width; ++x) {
+                    const double basis = cos(M_PI * i * x / width) * cos_y;
+                    const uint8_t* const pixel = pixels + ((size_t) y * (size_t) width + (size_t) x) * (size_t) bands;
+                    for (int c = 0; c < 3; ++c) {
+                        sum[c] += basis * srgb_to_linear(pixel[bands < 3 ? 0 : c]);
+                    }
+                }
+            }
+            const double scale = (i == 0 && j == 0 ? 1.0 : 2.0) / (width * height);
+            for (int c = 0; c < 3; ++c) {
+                factors[j * nx + i][c] = sum[c] * scale;
+            }
+        }
+    }
+}
+
+int image_placeholder(const void* image_buffer, size_t image_size, char placeholder[PLACEHOLDER_SIZE])
+{
+    M_REQUIRE_NON_NULL(image_buffer);
+    M_REQUIRE_NON_NULL(placeholder);
+
+    VipsImage* small = NULL;
+    if (vips_thumbnail_buffer((void*) image_buffer, image_size, &small, PLACEHOLDER_PIXELS, NULL) == -1) {
+        return ERR_IMGLIB;
+    }
+    size_t len = 0;
+    const int width = vips_image_get_width(small);
+    const int height = vips_image_get_height(small);
+    const int bands = vips_image_get_bands(small);
+    uint8_t* const pixels = vips_image_get_format(small) == VIPS_FORMAT_UCHAR && bands > 0 ?
+                            vips_image_write_to_memory(small, &len) : NULL;
+    g_object_unref(VIPS_OBJECT(small));
+    if (pixels == NULL) {
+        return ERR_IMGLIB;
+    }
+    if (len < (size_t) width * (size_t) height * (size_t) bands) {
+        g_free(pixels);
+        return ERR_IMGLIB;
+    }
+
+    const int nx = width >= height ? COMPONENTS_LONG : COMPONENTS_SHORT;
+    const int ny = width >= height ? COMPONENTS_SHORT : COMPONENTS_LONG;
+    double factors[NB_COMPONENTS][3];
+    transform(pixels, width, height, bands, nx, ny, factors);
+    g_free(pixels);
+
+    double max_ac = 0;
+    for (int k = 1; k < NB_COMPONENTS; ++k) {
+        for (int c = 0; c < 3; ++c) {
+            max_ac = fmax(max_ac, fabs(factors[k][c]));
+        }
+    }
+    const double q = floor(max_ac * 166 - 0.5);
+    const unsigned quantized_max = q < 0 ? 0 : q > 82 ? 82 : (unsigned) q;
+    const double max_value = (quantized_max + 1) / 166.0;
+
+    char* out = encode_83((unsigned) (nx - 1 + (ny - 1) * 9), 1, placeholder);
+    out = encode_83(quantized_max, 1, out);
+    out = encode_83(linear_to_srgb(factors[0][0]) << 16 | linear_to_srgb(factors[0][1]) << 8 |
+                    linear_to_srgb(factors[0][2]), 4, out);
+    for (int k = 1; k < NB_COMPONENTS; ++k) {
+        out = encode_83(quantize(factors[k][0], max_value) * 19 * 19 +
+                        quantize(factors[k][1], max_value) * 19 + quantize(factors[k][2], max_value), 2, out);
+    }
+    *out = '\0';
+    return ERR_NONE;
+}
@@ -0,0 +1,31 @@
+/**
+ * @file image_placeholder.h
+ * @brief Placeholders of the images: a blurred preview small enough to be
+ *        sent with the list of the images, shown while they are loaded.
+ */
+
+#pragma once
+
+#include <stddef.h> // for size_t
+
+#include "imgfs.h" // for PLACEHOLDER_SIZE
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Computes the blurhash (https://blurha.sh) of an image: the average
+ *        colour and the lowest frequencies of its cosine transform, 4 along
+ *        its longer side and 3 along the other, in a 28-character string.
+ *
+ * @param image_buffer The image content, best a resized version of it
+ * @param image_size Its size
+ * @param placeholder Where to put the blurhash, with its final '\0'
+ * @return Some error code. 0 if no error.
+ */
+int image_placeholder(const void* image_buffer, size_t image_size, char placeholder[PLACEHOLDER_SIZE]);
+
+#ifdef __cplusplus
+}
+#endif
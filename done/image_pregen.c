@@ -0,0 +1,155 @@
+/*
+ * @file image_pregen.c
+ * @brief Background generation of the resized images of new uploads.
+ */
+
+#include "image_pregen.h"
+#include "error.h"
+#include "util.h"
+
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define PREGEN_BACKOFF_SEC 1 // how long a worker waits before checking the load again
+
+struct pregen_job {
+    void* owner;
+    char img_id[MAX_IMG_ID + 1];
+};
+
+static struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t not_empty;
+    // ring buffer: the oldest job is at first, the most recent one at first + count - 1
+    struct pregen_job jobs[PREGEN_QUEUE_SIZE];
+    size_t first;
+    size_t count;
+    pthread_t* workers;
+    size_t nb_workers;
+    double max_load;
+    pregen_callback callback;
+    bool started;
+    bool stopping;
+} pregen = { .mutex = PTHREAD_MUTEX_INITIALIZER, .not_empty = PTHREAD_COND_INITIALIZER };
+
+static bool cpu_busy(void)
+{
+    double load = 0;
+    return pregen.max_load > 0 && getloadavg(&load, 1) == 1 && load > pregen.max_load;
+}
+
+// waits PREGEN_BACKOFF_SEC, or until a job is submitted; to be called with pregen.mutex held
+static void backoff(void)
+{
+    struct timespec until;
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_sec += PREGEN_BACKOFF_SEC;
+    pthread_cond_timedwait(&pregen.not_empty, &pregen.mutex, &until);
+}
+
+// queues a job as the most recent one, dropping the oldest if full; to be called with pregen.mutex held
+static void push_job(void* owner, const char* img_id)
+{
+    if (pregen.count == PREGEN_QUEUE_SIZE) {
+        pregen.first = (pregen.first + 1) % PREGEN_QUEUE_SIZE;
+        --pregen.count;
+    }
+    struct pregen_job* const job = &pregen.jobs[(pregen.first + pregen.count) % PREGEN_QUEUE_SIZE];
+    job->owner = owner;
+    strncpy(job->img_id, img_id, MAX_IMG_ID);
+    job->img_id[MAX_IMG_ID] = '\0';
+    ++pregen.count;
+    pthread_cond_signal(&pregen.not_empty);
+}
+
+static void* pregen_worker(void* arg _unused)
+{
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT );
+    sigaddset(&mask, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+    pthread_mutex_lock(&pregen.mutex);
+    while (!pregen.stopping) {
+        if (pregen.count == 0) {
+            pthread_cond_wait(&pregen.not_empty, &pregen.mutex);
+        } else if (cpu_busy()) {
+            // leave the CPU to the requests; the queue keeps the most recent uploads
+            backoff();
+        } else {
+            --pregen.count;
+            const struct pregen_job job = pregen.jobs[(pregen.first + pregen.count) % PREGEN_QUEUE_SIZE];
+            pthread_mutex_unlock(&pregen.mutex);
+            const int ret = pregen.callback(job.owner, job.img_id);
+            pthread_mutex_lock(&pregen.mutex);
+            if (ret == ERR_BUSY && !pregen.stopping) {
+                // the image processing queue is full of requests: tried again once it had time to drain
+                push_job(job.owner, job.img_id);
+                backoff();
+            }
+        }
+    }
+    pthread_mutex_unlock(&pregen.mutex);
+    return NULL;
+}
+
+int pregen_start(size_t nb_workers, double max_load, pregen_callback callback)
+{
+    M_REQUIRE_NON_NULL(callback);
+    if (nb_workers == 0 || pregen.started) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    pregen.workers = calloc(nb_workers, sizeof(pthread_t));
+    if (pregen.workers == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    pregen.max_load = max_load;
+    pregen.callback = callback;
+    pregen.stopping = false;
+    pregen.started  = true;
+    for (; pregen.nb_workers < nb_workers; ++pregen.nb_workers) {
+        if (pthread_create(&pregen.workers[pregen.nb_workers], NULL, pregen_worker, NULL)) {
+            pregen_stop();
+            return ERR_THREADING;
+        }
+    }
+    return ERR_NONE;
+}
+
+void pregen_submit(void* owner, const char* img_id)
+{
+    if (img_id == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&pregen.mutex);
+    if (pregen.started && !pregen.stopping) {
+        push_job(owner, img_id);
+    }
+    pthread_mutex_unlock(&pregen.mutex);
+}
+
+void pregen_stop(void)
+{
+    pthread_mutex_lock(&pregen.mutex);
+    if (!pregen.started) {
+        pthread_mutex_unlock(&pregen.mutex);
+        return;
+    }
+    pregen.stopping = true;
+    pregen.count = 0;
+    pthread_cond_broadcast(&pregen.not_empty);
+    pthread_mutex_unlock(&pregen.mutex);
+
+    for (size_t i = 0; i < pregen.nb_workers; ++i) {
+        pthread_join(pregen.workers[i], NULL);
+    }
+    free(pregen.workers);
+    pregen.workers = NULL;
+    pregen.nb_workers = 0;
+    pregen.started = false;
+}
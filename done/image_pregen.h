@@ -0,0 +1,60 @@
+/**
+ * @file image_pregen.h
+ * @brief Background generation of the resized images of new uploads.
+ *
+ * A bounded queue of images waiting for their resized versions, served by
+ * a pool of worker threads. The most recent uploads are handled first and,
+ * when the queue is full, the oldest entry is dropped: its resized images
+ * will simply be created on first read, as without pregeneration.
+ */
+
+#pragma once
+
+#include "imgfs.h" // for MAX_IMG_ID
+
+#include <stddef.h> // for size_t
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define PREGEN_QUEUE_SIZE 256
+
+/**
+ * @brief Work done for each queued image.
+ *
+ * @param owner The store the image belongs to, as given to pregen_submit()
+ * @param img_id The ID of the image
+ * @return Some error code. 0 if no error; ERR_BUSY to have the image queued
+ *         again, and tried after a while
+ */
+typedef int (*pregen_callback)(void* owner, const char* img_id);
+
+/**
+ * @brief Starts the worker threads.
+ *
+ * @param nb_workers Number of worker threads
+ * @param max_load Workers pause while the 1-minute load average is above
+ *        this value (CPU pressure); 0 to never pause
+ * @param callback The work to do for each image
+ * @return Some error code. 0 if no error.
+ */
+int pregen_start(size_t nb_workers, double max_load, pregen_callback callback);
+
+/**
+ * @brief Queues an image for background generation. Does nothing if
+ *        pregeneration is not started.
+ *
+ * @param owner The store the image belongs to
+ * @param img_id The ID of the image
+ */
+void pregen_submit(void* owner, const char* img_id);
+
+/**
+ * @brief Drops the queued images and waits for the workers to finish.
+ */
+void pregen_stop(void);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,213 @@
+/*
+ * @file image_similar.c
+ * @brief Perceptual hashes of the images, to find the ones that look alike.
+ */
+
+#include "image_similar.h"
+#include "error.h"
+#include "util.h"
+
+#include <math.h> // cos()
+#include <stdlib.h>
+#include <string.h>
+#include <vips/vips.h>
+
+#define PHASH_SIZE 32 // side of the grey image transformed
+#define PHASH_FREQS 8 // lowest frequencies kept, in each direction
+#define INITIAL_NODES 64
+
+static int compare_doubles(const void* a, const void* b)
+{
+    const double x = *(const double*) a;
+    const double y = *(const double*) b;
+    return (x > y) - (x < y);
+}
+
+// the hash of a PHASH_SIZE x PHASH_SIZE image, from the first of its bands
+static uint64_t dct_hash(const uint8_t* pixels, size_t bands)
+{
+    double cosines[PHASH_FREQS][PHASH_SIZE];
+    for (int u = 0; u < PHASH_FREQS; ++u) {
+        for (int x = 0; x < PHASH_SIZE; ++x) {
+            cosines[u][x] = cos((2 * x + 1) * u * M_PI / (2 * PHASH_SIZE));
+        }
+    }
+    // DCT of the rows, then of the columns, for the lowest frequencies only
+    double rows[PHASH_SIZE][PHASH_FREQS];
+    for (size_t y = 0; y < PHASH_SIZE; ++y) {
+        for (int u = 0; u < PHASH_FREQS; ++u) {
+            double sum = 0;
+            for (size_t x = 0; x < PHASH_SIZE; ++x) {
+                sum += pixels[(y * PHASH_SIZE + x) * bands] * cosines[u][x];
+            }
+            rows[y][u] = sum;
+        }
+    }
+    double dct[PHASH_FREQS * PHASH_FREQS];
+    for (int v = 0; v < PHASH_FREQS; ++v) {
+        for (int u = 0; u < PHASH_FREQS; ++u) {
+            double sum = 0;
+            for (int y = 0; y < PHASH_SIZE; ++y) {
+                sum += rows[y][u] * cosines[v][y];
+            }
+            dct[v * PHASH_FREQS + u] = sum;
+        }
+    }
+    // the first coefficient, the mean brightness, says nothing of the content
+    double sorted[PHASH_FREQS * PHASH_FREQS - 1];
+    memcpy(sorted, dct + 1, sizeof(sorted));
+    qsort(sorted, PHASH_FREQS * PHASH_FREQS - 1, sizeof(double), compare_doubles);
+    const double median = sorted[(PHASH_FREQS * PHASH_FREQS - 1) / 2];
+
+    // the bit of the first coefficient is always set, so that no hash is 0
+    uint64_t hash = 1;
+    for (int i = 1; i < PHASH_FREQS * PHASH_FREQS; ++i) {
+        if (dct[i] > median) {
+            hash |= UINT64_C(1) << i;
+        }
+    }
+    return hash;
+}
+
+int image_phash(const void* image_buffer, size_t image_size, uint64_t* phash)
+{
+    M_REQUIRE_NON_NULL(image_buffer);
+    M_REQUIRE_NON_NULL(phash);
+
+    VipsImage* small = NULL;
+    VipsImage* grey = NULL;
+    if (vips_thumbnail_buffer((void*) image_buffer, image_size, &small, PHASH_SIZE,
+                              "height", PHASH_SIZE, "size", VIPS_SIZE_FORCE, NULL) == -1 ||
+        vips_colourspace(small, &grey, VIPS_INTERPRETATION_B_W, NULL) == -1) {
+        if (small != NULL) g_object_unref(VIPS_OBJECT(small));
+        return ERR_IMGLIB;
+    }
+    g_object_unref(VIPS_OBJECT(small));
+
+    size_t len = 0;
+    const int bands = vips_image_get_bands(grey);
+    const int ok = vips_image_get_format(grey) == VIPS_FORMAT_UCHAR &&
+                   vips_image_get_width(grey) == PHASH_SIZE && vips_image_get_height(grey) == PHASH_SIZE;
+    uint8_t* const pixels = ok ? vips_image_write_to_memory(grey, &len) : NULL;
+    g_object_unref(VIPS_OBJECT(grey));
+    if (pixels == NULL) {
+        return ERR_IMGLIB;
+    }
+    *phash = dct_hash(pixels, (size_t) bands);
+    g_free(pixels);
+    return ERR_NONE;
+}
+
+unsigned phash_distance(uint64_t phash1, uint64_t phash2)
+{
+    return (unsigned) __builtin_popcountll(phash1 ^ phash2);
+}
+
+int similar_index_add(struct similar_index* similar, uint64_t phash, size_t index)
+{
+    M_REQUIRE_NON_NULL(similar);
+    if (similar->nb_nodes == similar->capacity) {
+        const size_t capacity = similar->capacity == 0 ? INITIAL_NODES : 2 * similar->capacity;
+        struct similar_node* const nodes = realloc(similar->nodes, capacity * sizeof(struct similar_node));
+        if (nodes == NULL) {
+            return ERR_OUT_OF_MEMORY;
+        }
+        similar->nodes = nodes;
+        similar->capacity = capacity;
+    }
+    struct similar_node* const nodes = similar->nodes;
+    const size_t added = similar->nb_nodes;
+    nodes[added].phash = phash;
+    nodes[added].index = index;
+    nodes[added].first_child = 0;
+    nodes[added].next_sibling = 0;
+    nodes[added].edge = 0;
+
+    // down the children at the same distance, until there is none
+    if (added > 0) {
+        size_t parent = 0;
+        for (;;) {
+            const unsigned distance = phash_distance(phash, nodes[parent].phash);
+            size_t child = nodes[parent].first_child;
+            while (child != 0 && nodes[child].edge != distance) {
+                child = nodes[child].next_sibling;
+            }
+            if (child == 0) {
+                nodes[added].edge = distance;
+                nodes[added].next_sibling = nodes[parent].first_child;
+                nodes[parent].first_child = added;
+                break;
+            }
+            parent = child;
+        }
+    }
+    ++similar->nb_nodes;
+    return ERR_NONE;
+}
+
+static int compare_matches(const void* a, const void* b)
+{
+    const struct similar_match* const x = a;
+    const struct similar_match* const y = b;
+    if (x->distance != y->distance) {
+        return x->distance < y->distance ? -1 : 1;
+    }
+    return (x->index > y->index) - (x->index < y->index);
+}
+
+int similar_index_find(const struct similar_index* similar, uint64_t phash, unsigned max_distance,
+                       struct similar_match** matches, size_t* nb_matches)
+{
+    M_REQUIRE_NON_NULL(similar);
+    M_REQUIRE_NON_NULL(matches);
+    M_REQUIRE_NON_NULL(nb_matches);
+    *matches = NULL;
+    *nb_matches = 0;
+    if (similar->nb_nodes == 0) {
+        return ERR_NONE;
+    }
+    // each node is visited at most once
+    size_t* const pending = calloc(similar->nb_nodes, sizeof(size_t));
+    struct similar_match* const found = calloc(similar->nb_nodes, sizeof(struct similar_match));
+    if (pending == NULL || found == NULL) {
+        free(pending);
+        free(found);
+        return ERR_OUT_OF_MEMORY;
+    }
+    const struct similar_node* const nodes = similar->nodes;
+    size_t nb_pending = 1;
+    size_t nb_found = 0;
+    pending[0] = 0;
+    while (nb_pending > 0) {
+        const struct similar_node* const node = &nodes[pending[--nb_pending]];
+        const unsigned distance = phash_distance(phash, node->phash);
+        if (distance <= max_distance) {
+            found[nb_found].index = node->index;
+            found[nb_found].distance = distance;
+            ++nb_found;
+        }
+        // by the triangle inequality, the other subtrees hold nothing close enough
+        for (size_t child = node->first_child; child != 0; child = nodes[child].next_sibling) {
+            if (nodes[child].edge + max_distance >= distance && nodes[child].edge <= distance + max_distance) {
+                pending[nb_pending++] = child;
+            }
+        }
+    }
+    free(pending);
+    if (nb_found == 0) {
+        free(found);
+        return ERR_NONE;
+    }
+    qsort(found, nb_found, sizeof(struct similar_match), compare_matches);
+    *matches = found;
+    *nb_matches = nb_found;
+    return ERR_NONE;
+}
+
+void similar_index_free(struct similar_index* similar)
+{
+    if (similar != NULL) {
+        free(similar->nodes);
+        zero_init_ptr(similar);
+    }
+}
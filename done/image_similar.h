@@ -0,0 +1,102 @@
+/**
+ * @file image_similar.h
+ * @brief Perceptual hashes of the images, to find the ones that look alike.
+ *
+ * Unlike the SHA, the perceptual hash of an image barely changes when it
+ * is re-encoded, slightly resized or retouched: near-duplicates are the
+ * images whose hashes differ by only a few bits. The hashes are indexed in
+ * a BK-tree, which only visits the subtrees that can hold a match.
+ */
+
+#pragma once
+
+#include <stddef.h> // for size_t
+#include <stdint.h> // for uint64_t
+
+#define PHASH_BITS 64
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Computes the 64-bit perceptual hash of an image: the signs of the
+ *        lowest frequencies of the DCT of its 32x32 grey version, relative
+ *        to their median. Its lowest bit, that of the mean brightness, is
+ *        always set: 0 is never a hash.
+ *
+ * @param image_buffer The image content
+ * @param image_size Its size
+ * @param phash Where to put the hash
+ * @return Some error code. 0 if no error.
+ */
+int image_phash(const void* image_buffer, size_t image_size, uint64_t* phash);
+
+/**
+ * @brief Number of bits that differ between two perceptual hashes.
+ */
+unsigned phash_distance(uint64_t phash1, uint64_t phash2);
+
+// A node of the tree: its children are at a distance to it given by their edge
+struct similar_node {
+    uint64_t phash;
+    size_t index;        // slot of the image in the metadata array
+    size_t first_child;  // 0 if none: the root is never a child
+    size_t next_sibling; // 0 if none
+    unsigned edge;       // distance to the parent
+};
+
+/**
+ * @brief The perceptual hashes of the images of an imgFS, zero-initialized
+ *        when empty.
+ *
+ * Images are only added: the ones deleted or replaced in the meantime are
+ * to be skipped by the caller, and the index rebuilt once they are many.
+ */
+struct similar_index {
+    struct similar_node* nodes; // the root first
+    size_t nb_nodes;
+    size_t capacity;
+};
+
+/**
+ * @brief An image found in the index.
+ */
+struct similar_match {
+    size_t index;      // slot of the image in the metadata array
+    unsigned distance; // to the hash looked for
+};
+
+/**
+ * @brief Adds an image to the index.
+ *
+ * @param similar The index
+ * @param phash The perceptual hash of the image
+ * @param index The slot of the image in the metadata array
+ * @return Some error code. 0 if no error.
+ */
+int similar_index_add(struct similar_index* similar, uint64_t phash, size_t index);
+
+/**
+ * @brief Finds the images whose hash is within a distance of a hash.
+ *
+ * @param similar The index
+ * @param phash The hash looked for
+ * @param max_distance Largest number of differing bits
+ * @param matches Where to put the (allocated) images found, closest first
+ * @param nb_matches Where to put their number
+ * @return Some error code. 0 if no error.
+ */
+int similar_index_find(const struct similar_index* similar, uint64_t phash, unsigned max_distance,
+                       struct similar_match** matches, size_t* nb_matches);
+
+/**
+ * @brief Empties the index.
+ *
+ * @param similar The index
+ */
+void similar_index_free(struct similar_index* similar);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,153 @@
+#include "image_similar.h"
+#include "util.h"
+#include "error.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <check.h>
+
+// hashes at a known distance from BASE_HASH (bit 0, always set in a hash, is kept)
+#define BASE_HASH 0x0123456789abcdefULL
+#define FLIP(n) (BASE_HASH ^ ((((uint64_t) 1 << (n)) - 1) << 1))
+
+#define RANDOM_HASHES 500
+
+// a small xorshift generator, for the same hashes at each run
+static uint64_t next_hash(uint64_t* state){
+  *state ^= *state << 13;
+  *state ^= *state >> 7;
+  *state ^= *state << 17;
+  return *state | 1;
+}
+
+// TEST : similar_index_find
+// ==================================================
+START_TEST(test_find_empty_index){
+  struct similar_index similar;
+  zero_init_var(similar);
+  struct similar_match* matches = (void*) 1;
+  size_t nb_matches = 1;
+
+  ck_assert_int_eq(similar_index_find(&similar, BASE_HASH, PHASH_BITS, &matches, &nb_matches), ERR_NONE);
+  ck_assert_ptr_null(matches);
+  ck_assert_int_eq(nb_matches, 0);
+  similar_index_free(&similar);
+} END_TEST
+
+START_TEST(test_find_distance_threshold){
+  struct similar_index similar;
+  zero_init_var(similar);
+  struct similar_match* matches = NULL;
+  size_t nb_matches = 0;
+
+  // slot n at distance n
+  for (size_t n = 0; n <= 10; ++n) {
+    ck_assert_int_eq(similar_index_add(&similar, FLIP(n), n), ERR_NONE);
+  }
+
+  // the bound is inclusive
+  ck_assert_int_eq(similar_index_find(&similar, BASE_HASH, 4, &matches, &nb_matches), ERR_NONE);
+  ck_assert_int_eq(nb_matches, 5);
+  for (size_t i = 0; i < nb_matches; ++i) {
+    ck_assert_int_le(matches[i].distance, 4);
+    ck_assert_int_eq(matches[i].distance, phash_distance(BASE_HASH, FLIP(matches[i].index)));
+  }
+  free(matches);
+
+  ck_assert_int_eq(similar_index_find(&similar, BASE_HASH, 0, &matches, &nb_matches), ERR_NONE);
+  ck_assert_int_eq(nb_matches, 1);
+  ck_assert_int_eq(matches[0].index, 0);
+  ck_assert_int_eq(matches[0].distance, 0);
+  free(matches);
+
+  // nothing that close
+  ck_assert_int_eq(similar_index_find(&similar, ~BASE_HASH | 1, 3, &matches, &nb_matches), ERR_NONE);
+  ck_assert_ptr_null(matches);
+  ck_assert_int_eq(nb_matches, 0);
+
+  similar_index_free(&similar);
+} END_TEST
+
+START_TEST(test_find_closest_first){
+  struct similar_index similar;
+  zero_init_var(similar);
+  struct similar_match* matches = NULL;
+  size_t nb_matches = 0;
+
+  // added farthest first, with two images at the same distance
+  const size_t distances[] = { 7, 3, 5, 1, 3, 0 };
+  const size_t nb_images = sizeof(distances) / sizeof(distances[0]);
+  for (size_t i = 0; i < nb_images; ++i) {
+    ck_assert_int_eq(similar_index_add(&similar, FLIP(distances[i]), i), ERR_NONE);
+  }
+
+  ck_assert_int_eq(similar_index_find(&similar, BASE_HASH, PHASH_BITS, &matches, &nb_matches), ERR_NONE);
+  ck_assert_int_eq(nb_matches, nb_images);
+  const size_t expected[] = { 5, 3, 1, 4, 2, 0 }; // the ties by slot
+  for (size_t i = 0; i < nb_matches; ++i) {
+    ck_assert_int_eq(matches[i].index, expected[i]);
+    ck_assert_int_eq(matches[i].distance, distances[expected[i]]);
+  }
+  free(matches);
+  similar_index_free(&similar);
+} END_TEST
+
+START_TEST(test_find_as_linear_scan){
+  struct similar_index similar;
+  zero_init_var(similar);
+  uint64_t hashes[RANDOM_HASHES];
+  uint64_t state = BASE_HASH;
+
+  // clusters of close hashes, as the near-duplicates of a store
+  for (size_t i = 0; i < RANDOM_HASHES; ++i) {
+    hashes[i] = i % 4 == 0 ? next_hash(&state) : hashes[i - 1] ^ (next_hash(&state) & 0x0f0f0f0f0f0f0f0eULL);
+    ck_assert_int_eq(similar_index_add(&similar, hashes[i], i), ERR_NONE);
+  }
+
+  for (unsigned max_distance = 0; max_distance <= PHASH_BITS; max_distance += 8) {
+    for (size_t q = 0; q < 20; ++q) {
+      const uint64_t phash = hashes[q * 7] ^ (next_hash(&state) & 0x0303030303030302ULL);
+      struct similar_match* matches = NULL;
+      size_t nb_matches = 0;
+      ck_assert_int_eq(similar_index_find(&similar, phash, max_distance, &matches, &nb_matches), ERR_NONE);
+
+      size_t expected = 0;
+      for (size_t i = 0; i < RANDOM_HASHES; ++i) {
+        expected += phash_distance(phash, hashes[i]) <= max_distance;
+      }
+      ck_assert_int_eq(nb_matches, expected);
+      for (size_t i = 0; i < nb_matches; ++i) {
+        ck_assert_int_eq(matches[i].distance, phash_distance(phash, hashes[matches[i].index]));
+        ck_assert_int_le(matches[i].distance, max_distance);
+        if (i > 0) {
+          ck_assert_int_le(matches[i - 1].distance, matches[i].distance);
+        }
+      }
+      free(matches);
+    }
+  }
+  similar_index_free(&similar);
+} END_TEST
+
+Suite* similar_index_tests(void) {
+  Suite *s = suite_create("Similar Index Tests");
+  TCase *tc_find = tcase_create("Find");
+
+  tcase_add_test(tc_find, test_find_empty_index);
+  tcase_add_test(tc_find, test_find_distance_threshold);
+  tcase_add_test(tc_find, test_find_closest_first);
+  tcase_add_test(tc_find, test_find_as_linear_scan);
+  suite_add_tcase(s, tc_find);
+
+  return s;
+}
+
+int main(void) {
+  int number_failed = 0;
+  Suite *s = similar_index_tests();
+  SRunner *sr = srunner_create(s);
+  srunner_run_all(sr, CK_NORMAL);
+  number_failed += srunner_ntests_failed(sr);
+  srunner_free(sr);
+
+  return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
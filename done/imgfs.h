@@ -20,7 +20,9 @@
                     * but we provide it here, as it is required by
                     * all the functions of this lib.
                     */
+#include <openssl/evp.h> // for EVP_MD_CTX
 #include <openssl/sha.h> // for SHA256_DIGEST_LENGTH
+#include <stddef.h>      // for size_t
 #include <stdint.h>      // for uint32_t, uint64_t
 #include <stdio.h>       // for FILE
 
@@ -29,6 +31,8 @@
 // Constraints
 #define MAX_IMGFS_NAME 31 // max. size of a ImgFS name
 #define MAX_IMG_ID 127    // max. size of an image id
+#define INSERT_PROBE_SIZE 131072 // 2^17 -> prefix of a streamed image kept to read its JPEG header
+#define PLACEHOLDER_SIZE 32 // max. size of the placeholder of an image, with its final '\0'
 
 // For is_valid in imgfs_metadata
 #define EMPTY 0
@@ -40,6 +44,27 @@
 #define ORIG_RES 2
 #define NB_RES 3
 
+// Encodings of the resized images, kept in unused_16 of their metadata,
+// FORMAT_BITS per resolution; the original is always a JPEG
+#define FORMAT_JPEG 0
+#define FORMAT_WEBP 1
+#define FORMAT_AVIF 2
+#define NB_FORMATS 3
+#define FORMAT_BITS 2
+#define FORMAT_MASK ((1 << FORMAT_BITS) - 1)
+#define GET_FORMAT(metadata, res) (((metadata)->unused_16 >> (FORMAT_BITS * (res))) & FORMAT_MASK)
+
+// JPEG encoding of a resized image made to fit in a size budget, kept in unused_16 of its
+// metadata after the formats, ENCODING_BITS per resolution: a quality level (0 for the
+// encoder defaults) and whether it is progressive
+#define ENCODING_SHIFT (FORMAT_BITS * ORIG_RES)
+#define ENCODING_BITS 6
+#define ENCODING_MASK ((1 << ENCODING_BITS) - 1)
+#define ENCODING_LEVEL_MASK 0x1F
+#define ENCODING_PROGRESSIVE 0x20
+#define ENCODING_QUALITY(encoding) (3 * ((encoding) & ENCODING_LEVEL_MASK) + 2)
+#define GET_ENCODING(metadata, res) (((metadata)->unused_16 >> (ENCODING_SHIFT + ENCODING_BITS * (res))) & ENCODING_MASK)
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -50,8 +75,8 @@ struct imgfs_header {
     uint32_t nb_files;
     uint32_t max_files;
     uint16_t resized_res[2 * (NB_RES - 1)];
-    uint32_t unused_32;
-    uint64_t unused_64;
+    uint32_t unused_32; // size of the extension records, see struct img_ext
+    uint64_t unused_64; // offset of their table in the file, 0 if none
 };
 
 struct img_metadata {
@@ -61,7 +86,19 @@ struct img_metadata {
     uint32_t size[NB_RES];
     uint64_t offset[NB_RES];
     uint16_t is_valid;
-    uint16_t unused_16;
+    uint16_t unused_16; // see GET_FORMAT() and GET_ENCODING()
+};
+
+/*
+ * Extension record of a slot of the metadata array. Their table is appended
+ * to the imgFS file the first time one is written. A record only applies to
+ * the content whose SHA it holds, so that slots can be deleted and reused
+ * without updating it.
+ */
+struct img_ext {
+    unsigned char SHA[SHA256_DIGEST_LENGTH]; // content the record was made for
+    uint64_t phash;                          // perceptual hash of the original, 0 if none (see image_similar.h)
+    char placeholder[PLACEHOLDER_SIZE];      // blurhash of the image, empty if none (see image_placeholder.h)
 };
 
 struct imgfs_file {
@@ -70,6 +107,17 @@ struct imgfs_file {
     struct img_metadata *metadata;
 };
 
+struct imgfs_insert_stream {
+    EVP_MD_CTX *sha_ctx; // running SHA-256 of the content received so far
+    uint64_t offset;     // where the content is written in the imgFS file
+    size_t size;         // announced size of the image
+    size_t written;      // number of bytes received so far
+    char *probe;         // first bytes of the image, used to get its resolution
+    size_t probe_len;
+    char *optimized;     // content to store instead, e.g. from optimize_jpeg(), set before the commit
+    size_t optimized_size; // if smaller than size; freed with the stream
+};
+
 /**
  * @brief Prints imgFS header informations.
  *
@@ -146,6 +194,27 @@ int do_create(const char *imgfs_filename, struct imgfs_file *imgfs_file);
  */
 int do_delete(const char *img_id, struct imgfs_file *imgfs_file);
 
+/**
+ * @brief Reads the extension records of all the slots of the metadata array.
+ *
+ * @param imgfs_file The main in-memory data structure
+ * @param records Where to put the header.max_files records, zeroed if the
+ *        imgFS has none
+ * @return Some error code. 0 if no error.
+ */
+int do_read_ext(const struct imgfs_file *imgfs_file, struct img_ext *records);
+
+/**
+ * @brief Writes the extension record of a slot of the metadata array,
+ *        appending the table of records to the imgFS file if needed.
+ *
+ * @param imgfs_file The main in-memory data structure
+ * @param index The slot
+ * @param record Its record
+ * @return Some error code. 0 if no error.
+ */
+int do_write_ext(struct imgfs_file *imgfs_file, uint32_t index, const struct img_ext *record);
+
 /**
  * @brief Transforms resolution string to its int value.
  *
@@ -168,6 +237,46 @@ int resolution_atoi(const char *resolution);
 int do_read(const char *img_id, int resolution, char **image_buffer,
             uint32_t *image_size, struct imgfs_file *imgfs_file);
 
+/**
+ * @brief Finds the slot of an image in the metadata array.
+ *
+ * @param img_id The ID of the image to be found.
+ * @param imgfs_file The main in-memory data structure
+ * @param index Location of the index of the image
+ * @return Some error code. 0 if no error.
+ */
+int do_find(const char *img_id, const struct imgfs_file *imgfs_file, size_t *index);
+
+/**
+ * @brief Finds where the content of an image is stored in the imgFS file,
+ *        creating the requested resolution if needed.
+ *
+ * Stored content never moves, so it can then be read without the
+ * in-memory structure, e.g. directly from the file descriptor.
+ *
+ * @param img_id The ID of the image to be located.
+ * @param resolution The desired resolution for the image.
+ * @param offset Location of the offset of the content in the file
+ * @param size Location of the size of the content
+ * @param imgfs_file The main in-memory data structure
+ * @return Some error code. 0 if no error.
+ */
+int do_locate(const char *img_id, int resolution, uint64_t *offset,
+              uint32_t *size, struct imgfs_file *imgfs_file);
+
+/**
+ * @brief Reads size bytes of stored content from offset in the imgFS file,
+ *        e.g. a part of an image located with do_locate().
+ *
+ * @param offset Where to start reading in the file
+ * @param size Number of bytes to read
+ * @param buffer Location of the location of the (allocated) content read
+ * @param imgfs_file The main in-memory data structure
+ * @return Some error code. 0 if no error.
+ */
+int do_read_at(uint64_t offset, uint32_t size, char **buffer,
+               struct imgfs_file *imgfs_file);
+
 /**
  * @brief Insert image in the imgFS file
  *
@@ -179,6 +288,89 @@ int do_read(const char *img_id, int resolution, char **image_buffer,
 int do_insert(const char *image_buffer, size_t image_size, const char *img_id,
               struct imgfs_file *imgfs_file);
 
+/**
+ * @brief Starts inserting an image whose content will be given piece by piece.
+ *
+ * Reserves image_size bytes at the end of the imgFS file, so that other
+ * appends (e.g. resized images) go after it while the content is received.
+ *
+ * @param image_size Total size of the image to come
+ * @param stream The insertion state to initialize
+ * @param imgfs_file The main in-memory data structure
+ * @return Some error code. 0 if no error.
+ */
+int do_insert_begin(size_t image_size, struct imgfs_insert_stream *stream,
+                    struct imgfs_file *imgfs_file);
+
+/**
+ * @brief Writes the next piece of a streamed image to its reserved place and
+ *        updates its SHA.
+ *
+ * @param chunk The next bytes of the image
+ * @param chunk_len Number of bytes in chunk
+ * @param stream The insertion state
+ * @param imgfs_file The main in-memory data structure
+ * @return Some error code. 0 if no error.
+ */
+int do_insert_append(const char *chunk, size_t chunk_len,
+                     struct imgfs_insert_stream *stream,
+                     struct imgfs_file *imgfs_file);
+
+/**
+ * @brief Gets the SHA of the content received so far, the stream going on,
+ *        e.g. to know before the commit whether it is a duplicate.
+ *
+ * @param stream The insertion state
+ * @param SHA Where to put the SHA, of SHA256_DIGEST_LENGTH bytes
+ * @return Some error code. 0 if no error.
+ */
+int do_insert_sha(const struct imgfs_insert_stream *stream, unsigned char *SHA);
+
+/**
+ * @brief Ends a streamed insertion: does the deduplication and writes the
+ *        metadata.
+ *
+ * If the content already exists in the imgFS, the reserved space is given
+ * back. Otherwise, if the stream was given an optimized content, it is
+ * stored instead (only written here, it is made by the caller without
+ * holding any lock); the SHA remains the one of the content
+ * received, so that the same upload is still found as a duplicate. The
+ * stream is released in all cases, even on error.
+ *
+ * @param img_id Image ID
+ * @param stream The insertion state
+ * @param imgfs_file The main in-memory data structure
+ * @return Some error code. 0 if no error.
+ */
+int do_insert_commit(const char *img_id, struct imgfs_insert_stream *stream,
+                     struct imgfs_file *imgfs_file);
+
+/**
+ * @brief Ends a streamed insertion by giving another ID to an existing
+ *        image rather than storing the content received, e.g. since it
+ *        looks the same.
+ *
+ * The reserved space is given back. The stream is released in all cases,
+ * even on error.
+ *
+ * @param img_id Image ID
+ * @param index The slot of the existing image in the metadata array
+ * @param stream The insertion state, NULL if the content was not streamed
+ * @param imgfs_file The main in-memory data structure
+ * @return Some error code. 0 if no error.
+ */
+int do_insert_alias(const char *img_id, size_t index, struct imgfs_insert_stream *stream,
+                    struct imgfs_file *imgfs_file);
+
+/**
+ * @brief Cancels a streamed insertion and gives back its reserved space.
+ *
+ * @param stream The insertion state
+ * @param imgfs_file The main in-memory data structure
+ */
+void do_insert_abort(struct imgfs_insert_stream *stream,
+                     struct imgfs_file *imgfs_file);
+
 /**
  * @brief Removes the deleted images by moving the existing ones
  *
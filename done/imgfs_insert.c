@@ -2,72 +2,300 @@
 #include "image_content.h"
 #include "image_dedup.h"
 #include "error.h"
-#include <openssl/sha.h> // for SHA256()
+#include "util.h"
+#include <openssl/evp.h> // for EVP_Digest*()
 #include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h> // for ftruncate()
 
-int do_insert(const char *image_buffer, size_t image_size, const char *img_id, struct imgfs_file *imgfs_file)
+// free the stream and give back its reserved space if it is still at the end of the file
+static void release_stream(struct imgfs_insert_stream *stream, struct imgfs_file *imgfs_file, bool rollback)
 {
-    M_REQUIRE_NON_NULL(image_buffer);
-    M_REQUIRE_NON_NULL(img_id);
+    if (rollback && fflush(imgfs_file->file) == 0 && fseek(imgfs_file->file, 0, SEEK_END) == 0) {
+        const long end = ftell(imgfs_file->file);
+        if (end >= 0 && (uint64_t) end == stream->offset + stream->size &&
+            ftruncate(fileno(imgfs_file->file), (off_t) stream->offset) == -1) {
+            perror("ftruncate() in release_stream()");
+        }
+    }
+    EVP_MD_CTX_free(stream->sha_ctx);
+    free(stream->probe);
+    free(stream->optimized);
+    stream->sha_ctx = NULL;
+    stream->probe = NULL;
+    stream->optimized = NULL;
+}
+
+// get the resolution from the kept prefix, or from the whole content read back when the header is further
+static int stream_resolution(struct img_metadata *metadata, const struct imgfs_insert_stream *stream,
+                             struct imgfs_file *imgfs_file)
+{
+    int ret = get_resolution(&metadata->orig_res[1], &metadata->orig_res[0], stream->probe, stream->probe_len);
+    if (ret == ERR_NONE || stream->probe_len == stream->size) {
+        return ret;
+    }
+    char *image_buffer = malloc(stream->size);
+    if (image_buffer == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    if (fseek(imgfs_file->file, (long) stream->offset, SEEK_SET) ||
+        fread(image_buffer, stream->size, 1, imgfs_file->file) != 1) {
+        free(image_buffer);
+        return ERR_IO;
+    }
+    ret = get_resolution(&metadata->orig_res[1], &metadata->orig_res[0], image_buffer, stream->size);
+    free(image_buffer);
+    return ret;
+}
+
+int do_insert_begin(size_t image_size, struct imgfs_insert_stream *stream, struct imgfs_file *imgfs_file)
+{
+    M_REQUIRE_NON_NULL(stream);
     M_REQUIRE_NON_NULL(imgfs_file);
-    struct imgfs_header* header = &imgfs_file->header;
+    if (image_size == 0 || image_size > UINT32_MAX) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    if (imgfs_file->header.nb_files >= imgfs_file->header.max_files) {
+        return ERR_IMGFS_FULL;
+    }
+    zero_init_ptr(stream);
+    stream->size      = image_size;
+    stream->probe_len = MIN(image_size, INSERT_PROBE_SIZE);
+    stream->probe     = malloc(stream->probe_len);
+    stream->sha_ctx   = EVP_MD_CTX_new();
+    if (stream->probe == NULL || stream->sha_ctx == NULL) {
+        release_stream(stream, imgfs_file, false);
+        return ERR_OUT_OF_MEMORY;
+    }
+    if (EVP_DigestInit_ex(stream->sha_ctx, EVP_sha256(), NULL) != 1) {
+        release_stream(stream, imgfs_file, false);
+        return ERR_RUNTIME;
+    }
+
+    // writing the last byte reserves the whole space at the end of the file
+    long end = 0;
+    if (fseek(imgfs_file->file, 0, SEEK_END) || (end = ftell(imgfs_file->file)) < 0) {
+        release_stream(stream, imgfs_file, false);
+        return ERR_IO;
+    }
+    stream->offset = (uint64_t) end;
+    if (fseek(imgfs_file->file, (long) image_size - 1, SEEK_CUR) ||
+        fputc(0, imgfs_file->file) == EOF) {
+        release_stream(stream, imgfs_file, true);
+        return ERR_IO;
+    }
+    return ERR_NONE;
+}
+
+int do_insert_append(const char *chunk, size_t chunk_len, struct imgfs_insert_stream *stream,
+                     struct imgfs_file *imgfs_file)
+{
+    M_REQUIRE_NON_NULL(chunk);
+    M_REQUIRE_NON_NULL(stream);
+    M_REQUIRE_NON_NULL(imgfs_file);
+    if (chunk_len > stream->size - stream->written) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    if (chunk_len == 0) {
+        return ERR_NONE;
+    }
+
+    if (stream->written < stream->probe_len) {
+        memcpy(stream->probe + stream->written, chunk, MIN(chunk_len, stream->probe_len - stream->written));
+    }
+    if (EVP_DigestUpdate(stream->sha_ctx, chunk, chunk_len) != 1) {
+        return ERR_RUNTIME;
+    }
+    if (fseek(imgfs_file->file, (long) (stream->offset + stream->written), SEEK_SET) ||
+        fwrite(chunk, chunk_len, 1, imgfs_file->file) != 1) {
+        return ERR_IO;
+    }
+    stream->written += chunk_len;
+    return ERR_NONE;
+}
+
+int do_insert_sha(const struct imgfs_insert_stream *stream, unsigned char *SHA)
+{
+    M_REQUIRE_NON_NULL(stream);
+    M_REQUIRE_NON_NULL(SHA);
+    // from a copy of the running digest, which the commit still needs
+    EVP_MD_CTX* const sha_ctx = EVP_MD_CTX_new();
+    if (sha_ctx == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
     int ret = ERR_NONE;
+    if (EVP_MD_CTX_copy_ex(sha_ctx, stream->sha_ctx) != 1 || EVP_DigestFinal_ex(sha_ctx, SHA, NULL) != 1) {
+        ret = ERR_RUNTIME;
+    }
+    EVP_MD_CTX_free(sha_ctx);
+    return ret;
+}
+
+void do_insert_abort(struct imgfs_insert_stream *stream, struct imgfs_file *imgfs_file)
+{
+    if (stream != NULL && imgfs_file != NULL) {
+        release_stream(stream, imgfs_file, true);
+    }
+}
+
+// stores the optimized content given with the stream instead of the one received
+static int store_optimized(struct img_metadata *metadata, const struct imgfs_insert_stream *stream,
+                           struct imgfs_file *imgfs_file)
+{
+    if (fseek(imgfs_file->file, (long) stream->offset, SEEK_SET) ||
+        fwrite(stream->optimized, stream->optimized_size, 1, imgfs_file->file) != 1) {
+        return ERR_IO;
+    }
+    metadata->size[ORIG_RES] = (uint32_t) stream->optimized_size;
+
+    // the end of the reserved space is given back, if nothing was appended after it
+    if (fflush(imgfs_file->file) == 0 && fseek(imgfs_file->file, 0, SEEK_END) == 0) {
+        const long end = ftell(imgfs_file->file);
+        if (end >= 0 && (uint64_t) end == stream->offset + stream->size &&
+            ftruncate(fileno(imgfs_file->file), (off_t) (stream->offset + stream->optimized_size)) == -1) {
+            perror("ftruncate() in store_optimized()");
+        }
+    }
+    return ERR_NONE;
+}
 
+// the first free slot of the metadata array
+static int find_free_slot(const struct imgfs_file *imgfs_file, uint32_t *index)
+{
+    const struct imgfs_header* header = &imgfs_file->header;
     if (header->nb_files >= header->max_files) {
         return ERR_IMGFS_FULL;
     }
-    bool empty_spot_found         = false;
-    uint32_t metadata_index       = 0;
-    struct img_metadata* metadata = imgfs_file->metadata;
-    for(; !empty_spot_found && metadata_index < header->max_files; ++metadata, ++metadata_index) {
-        if (metadata->is_valid == EMPTY) {
-            empty_spot_found = true;
+    for (uint32_t i = 0; i < header->max_files; ++i) {
+        if (imgfs_file->metadata[i].is_valid == EMPTY) {
+            *index = i;
+            return ERR_NONE;
         }
     }
-    --metadata;
-    --metadata_index;
+    return ERR_IMGFS_FULL;
+}
 
-    if (empty_spot_found) {
-        SHA256((const unsigned char*)image_buffer, image_size, metadata->SHA);
-        strncpy(metadata->img_id, img_id, MAX_IMG_ID + 1);
-        ret = get_resolution(&metadata->orig_res[1], &metadata->orig_res[0], image_buffer, image_size);
-        if (ret != ERR_NONE) {
-            return ret;
-        }
+// marks a filled slot as valid and writes it with the header
+static int write_new_image(struct imgfs_file *imgfs_file, uint32_t metadata_index)
+{
+    struct imgfs_header* header = &imgfs_file->header;
+    struct img_metadata* metadata = imgfs_file->metadata + metadata_index;
+    metadata->is_valid = NON_EMPTY;
+    header->nb_files += 1;
+    header->version += 1;
+
+    if (fseek(imgfs_file->file, 0, SEEK_SET) ||
+        fwrite(header, sizeof(struct imgfs_header), 1, imgfs_file->file) != 1) {
+        return ERR_IO;
+    }
+    if (fseek(imgfs_file->file, (long) (sizeof(struct imgfs_header) + metadata_index * sizeof(struct img_metadata)), SEEK_SET) ||
+        fwrite(metadata, sizeof(struct img_metadata), 1, imgfs_file->file) != 1) {
+        return ERR_IO;
+    }
+    return ERR_NONE;
+}
+
+int do_insert_commit(const char *img_id, struct imgfs_insert_stream *stream, struct imgfs_file *imgfs_file)
+{
+    M_REQUIRE_NON_NULL(stream);
+    M_REQUIRE_NON_NULL(imgfs_file);
+    if (img_id == NULL || stream->written != stream->size) {
+        release_stream(stream, imgfs_file, true);
+        return ERR_INVALID_ARGUMENT;
+    }
+    uint32_t metadata_index = 0;
+    int ret = find_free_slot(imgfs_file, &metadata_index);
+    if (ret != ERR_NONE) {
+        release_stream(stream, imgfs_file, true);
+        return ret;
+    }
+    struct img_metadata* metadata = imgfs_file->metadata + metadata_index;
+
+    if (EVP_DigestFinal_ex(stream->sha_ctx, metadata->SHA, NULL) != 1) {
+        release_stream(stream, imgfs_file, true);
+        return ERR_RUNTIME;
+    }
+    strncpy(metadata->img_id, img_id, MAX_IMG_ID + 1);
+    ret = stream_resolution(metadata, stream, imgfs_file);
+    if (ret == ERR_NONE) {
         ret = do_name_and_content_dedup(imgfs_file, metadata_index);
-        if (ret != ERR_NONE) {
-            return ret;
-        }
-        if (metadata->offset[ORIG_RES] == 0) {
-            if (fseek(imgfs_file->file, 0, SEEK_END) == -1) {
-                return ERR_IO;
-            }
-            uint64_t orig_res_offset = (uint64_t) imgfs_file->file->_offset;
-            if (fwrite(image_buffer, image_size, 1, imgfs_file->file) != 1) {
-                return ERR_IO;
-            }
-            metadata->offset[THUMB_RES] = 0;
-            metadata->offset[SMALL_RES] = 0;
-            metadata->offset[ORIG_RES ] = orig_res_offset;
-            metadata->size[THUMB_RES] = 0;
-            metadata->size[SMALL_RES] = 0;
-            metadata->size[ORIG_RES ] = (uint32_t) image_size;
-        }
-        metadata->is_valid = NON_EMPTY;
-        header->nb_files += 1;
-        header->version += 1;
+    }
+    if (ret != ERR_NONE) {
+        release_stream(stream, imgfs_file, true);
+        return ret;
+    }
 
-        if (fseek(imgfs_file->file, 0, SEEK_SET) ||
-            fwrite(header, sizeof(struct imgfs_header), 1, imgfs_file->file) != 1) {
-            return ERR_IO;
-        }
-        if (fseek(imgfs_file->file, sizeof(struct imgfs_header) + metadata_index*sizeof(struct img_metadata), SEEK_SET) == -1 ||
-            fwrite(metadata, sizeof(struct img_metadata), 1, imgfs_file->file) != 1) {
-            return ERR_IO;
+    // the content already exists: the reserved space is not needed
+    const bool duplicate = metadata->offset[ORIG_RES] != 0;
+    if (!duplicate) {
+        metadata->offset[THUMB_RES] = 0;
+        metadata->offset[SMALL_RES] = 0;
+        metadata->offset[ORIG_RES ] = stream->offset;
+        metadata->size[THUMB_RES] = 0;
+        metadata->size[SMALL_RES] = 0;
+        metadata->size[ORIG_RES ] = (uint32_t) stream->size;
+        metadata->unused_16 = 0;
+        if (stream->optimized != NULL && stream->optimized_size > 0 && stream->optimized_size < stream->size) {
+            ret = store_optimized(metadata, stream, imgfs_file);
         }
     }
+    release_stream(stream, imgfs_file, duplicate || ret != ERR_NONE);
+    if (ret != ERR_NONE) {
+        return ret;
+    }
+    return write_new_image(imgfs_file, metadata_index);
+}
 
-    return ret;
+int do_insert_alias(const char *img_id, size_t index, struct imgfs_insert_stream *stream,
+                    struct imgfs_file *imgfs_file)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    uint32_t metadata_index = 0;
+    int ret = ERR_NONE;
+    if (img_id == NULL) {
+        ret = ERR_INVALID_ARGUMENT;
+    } else if (index >= imgfs_file->header.max_files || imgfs_file->metadata[index].is_valid == EMPTY) {
+        ret = ERR_IMAGE_NOT_FOUND;
+    } else {
+        ret = find_free_slot(imgfs_file, &metadata_index);
+    }
+    if (stream != NULL) {
+        release_stream(stream, imgfs_file, true);
+    }
+    if (ret != ERR_NONE) {
+        return ret;
+    }
+
+    // same content as the existing image: the deduplication does the rest
+    struct img_metadata* metadata = imgfs_file->metadata + metadata_index;
+    const struct img_metadata* existing = imgfs_file->metadata + index;
+    memcpy(metadata->SHA, existing->SHA, SHA256_DIGEST_LENGTH);
+    memcpy(metadata->orig_res, existing->orig_res, sizeof(metadata->orig_res));
+    strncpy(metadata->img_id, img_id, MAX_IMG_ID + 1);
+    ret = do_name_and_content_dedup(imgfs_file, metadata_index);
+    if (ret != ERR_NONE) {
+        return ret;
+    }
+    return write_new_image(imgfs_file, metadata_index);
+}
+
+int do_insert(const char *image_buffer, size_t image_size, const char *img_id, struct imgfs_file *imgfs_file)
+{
+    M_REQUIRE_NON_NULL(image_buffer);
+    M_REQUIRE_NON_NULL(img_id);
+    M_REQUIRE_NON_NULL(imgfs_file);
+
+    struct imgfs_insert_stream stream;
+    int ret = do_insert_begin(image_size, &stream, imgfs_file);
+    if (ret != ERR_NONE) {
+        return ret;
+    }
+    ret = do_insert_append(image_buffer, image_size, &stream, imgfs_file);
+    if (ret != ERR_NONE) {
+        do_insert_abort(&stream, imgfs_file);
+        return ret;
+    }
+    return do_insert_commit(img_id, &stream, imgfs_file);
 }
@@ -6,29 +6,35 @@
 #include <string.h>
 #include <stdlib.h>
 
-int do_read(const char *img_id, int resolution, char **image_buffer, uint32_t *image_size, struct imgfs_file *imgfs_file)
+int do_find(const char *img_id, const struct imgfs_file *imgfs_file, size_t *index)
 {
     M_REQUIRE_NON_NULL(img_id);
-    M_REQUIRE_NON_NULL(image_buffer);
-    M_REQUIRE_NON_NULL(image_size);
     M_REQUIRE_NON_NULL(imgfs_file);
-    const struct imgfs_header* const header = &imgfs_file->header;
-    int ret = ERR_NONE;
+    M_REQUIRE_NON_NULL(index);
 
-    bool image_found                     = false;
-    uint32_t metadata_index              = 0;
-    struct img_metadata* metadata        = &imgfs_file->metadata[0];
-    for(; !image_found && metadata_index < header->max_files; ++metadata, ++metadata_index) {
+    for (uint32_t i = 0; i < imgfs_file->header.max_files; ++i) {
+        const struct img_metadata* const metadata = &imgfs_file->metadata[i];
         if (metadata->is_valid == NON_EMPTY && strcmp(metadata->img_id, img_id) == 0) {
-            image_found = true;
+            *index = i;
+            return ERR_NONE;
         }
     }
-    --metadata;
-    --metadata_index;
+    return ERR_IMAGE_NOT_FOUND;
+}
 
-    if (!image_found) {
-        return ERR_IMAGE_NOT_FOUND;
+int do_locate(const char *img_id, int resolution, uint64_t *offset, uint32_t *size, struct imgfs_file *imgfs_file)
+{
+    M_REQUIRE_NON_NULL(img_id);
+    M_REQUIRE_NON_NULL(offset);
+    M_REQUIRE_NON_NULL(size);
+    M_REQUIRE_NON_NULL(imgfs_file);
+
+    size_t metadata_index = 0;
+    int ret = do_find(img_id, imgfs_file, &metadata_index);
+    if (ret != ERR_NONE) {
+        return ret;
     }
+    const struct img_metadata* const metadata = &imgfs_file->metadata[metadata_index];
 
     if ((metadata->size[resolution] == 0 || metadata->offset[resolution] == 0) && resolution != ORIG_RES) {
         ret = lazily_resize(resolution, imgfs_file, metadata_index);
@@ -36,17 +42,48 @@ int do_read(const char *img_id, int resolution, char **image_buffer, uint32_t *i
             return ret;
         }
     }
-    char* buffer_out = malloc(metadata->size[resolution]);
+    *offset = metadata->offset[resolution];
+    *size   = metadata->size[resolution];
+
+    return ret;
+}
+
+int do_read_at(uint64_t offset, uint32_t size, char **buffer, struct imgfs_file *imgfs_file)
+{
+    M_REQUIRE_NON_NULL(buffer);
+    M_REQUIRE_NON_NULL(imgfs_file);
+
+    char* buffer_out = malloc(size);
     if (buffer_out == NULL) {
         return ERR_OUT_OF_MEMORY;
     }
-    if (fseek(imgfs_file->file, (signed) metadata->offset[resolution], SEEK_SET) ||
-        fread(buffer_out, metadata->size[resolution], 1, imgfs_file->file) != 1) {
+    if (fseek(imgfs_file->file, (signed) offset, SEEK_SET) ||
+        fread(buffer_out, size, 1, imgfs_file->file) != 1) {
         free(buffer_out);
         return ERR_IO;
     }
-    *image_buffer = buffer_out;
-    *image_size   = metadata->size[resolution];
+    *buffer = buffer_out;
+    return ERR_NONE;
+}
+
+int do_read(const char *img_id, int resolution, char **image_buffer, uint32_t *image_size, struct imgfs_file *imgfs_file)
+{
+    M_REQUIRE_NON_NULL(img_id);
+    M_REQUIRE_NON_NULL(image_buffer);
+    M_REQUIRE_NON_NULL(image_size);
+    M_REQUIRE_NON_NULL(imgfs_file);
+
+    uint64_t offset = 0;
+    uint32_t size = 0;
+    int ret = do_locate(img_id, resolution, &offset, &size, imgfs_file);
+    if (ret != ERR_NONE) {
+        return ret;
+    }
+    ret = do_read_at(offset, size, image_buffer, imgfs_file);
+    if (ret != ERR_NONE) {
+        return ret;
+    }
+    *image_size = size;
 
     return ret;
 }
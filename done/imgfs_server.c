@@ -40,6 +40,12 @@ static void set_signal_handler(void)
         perror("sigaction() in set_signal_handler()");
         abort();
     }
+    // a peer gone while it is answered (or closed for being idle) fails the send, not the server
+    action.sa_handler = SIG_IGN;
+    if (sigaction(SIGPIPE, &action, NULL) < 0) {
+        perror("sigaction() in set_signal_handler()");
+        abort();
+    }
 }
 
 /********************************************************************/
@@ -10,24 +10,89 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h> // uint16_t
+#include <inttypes.h> // PRIu32, PRIu64
 #include <stdbool.h>
+#include <unistd.h> // sysconf
 #include <vips/vips.h>
 #include <pthread.h>
 #include <stdbool.h>
+#include <json-c/json.h>
 
 #include "error.h"
 #include "http_prot.h"
 #include "util.h" // atouint16
 #include "imgfs.h"
+#include "image_content.h"
 #include "http_net.h"
 #include "imgfs_server_service.h"
+#include "image_pregen.h"
+#include "image_executor.h"
+#include "image_optimize.h"
+#include "image_placeholder.h"
+#include "image_similar.h"
+#include "variant_cache.h"
+#include "static_cache.h"
 
-// Main in-memory structure for imgFS
-static struct imgfs_file fs_file;
+#define MAX_STORES 32
+#define MAX_STORE_NAME 31
+
+#define MAX_RESIZES_IN_FLIGHT 64
+
+// A resized image being created, that other requests for it wait for
+struct resize_in_flight {
+    size_t index; // slot of the image in the metadata array
+    int res;      // CUSTOM_RES for a version of the variant cache, identified by the fields below
+    unsigned char SHA[SHA256_DIGEST_LENGTH];
+    uint16_t width;
+    uint16_t height;
+    int format;
+    // set by the table
+    unsigned long id;  // tells apart the successive resizes of the same version
+    bool done;
+    int ret;           // result of the resize once done, kept until its waiters have read it
+    size_t nb_waiting;
+};
+
+// What is done with an upload that looks like an image of the store
+enum near_policy { NEAR_OFF, NEAR_INDEX, NEAR_REJECT, NEAR_ALIAS };
+
+// One served imgFS file, with its own lock
+struct imgfs_store {
+    char name[MAX_STORE_NAME + 1]; // empty for the main store, served directly under URI_ROOT
+    struct imgfs_file fs_file;     // main in-memory structure for imgFS
+    pthread_mutex_t mutex;
+    int format;                    // FORMAT_* of the resized images it creates
+    uint32_t budget[ORIG_RES];     // maximum size of its resized JPEG images, 0 if none
+    bool box_filter[ORIG_RES];     // resolutions resized with a box filter rather than by libvips
+    bool optimize_jpeg;            // uploads stored losslessly optimized, see optimize_jpeg()
+    enum near_policy near_duplicates; // NEAR_OFF if its images are not hashed
+    unsigned near_distance;        // largest distance between the hashes of near-duplicates
+    bool placeholders;             // blurhash of its images made with their first resized version
+    struct img_ext* ext;           // extension records of its slots, when hashed or with placeholders
+    struct similar_index similar;  // perceptual hashes of its images, when hashed
+    // resized images being created; protected by mutex
+    struct resize_in_flight in_flight[MAX_RESIZES_IN_FLIGHT];
+    size_t nb_in_flight;
+    unsigned long last_resize_id;
+    pthread_cond_t resize_done;    // signaled whenever one of them is finished
+};
+
+static const char* const FORMAT_TYPES[NB_FORMATS] = { "image/jpeg", "image/webp", "image/avif" };
+
+static struct imgfs_store stores[MAX_STORES];
+static size_t nb_stores = 0;
 static uint16_t server_port;
-static pthread_mutex_t mutex;
+// send images with sendfile(2) straight from the imgFS file, rather than reading them in memory first
+static bool use_sendfile = true;
+
+// images can also be read at any size, rounded up to one of these
+#define MAX_SIZE_BUCKETS 16
+static uint16_t size_buckets[MAX_SIZE_BUCKETS] = { 64, 128, 256, 512, 1024, 2048 };
+static size_t nb_size_buckets = 6;
+#define DEFAULT_VARIANT_CACHE_MB 64
 
 #define URI_ROOT "/imgfs"
+#define HEADERS_SIZE 256
 #define STARTING_VALID_PORT 1024
 
 /**********************************************************************
@@ -41,6 +106,15 @@ static int reply_error_msg(int connection, int error)
         fprintf(stderr, "reply_error_msg(): sprintf() failed...\n");
         return ERR_RUNTIME;
     }
+    if (error == ERR_BUSY) {
+        // the image processing queue is full: nothing wrong with the request itself
+        return http_reply(connection, HTTP_SERVICE_UNAVAILABLE, "Retry-After: 1" HTTP_LINE_DELIM,
+                          err_msg, strlen(err_msg));
+    }
+    if (error == ERR_NEAR_DUPLICATE) {
+        // refused by -near_duplicates reject: the store holds an image that looks the same
+        return http_reply(connection, HTTP_CONFLICT, "", err_msg, strlen(err_msg));
+    }
     return http_reply(connection, "500 Internal Server Error", "",
                       err_msg, strlen(err_msg));
 }
@@ -59,14 +133,95 @@ static int reply_302_msg(int connection)
     return http_reply(connection, "302 Found", location, "", 0);
 }
 
-static int handle_list_call(int connection)
+/**********************************************************************
+ * Sends 416 message for a range outside of the content.
+ ********************************************************************** */
+static int reply_416_msg(int connection, uint32_t content_len)
+{
+    char content_range[ERR_MSG_SIZE];
+    if (snprintf(content_range, ERR_MSG_SIZE, "Content-Range: bytes */%" PRIu32 HTTP_LINE_DELIM,
+                 content_len) < 0) {
+        fprintf(stderr, "reply_416_msg(): sprintf() failed...\n");
+        return ERR_RUNTIME;
+    }
+    return http_reply(connection, HTTP_RANGE_NOT_SATISFIABLE, content_range, "", 0);
+}
+
+// whether the extension record of a slot is the one of its current content
+static bool has_ext(const struct imgfs_store* store, size_t index)
 {
+    const struct img_metadata* const metadata = &store->fs_file.metadata[index];
+    return store->ext != NULL && metadata->is_valid == NON_EMPTY &&
+           memcmp(store->ext[index].SHA, metadata->SHA, SHA256_DIGEST_LENGTH) == 0;
+}
+
+// the extension record of a slot, emptied if it was made for another content
+static struct img_ext* slot_ext(struct imgfs_store* store, size_t index)
+{
+    struct img_ext* const ext = &store->ext[index];
+    if (!has_ext(store, index)) {
+        zero_init_ptr(ext);
+        memcpy(ext->SHA, store->fs_file.metadata[index].SHA, SHA256_DIGEST_LENGTH);
+    }
+    return ext;
+}
+
+// adds to a list in JSON the placeholders of the images that have one, by ID
+static int add_placeholders(const struct imgfs_store* store, char** json_string)
+{
+    struct json_object* const json_obj = json_tokener_parse(*json_string);
+    struct json_object* const placeholders = json_object_new_object();
+    if (json_obj == NULL || placeholders == NULL ||
+        json_object_object_add(json_obj, "Placeholders", placeholders) == -1) {
+        json_object_put(placeholders);
+        json_object_put(json_obj);
+        return ERR_RUNTIME;
+    }
+    int ret = ERR_NONE;
+    for (size_t i = 0; ret == ERR_NONE && i < store->fs_file.header.max_files; ++i) {
+        if (has_ext(store, i) && store->ext[i].placeholder[0] != '\0') {
+            const char* const placeholder = store->ext[i].placeholder;
+            struct json_object* const json_placeholder =
+                json_object_new_string_len(placeholder, (int) strnlen(placeholder, PLACEHOLDER_SIZE));
+            if (json_placeholder == NULL ||
+                json_object_object_add(placeholders, store->fs_file.metadata[i].img_id, json_placeholder) == -1) {
+                json_object_put(json_placeholder);
+                ret = ERR_RUNTIME;
+            }
+        }
+    }
+    if (ret == ERR_NONE) {
+        char* const with_placeholders = strdup(json_object_to_json_string(json_obj));
+        if (with_placeholders == NULL) {
+            ret = ERR_OUT_OF_MEMORY;
+        } else {
+            free(*json_string);
+            *json_string = with_placeholders;
+        }
+    }
+    json_object_put(json_obj);
+    return ret;
+}
+
+static int handle_list_call(struct imgfs_store* store, struct http_message* msg, int connection)
+{
+    // list?placeholders=1 also gives the placeholders of the images
+    char placeholders[2];
+    const bool with_placeholders = http_get_var(&msg->uri, "placeholders", placeholders, sizeof(placeholders)) > 0 &&
+                                   strcmp(placeholders, "1") == 0;
     char* json_string;
-    if (pthread_mutex_lock(&mutex)) {
+    if (pthread_mutex_lock(&store->mutex)) {
         return ERR_THREADING;
     }
-    int res = do_list(&fs_file, JSON, &json_string);
-    if (pthread_mutex_unlock(&mutex)) {
+    int res = do_list(&store->fs_file, JSON, &json_string);
+    if (res == ERR_NONE && with_placeholders) {
+        res = add_placeholders(store, &json_string);
+        if (res != ERR_NONE) {
+            free(json_string);
+        }
+    }
+    if (pthread_mutex_unlock(&store->mutex)) {
+        if (res == ERR_NONE) free(json_string);
         return ERR_THREADING;
     }
     if (res != ERR_NONE) {
@@ -77,46 +232,566 @@ static int handle_list_call(int connection)
     return reply;
 }
 
-static int handle_read_call(struct http_message* msg, int connection)
+/**********************************************************************
+ * Resizes in flight: the first request for a missing resolution (or for
+ * a version missing from the variant cache) creates it, the concurrent
+ * ones wait for it rather than doing the same work, and get its result:
+ * if it failed, they fail the same way instead of trying again one after
+ * the other. To be called with the store lock held.
+ ********************************************************************** */
+static struct resize_in_flight stored_resize(size_t index, int res)
+{
+    struct resize_in_flight resize;
+    zero_init_var(resize);
+    resize.index = index;
+    resize.res   = res;
+    return resize;
+}
+
+static struct resize_in_flight variant_resize(const unsigned char* SHA, uint16_t width, uint16_t height,
+                                              int format)
+{
+    struct resize_in_flight resize = stored_resize(0, CUSTOM_RES);
+    memcpy(resize.SHA, SHA, SHA256_DIGEST_LENGTH);
+    resize.width  = width;
+    resize.height = height;
+    resize.format = format;
+    return resize;
+}
+
+static bool same_resize(const struct resize_in_flight* a, const struct resize_in_flight* b)
+{
+    if (a->res != b->res) {
+        return false;
+    }
+    if (a->res != CUSTOM_RES) {
+        return a->index == b->index;
+    }
+    return memcmp(a->SHA, b->SHA, SHA256_DIGEST_LENGTH) == 0 &&
+           a->width == b->width && a->height == b->height && a->format == b->format;
+}
+
+// the unfinished resize of that version, NULL if none
+static struct resize_in_flight* find_in_flight(struct imgfs_store* store, const struct resize_in_flight* resize)
+{
+    for (size_t i = 0; i < store->nb_in_flight; ++i) {
+        if (!store->in_flight[i].done && same_resize(&store->in_flight[i], resize)) {
+            return &store->in_flight[i];
+        }
+    }
+    return NULL;
+}
+
+static bool is_in_flight(struct imgfs_store* store, const struct resize_in_flight* resize)
+{
+    return find_in_flight(store, resize) != NULL;
+}
+
+static size_t in_flight_slot(const struct imgfs_store* store, unsigned long id)
+{
+    size_t i = 0;
+    while (i < store->nb_in_flight && store->in_flight[i].id != id) {
+        ++i;
+    }
+    return i;
+}
+
+static void remove_in_flight_slot(struct imgfs_store* store, size_t i)
+{
+    store->in_flight[i] = store->in_flight[--store->nb_in_flight];
+}
+
+// the id to finish it with, 0 if it cannot be shared
+static unsigned long add_in_flight(struct imgfs_store* store, const struct resize_in_flight* resize)
+{
+    if (store->nb_in_flight == MAX_RESIZES_IN_FLIGHT) {
+        // the resize is then simply not shared
+        return 0;
+    }
+    struct resize_in_flight* const added = &store->in_flight[store->nb_in_flight++];
+    *added = *resize;
+    added->id = ++store->last_resize_id;
+    added->done = false;
+    added->ret = ERR_NONE;
+    added->nb_waiting = 0;
+    return added->id;
+}
+
+// hands the result of a resize to the requests waiting for it
+static void finish_in_flight(struct imgfs_store* store, unsigned long id, int ret)
+{
+    const size_t i = in_flight_slot(store, id);
+    if (i == store->nb_in_flight) {
+        return;
+    }
+    if (store->in_flight[i].nb_waiting == 0) {
+        remove_in_flight_slot(store, i);
+    } else {
+        store->in_flight[i].done = true;
+        store->in_flight[i].ret = ret;
+    }
+    pthread_cond_broadcast(&store->resize_done);
+}
+
+// waits for a resize in flight, and returns its result
+static int wait_in_flight(struct imgfs_store* store, const struct resize_in_flight* resize)
+{
+    struct resize_in_flight* const waited = find_in_flight(store, resize);
+    if (waited == NULL) {
+        return ERR_NONE;
+    }
+    const unsigned long id = waited->id;
+    ++waited->nb_waiting;
+    size_t i = 0;
+    for (;;) {
+        // the slot moves as other resizes are removed
+        i = in_flight_slot(store, id);
+        if (store->in_flight[i].done) {
+            break;
+        }
+        pthread_cond_wait(&store->resize_done, &store->mutex);
+    }
+    const int ret = store->in_flight[i].ret;
+    if (--store->in_flight[i].nb_waiting == 0) {
+        remove_in_flight_slot(store, i);
+    }
+    return ret;
+}
+
+// resize_run() as an executor_task
+static int resize_task(void* job)
+{
+    return resize_run(job);
+}
+
+/**********************************************************************
+ * Placeholders of the images, shared by the slots of the same content.
+ * To be called with the store lock held.
+ ********************************************************************** */
+static bool has_placeholder(const struct imgfs_store* store, size_t index)
+{
+    return has_ext(store, index) && store->ext[index].placeholder[0] != '\0';
+}
+
+static int record_placeholder(struct imgfs_store* store, const unsigned char* SHA, const char* placeholder)
+{
+    int ret = ERR_NONE;
+    for (size_t i = 0; ret == ERR_NONE && i < store->fs_file.header.max_files; ++i) {
+        const struct img_metadata* const metadata = &store->fs_file.metadata[i];
+        if (metadata->is_valid == NON_EMPTY && memcmp(metadata->SHA, SHA, SHA256_DIGEST_LENGTH) == 0 &&
+            !has_placeholder(store, i)) {
+            struct img_ext* const ext = slot_ext(store, i);
+            strncpy(ext->placeholder, placeholder, PLACEHOLDER_SIZE - 1);
+            ret = do_write_ext(&store->fs_file, (uint32_t) i, ext);
+        }
+    }
+    return ret;
+}
+
+// the placeholder of a duplicate, which gets no resized images of its own
+static int inherit_placeholder(struct imgfs_store* store, size_t index)
+{
+    const unsigned char* const SHA = store->fs_file.metadata[index].SHA;
+    for (size_t i = 0; i < store->fs_file.header.max_files; ++i) {
+        if (has_placeholder(store, i) && memcmp(store->ext[i].SHA, SHA, SHA256_DIGEST_LENGTH) == 0) {
+            return record_placeholder(store, SHA, store->ext[i].placeholder);
+        }
+    }
+    return ERR_NONE;
+}
+
+// a resize that also makes the placeholder of the image if asked
+struct placeholder_resize {
+    struct resize_job* job;
+    bool make_placeholder;
+    char placeholder[PLACEHOLDER_SIZE]; // empty if none was made
+};
+
+static int placeholder_resize_task(void* arg)
+{
+    struct placeholder_resize* const task = arg;
+    const int ret = resize_run(task->job);
+    if (ret != ERR_NONE || !task->make_placeholder) {
+        return ret;
+    }
+    // from the smallest version created; the resize succeeded all the same if it fails
+    for (int res = 0; res < ORIG_RES; ++res) {
+        if (task->job->width[res] != 0 && task->job->buffer_out[res] != NULL) {
+            if (image_placeholder(task->job->buffer_out[res], task->job->buffer_out_len[res],
+                                  task->placeholder) != ERR_NONE) {
+                task->placeholder[0] = '\0';
+            }
+            break;
+        }
+    }
+    return ret;
+}
+
+/**********************************************************************
+ * Creates the resolutions of a prepared job. To be called with the store
+ * lock held, which is released while resizing, so that other requests on
+ * the store are not stalled behind it.
+ ********************************************************************** */
+static int run_resize(struct imgfs_store* store, struct resize_job* job)
+{
+    const size_t index = job->index;
+    unsigned long shared[NB_RES] = { 0 };
+    for (int res = 0; res < ORIG_RES; ++res) {
+        if (job->width[res] != 0) {
+            const struct resize_in_flight resize = stored_resize(index, res);
+            shared[res] = add_in_flight(store, &resize);
+        }
+    }
+    struct placeholder_resize task = { job, store->placeholders && !has_placeholder(store, index), "" };
+    unsigned char SHA[SHA256_DIGEST_LENGTH]; // the job is released by resize_commit()
+    memcpy(SHA, job->SHA, SHA256_DIGEST_LENGTH);
+    pthread_mutex_unlock(&store->mutex);
+
+    int ret = executor_run(placeholder_resize_task, &task);
+
+    // not checked: the waiting requests must be woken up whatever happens
+    pthread_mutex_lock(&store->mutex);
+    if (ret == ERR_NONE) {
+        ret = resize_commit(job, &store->fs_file);
+    } else {
+        resize_release(job);
+    }
+    for (int res = 0; res < ORIG_RES; ++res) {
+        if (shared[res] != 0) {
+            finish_in_flight(store, shared[res], ret);
+        }
+    }
+    if (ret == ERR_NONE && task.placeholder[0] != '\0' &&
+        record_placeholder(store, SHA, task.placeholder) != ERR_NONE) {
+        // made again with the next resized version
+        debug_printf("run_resize(): the placeholder of image %zu could not be recorded\n", index);
+    }
+    return ret;
+}
+
+// how the resized images of a store are encoded
+static void set_encoding(const struct imgfs_store* store, struct resize_job* job)
+{
+    job->format = store->format;
+    memcpy(job->budget, store->budget, sizeof(store->budget));
+    memcpy(job->box_filter, store->box_filter, sizeof(store->box_filter));
+}
+
+/**********************************************************************
+ * Locates an image in a store, creating the requested resolution if
+ * needed.
+ ********************************************************************** */
+static int locate_image(struct imgfs_store* store, const char* img_id, int res,
+                        uint64_t* offset, uint32_t* size, int* format)
+{
+    struct imgfs_file* const fs_file = &store->fs_file;
+    size_t index = 0;
+    int ret = ERR_NONE;
+
+    if (pthread_mutex_lock(&store->mutex)) {
+        return ERR_THREADING;
+    }
+    bool resized = false;
+    for (;;) {
+        ret = do_find(img_id, fs_file, &index);
+        if (ret != ERR_NONE || res == ORIG_RES || fs_file->metadata[index].size[res] != 0) {
+            break;
+        }
+        if (resized) {
+            // the commit did not create it: resizing again would not either
+            ret = ERR_IO;
+            break;
+        }
+        const struct resize_in_flight resize = stored_resize(index, res);
+        if (is_in_flight(store, &resize)) {
+            // look again once it is done, as the image may have been replaced meanwhile
+            ret = wait_in_flight(store, &resize);
+            if (ret != ERR_NONE) {
+                break;
+            }
+            continue;
+        }
+        struct resize_job job;
+        ret = resize_prepare(res, fs_file, index, &job);
+        if (ret == ERR_NONE) {
+            set_encoding(store, &job);
+            ret = run_resize(store, &job);
+            resized = true;
+        }
+        if (ret != ERR_NONE) {
+            break;
+        }
+    }
+    if (ret == ERR_NONE) {
+        *offset = fs_file->metadata[index].offset[res];
+        *size   = fs_file->metadata[index].size[res];
+        *format = res == ORIG_RES ? FORMAT_JPEG : (int) GET_FORMAT(&fs_file->metadata[index], res);
+        // what was just written must reach the file descriptor before the kernel reads it
+        if (use_sendfile && fflush(fs_file->file)) {
+            ret = ERR_IO;
+        }
+    }
+    if (pthread_mutex_unlock(&store->mutex)) {
+        return ERR_THREADING;
+    }
+    return ret;
+}
+
+/**********************************************************************
+ * Sends stored content, from the imgFS file, or from memory when data is
+ * not NULL. Only a part of it may be asked for, e.g. to resume an
+ * interrupted transfer.
+ ********************************************************************** */
+static int reply_image(struct imgfs_store* store, struct http_message* msg, int connection,
+                       const char* data, uint64_t offset, uint32_t image_size, int format)
+{
+    bool partial = false;
+    uint64_t start = 0;
+    uint64_t len = image_size;
+    struct http_string range;
+    if (http_get_header(msg, "Range", &range)) {
+        int ret = http_parse_range(&range, image_size, &start, &len);
+        if (ret < 0) {
+            return reply_416_msg(connection, image_size);
+        }
+        partial = ret > 0;
+    }
+    const char* const status = partial ? HTTP_PARTIAL_CONTENT : HTTP_OK;
+    char headers[HEADERS_SIZE];
+    // the content depends on the formats the client accepts, unless the store only uses JPEG
+    int headers_len = snprintf(headers, HEADERS_SIZE, "Content-Type: %s" HTTP_LINE_DELIM
+                               "Accept-Ranges: bytes" HTTP_LINE_DELIM "%s", FORMAT_TYPES[format],
+                               store->format != FORMAT_JPEG ? "Vary: Accept" HTTP_LINE_DELIM : "");
+    if (partial && headers_len > 0) {
+        headers_len += snprintf(headers + headers_len, HEADERS_SIZE - (size_t) headers_len,
+                                "Content-Range: bytes %" PRIu64 "-%" PRIu64 "/%" PRIu32 HTTP_LINE_DELIM,
+                                start, start + len - 1, image_size);
+    }
+    if (headers_len < 0 || headers_len >= HEADERS_SIZE) {
+        return reply_error_msg(connection, ERR_RUNTIME);
+    }
+
+    if (data != NULL) {
+        return http_reply(connection, status, headers, data + start, (size_t) len);
+    }
+    if (use_sendfile) {
+        // stored content never moves, so it can be sent without holding the lock
+        return http_reply_file(connection, status, headers, fileno(store->fs_file.file), offset + start, len);
+    }
+
+    char* image_buffer = NULL;
+    if (pthread_mutex_lock(&store->mutex)) {
+        return ERR_THREADING;
+    }
+    int ret = do_read_at(offset + start, (uint32_t) len, &image_buffer, &store->fs_file);
+    if (pthread_mutex_unlock(&store->mutex)) {
+        free(image_buffer);
+        return ERR_THREADING;
+    }
+    if (ret != ERR_NONE) {
+        return reply_error_msg(connection, ret);
+    }
+    ret = http_reply(connection, status, headers, image_buffer, (size_t) len);
+    free(image_buffer);
+    return ret;
+}
+
+/**********************************************************************
+ * Rounds a requested size up to the next bucket; 0 (not given) means
+ * the largest one.
+ ********************************************************************** */
+static uint16_t round_to_bucket(uint16_t size)
+{
+    for (size_t i = 0; i < nb_size_buckets; ++i) {
+        if (size != 0 && size <= size_buckets[i]) {
+            return size_buckets[i];
+        }
+    }
+    return size_buckets[nb_size_buckets - 1];
+}
+
+/**********************************************************************
+ * Gets a size argument of the URI: 1 if found, 0 if absent, or an error.
+ ********************************************************************** */
+static int get_size_var(const struct http_message* msg, const char* name, uint16_t* size)
+{
+    char size_string[8];
+    int ret = http_get_var(&msg->uri, name, size_string, sizeof(size_string));
+    if (ret <= 0) {
+        return ret;
+    }
+    *size = atouint16(size_string);
+    return *size == 0 ? ERR_INVALID_ARGUMENT : 1;
+}
+
+/**********************************************************************
+ * Creates a version of an image missing from the variant cache, and adds
+ * it. The concurrent requests for it wait for the first one, and then
+ * take it from the cache, or fail as it did: if it is not kept there,
+ * they make their own.
+ ********************************************************************** */
+static int make_variant(struct imgfs_store* store, const char* img_id, const unsigned char* SHA,
+                        uint16_t width, uint16_t height, int format, struct variant** variant)
+{
+    const struct resize_in_flight resize = variant_resize(SHA, width, height, format);
+    struct resize_job job;
+    size_t index = 0;
+
+    if (pthread_mutex_lock(&store->mutex)) {
+        return ERR_THREADING;
+    }
+    if (is_in_flight(store, &resize)) {
+        const int ret = wait_in_flight(store, &resize);
+        *variant = ret == ERR_NONE ? variant_cache_get(SHA, width, height, format) : NULL;
+        if (ret != ERR_NONE || *variant != NULL) {
+            return pthread_mutex_unlock(&store->mutex) ? ERR_THREADING : ret;
+        }
+    }
+    int ret = do_find(img_id, &store->fs_file, &index);
+    if (ret == ERR_NONE) {
+        ret = resize_prepare_custom(width, height, format, &store->fs_file, index, &job);
+    }
+    // only claimed by the first request
+    const unsigned long shared = ret == ERR_NONE && !is_in_flight(store, &resize) ?
+                                 add_in_flight(store, &resize) : 0;
+    if (pthread_mutex_unlock(&store->mutex)) {
+        if (ret == ERR_NONE) resize_release(&job);
+        return ERR_THREADING;
+    }
+    if (ret != ERR_NONE) {
+        return ret;
+    }
+    ret = executor_run(resize_task, &job);
+    if (ret == ERR_NONE) {
+        *variant = variant_cache_add(job.SHA, width, height, format, job.buffer_out[CUSTOM_RES],
+                                     job.buffer_out_len[CUSTOM_RES]);
+        job.buffer_out[CUSTOM_RES] = NULL;
+        ret = *variant == NULL ? ERR_OUT_OF_MEMORY : ERR_NONE;
+    }
+    resize_release(&job);
+    if (shared != 0) {
+        // not checked: the waiting requests must be woken up whatever happens
+        pthread_mutex_lock(&store->mutex);
+        finish_in_flight(store, shared, ret);
+        pthread_mutex_unlock(&store->mutex);
+    }
+    return ret;
+}
+
+/**********************************************************************
+ * Sends an image resized to fit in width x height, from the cache of
+ * such versions, or created from the smallest stored version that is
+ * large enough (see resize_prepare_custom()). It is encoded in the format
+ * of the store if the client accepts it, in JPEG otherwise.
+ ********************************************************************** */
+static int reply_custom_size(struct imgfs_store* store, struct http_message* msg, int connection,
+                             const char* img_id, uint16_t width, uint16_t height)
+{
+    struct imgfs_file* const fs_file = &store->fs_file;
+    const int format = store->format != FORMAT_JPEG && http_accepts(msg, FORMAT_TYPES[store->format]) > 0 ?
+                       store->format : FORMAT_JPEG;
+    unsigned char SHA[SHA256_DIGEST_LENGTH];
+    uint64_t offset = 0;
+    uint32_t size = 0;
+    size_t index = 0;
+
+    if (pthread_mutex_lock(&store->mutex)) {
+        return ERR_THREADING;
+    }
+    int ret = do_find(img_id, fs_file, &index);
+    bool original = false;
+    if (ret == ERR_NONE) {
+        const struct img_metadata* const metadata = &fs_file->metadata[index];
+        memcpy(SHA, metadata->SHA, SHA256_DIGEST_LENGTH);
+        // nothing to resize: the original fits
+        original = width >= metadata->orig_res[0] && height >= metadata->orig_res[1];
+        offset = metadata->offset[ORIG_RES];
+        size   = metadata->size[ORIG_RES];
+        if (original && use_sendfile && fflush(fs_file->file)) {
+            ret = ERR_IO;
+        }
+    }
+    if (pthread_mutex_unlock(&store->mutex)) {
+        return ERR_THREADING;
+    }
+    if (ret != ERR_NONE) {
+        return reply_error_msg(connection, ret);
+    }
+    if (original) {
+        return reply_image(store, msg, connection, NULL, offset, size, FORMAT_JPEG);
+    }
+
+    struct variant* variant = variant_cache_get(SHA, width, height, format);
+    if (variant == NULL) {
+        ret = make_variant(store, img_id, SHA, width, height, format, &variant);
+        if (ret == ERR_THREADING) {
+            return ret;
+        }
+        if (ret != ERR_NONE) {
+            return reply_error_msg(connection, ret);
+        }
+    }
+    if (variant->size > UINT32_MAX) {
+        variant_cache_release(variant);
+        return reply_error_msg(connection, ERR_RUNTIME);
+    }
+    ret = reply_image(store, msg, connection, variant->data, 0, (uint32_t) variant->size, format);
+    variant_cache_release(variant);
+    return ret;
+}
+
+static int handle_read_call(struct imgfs_store* store, struct http_message* msg, int connection)
 {
     char res_string[15];
     int res = 0;
     char img_id[MAX_IMG_ID + 1];
-    int ret = http_get_var(&msg->uri, "res", res_string, 15);
-    if (ret == 0) ret = ERR_NOT_ENOUGH_ARGUMENTS;
-    if (ret <= 0) {
+    // either a stored resolution, or any size given by w and/or h
+    uint16_t width = 0;
+    uint16_t height = 0;
+    int ret = get_size_var(msg, "w", &width);
+    if (ret >= 0) {
+        ret = get_size_var(msg, "h", &height);
+    }
+    if (ret < 0) {
         return reply_error_msg(connection, ret);
     }
-    res = resolution_atoi(res_string);
-    if (res == -1) {
-        return reply_error_msg(connection, ERR_RESOLUTIONS);
+    const bool custom_size = width != 0 || height != 0;
+    if (!custom_size) {
+        ret = http_get_var(&msg->uri, "res", res_string, 15);
+        if (ret == 0) ret = ERR_NOT_ENOUGH_ARGUMENTS;
+        if (ret <= 0) {
+            return reply_error_msg(connection, ret);
+        }
+        res = resolution_atoi(res_string);
+        if (res == -1) {
+            return reply_error_msg(connection, ERR_RESOLUTIONS);
+        }
     }
     ret = http_get_var(&msg->uri, "img_id", img_id, MAX_IMG_ID + 1);
     if (ret == 0) ret = ERR_NOT_ENOUGH_ARGUMENTS;
     if (ret <= 0) {
         return reply_error_msg(connection, ret);
     }
+    if (custom_size) {
+        return reply_custom_size(store, msg, connection, img_id, round_to_bucket(width), round_to_bucket(height));
+    }
 
-    char* image_buffer = NULL;
+    uint64_t offset = 0;
     uint32_t image_size = 0;
-    if (pthread_mutex_lock(&mutex)) {
-        return ERR_THREADING;
-    }
-    ret = do_read(img_id, res, &image_buffer, &image_size, &fs_file);
-    if (pthread_mutex_unlock(&mutex)) {
-        free(image_buffer);
-        return ERR_THREADING;
-    }
+    int format = FORMAT_JPEG;
+    ret = locate_image(store, img_id, res, &offset, &image_size, &format);
     if (ret != ERR_NONE) {
-        free(image_buffer);
         return reply_error_msg(connection, ret);
     }
-    ret = http_reply(connection, HTTP_OK, "Content-Type: image/jpeg" HTTP_LINE_DELIM, image_buffer, (size_t) image_size);
-    free(image_buffer);
-    return ret;
+    if (format != FORMAT_JPEG && http_accepts(msg, FORMAT_TYPES[format]) <= 0) {
+        // the stored version is of no use to this client: a JPEG one of the same size is made
+        const uint16_t* const resized_res = store->fs_file.header.resized_res;
+        return reply_custom_size(store, msg, connection, img_id, resized_res[2 * res], resized_res[2 * res + 1]);
+    }
+    return reply_image(store, msg, connection, NULL, offset, image_size, format);
 }
 
-static int handle_delete_call(struct http_message* msg, int connection)
+static int handle_delete_call(struct imgfs_store* store, struct http_message* msg, int connection)
 {
     char img_id[MAX_IMG_ID + 1];
     int ret = http_get_var(&msg->uri, "img_id", img_id, MAX_IMG_ID + 1);
@@ -124,11 +799,11 @@ static int handle_delete_call(struct http_message* msg, int connection)
     if (ret <= 0) {
         return reply_error_msg(connection, ret);
     }
-    if (pthread_mutex_lock(&mutex)) {
+    if (pthread_mutex_lock(&store->mutex)) {
         return ERR_THREADING;
     }
-    ret = do_delete(img_id, &fs_file);
-    if (pthread_mutex_unlock(&mutex)) {
+    ret = do_delete(img_id, &store->fs_file);
+    if (pthread_mutex_unlock(&store->mutex)) {
         return ERR_THREADING;
     }
     if (ret != ERR_NONE) {
@@ -139,37 +814,564 @@ static int handle_delete_call(struct http_message* msg, int connection)
 
 }
 
-static int handle_insert_call(struct http_message* msg, int connection)
+/**********************************************************************
+ * Finds the store addressed by a message: URI_ROOT "/<store name>/<action>"
+ * for the additional stores, URI_ROOT "/<action>" for the main one.
+ * action is set to the part of the URI starting with the action.
+ ********************************************************************** */
+static struct imgfs_store* find_store(const struct http_message* msg, struct http_string* action)
+{
+    if (nb_stores == 0 || !http_match_uri(msg, URI_ROOT "/")) {
+        return NULL;
+    }
+    const size_t root_len = strlen(URI_ROOT);
+    action->val = msg->uri.val + root_len;
+    action->len = msg->uri.len - root_len;
+    for (size_t i = 1; i < nb_stores; ++i) {
+        const size_t name_len = strlen(stores[i].name);
+        if (action->len > name_len + 1 && strncmp(action->val + 1, stores[i].name, name_len) == 0 &&
+            action->val[name_len + 1] == '/') {
+            action->val += name_len + 1;
+            action->len -= name_len + 1;
+            return &stores[i];
+        }
+    }
+    return &stores[0];
+}
+
+// checks whether the action part of an URI starts with name
+static bool match_action(const struct http_string* action, const char* name)
 {
+    const size_t name_len = strlen(name);
+    return action->len >= name_len && strncmp(action->val, name, name_len) == 0;
+}
+
+/**********************************************************************
+ * Streamed upload of an image: written to the imgFS file while it arrives.
+ ********************************************************************** */
+struct insert_upload {
+    struct imgfs_store* store;
+    struct imgfs_insert_stream stream;
+    int err; // first error met while receiving, reported once the request is complete
+};
+
+static int insert_upload_begin(const struct http_message* msg, size_t content_len, void** ctx)
+{
+    struct http_string action;
+    struct imgfs_store* const store = find_store(msg, &action);
+    if (store == NULL || !match_action(&action, "/insert") || !http_match_verb(&msg->method, "POST")) {
+        return 0;
+    }
+    struct insert_upload* upload = malloc(sizeof(struct insert_upload));
+    if (upload == NULL) {
+        return 0;
+    }
+    upload->store = store;
+    upload->err = ERR_NONE;
+    if (pthread_mutex_lock(&store->mutex)) {
+        free(upload);
+        return 0;
+    }
+    int ret = do_insert_begin(content_len, &upload->stream, &store->fs_file);
+    pthread_mutex_unlock(&store->mutex);
+    // let the body be received as usual, the error will be reported by handle_insert_call()
+    if (ret != ERR_NONE) {
+        free(upload);
+        return 0;
+    }
+    *ctx = upload;
+    return 1;
+}
+
+static int insert_upload_chunk(void* ctx, const char* data, size_t len)
+{
+    struct insert_upload* upload = ctx;
+    struct imgfs_store* const store = upload->store;
+    if (upload->err != ERR_NONE) {
+        return ERR_NONE;
+    }
+    if (pthread_mutex_lock(&store->mutex)) {
+        upload->err = ERR_THREADING;
+        return ERR_NONE;
+    }
+    upload->err = do_insert_append(data, len, &upload->stream, &store->fs_file);
+    pthread_mutex_unlock(&store->mutex);
+    return ERR_NONE;
+}
+
+static void insert_upload_abort(void* ctx)
+{
+    struct insert_upload* upload = ctx;
+    struct imgfs_store* const store = upload->store;
+    pthread_mutex_lock(&store->mutex);
+    do_insert_abort(&upload->stream, &store->fs_file);
+    pthread_mutex_unlock(&store->mutex);
+    free(upload);
+}
+
+static const struct http_body_handler insert_upload_handler = {
+    insert_upload_begin, insert_upload_chunk, insert_upload_abort
+};
+
+/**********************************************************************
+ * Creates the resized images of a new upload, in the background, so that
+ * reads almost never have to. Refused with ERR_BUSY when the executor is
+ * full of requests, and then queued again.
+ ********************************************************************** */
+static int pregen_resized_images(void* owner, const char* img_id)
+{
+    struct imgfs_store* const store = owner;
+    struct resize_job job;
+    size_t index = 0;
+
+    if (pthread_mutex_lock(&store->mutex)) {
+        return ERR_THREADING;
+    }
+    // all the missing resolutions, from a single decode
+    int ret = do_find(img_id, &store->fs_file, &index);
+    if (ret == ERR_NONE) {
+        ret = resize_prepare_all(&store->fs_file, index, &job);
+        set_encoding(store, &job);
+    }
+    if (ret == ERR_NONE) {
+        // the ones a request is already creating are left to it
+        for (int res = 0; res < ORIG_RES; ++res) {
+            const struct resize_in_flight resize = stored_resize(index, res);
+            if (is_in_flight(store, &resize)) {
+                job.width[res] = job.height[res] = 0;
+            }
+        }
+        ret = run_resize(store, &job);
+    }
+    pthread_mutex_unlock(&store->mutex);
+    // e.g. the image was deleted in the meantime
+    if (ret != ERR_NONE && ret != ERR_BUSY) {
+        debug_printf("pregen_resized_images(): %s for %s\n", ERR_MSG(ret), img_id);
+    }
+    return ret;
+}
+
+/**********************************************************************
+ * Perceptual hashes of the images of a store, to find the ones that look
+ * alike. To be called with the store lock held.
+ ********************************************************************** */
+static bool is_hashed(const struct imgfs_store* store, size_t index)
+{
+    return has_ext(store, index) && store->ext[index].phash != 0;
+}
+
+// the index without the images deleted or replaced meanwhile
+static int rebuild_similar(struct imgfs_store* store)
+{
+    similar_index_free(&store->similar);
+    int ret = ERR_NONE;
+    for (size_t i = 0; ret == ERR_NONE && i < store->fs_file.header.max_files; ++i) {
+        if (is_hashed(store, i)) {
+            ret = similar_index_add(&store->similar, store->ext[i].phash, i);
+        }
+    }
+    return ret;
+}
+
+static int record_phash(struct imgfs_store* store, size_t index, uint64_t phash)
+{
+    struct img_ext* const ext = slot_ext(store, index);
+    ext->phash = phash;
+    int ret = do_write_ext(&store->fs_file, (uint32_t) index, ext);
+    if (ret != ERR_NONE) {
+        return ret;
+    }
+    // the nodes of the images replaced are only dropped when rebuilding
+    if (store->similar.nb_nodes >= 2 * (size_t) store->fs_file.header.max_files) {
+        return rebuild_similar(store);
+    }
+    return similar_index_add(&store->similar, phash, index);
+}
+
+// the hash recorded for a stored image, or for the same content under another ID;
+// 0 if there is none, since it would take decoding the image
+static int recorded_phash(struct imgfs_store* store, size_t index, uint64_t* phash)
+{
+    const struct img_metadata* const metadata = &store->fs_file.metadata[index];
+    *phash = 0;
+    if (is_hashed(store, index)) {
+        *phash = store->ext[index].phash;
+        return ERR_NONE;
+    }
+    for (size_t i = 0; i < store->fs_file.header.max_files; ++i) {
+        if (is_hashed(store, i) && memcmp(store->ext[i].SHA, metadata->SHA, SHA256_DIGEST_LENGTH) == 0) {
+            *phash = store->ext[i].phash;
+            return record_phash(store, index, *phash);
+        }
+    }
+    return ERR_NONE;
+}
+
+// the hash of a stored image, computed and recorded if needed
+static int stored_phash(struct imgfs_store* store, size_t index, uint64_t* phash)
+{
+    const struct img_metadata* const metadata = &store->fs_file.metadata[index];
+    int ret = recorded_phash(store, index, phash);
+    if (ret != ERR_NONE || *phash != 0) {
+        return ret;
+    }
+    char* content = NULL;
+    ret = do_read_at(metadata->offset[ORIG_RES], metadata->size[ORIG_RES], &content, &store->fs_file);
+    if (ret == ERR_NONE) {
+        ret = image_phash(content, metadata->size[ORIG_RES], phash);
+        free(content);
+    }
+    if (ret == ERR_NONE) {
+        ret = record_phash(store, index, *phash);
+    }
+    return ret;
+}
+
+// the images within max_distance of phash, closest first, each once
+static int find_similar(const struct imgfs_store* store, uint64_t phash, unsigned max_distance,
+                        struct similar_match** matches, size_t* nb_matches)
+{
+    int ret = similar_index_find(&store->similar, phash, max_distance, matches, nb_matches);
+    if (ret != ERR_NONE) {
+        return ret;
+    }
+    // the node of a replaced image is at the distance of its current content only by chance,
+    // in which case the image is indeed that close
+    size_t kept = 0;
+    for (size_t i = 0; i < *nb_matches; ++i) {
+        const struct similar_match match = (*matches)[i];
+        if (is_hashed(store, match.index) &&
+            phash_distance(phash, store->ext[match.index].phash) == match.distance &&
+            (kept == 0 || (*matches)[kept - 1].index != match.index)) {
+            (*matches)[kept++] = match;
+        }
+    }
+    *nb_matches = kept;
+    return ERR_NONE;
+}
+
+// reads the extension records of a store
+static int load_ext(struct imgfs_store* store)
+{
+    store->ext = calloc(store->fs_file.header.max_files, sizeof(struct img_ext));
+    if (store->ext == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    return do_read_ext(&store->fs_file, store->ext);
+}
+
+// hashes the images of a store not hashed yet, and indexes them all;
+// the ones that cannot be hashed are left out, as when uploaded
+static int index_store(struct imgfs_store* store)
+{
+    int ret = rebuild_similar(store);
+    size_t nb_hashed = 0;
+    for (size_t i = 0; ret == ERR_NONE && i < store->fs_file.header.max_files; ++i) {
+        if (store->fs_file.metadata[i].is_valid == NON_EMPTY && !is_hashed(store, i)) {
+            uint64_t phash = 0;
+            if (stored_phash(store, i, &phash) == ERR_NONE) {
+                ++nb_hashed;
+            } else {
+                fprintf(stderr, "index_store(): %s could not be hashed\n", store->fs_file.metadata[i].img_id);
+            }
+        }
+    }
+    if (nb_hashed > 0) {
+        printf("%zu images hashed\n", nb_hashed);
+    }
+    return ret;
+}
+
+/**********************************************************************
+ * The insertion of an image. Its content is hashed (and may be optimized)
+ * by the executor, without the store lock; the lock is only taken by the
+ * connection thread, around the accesses to the imgFS file.
+ ********************************************************************** */
+struct insert_task {
+    struct imgfs_store* store;
+    const char* name;
+    struct imgfs_insert_stream* stream; // the content, already written in the imgFS file
+    const char* body;                   // the same content if received in memory, NULL if streamed
+    bool duplicate;                     // already stored: not worth optimizing
+    // made by prepare_upload()
+    bool hashed;
+    uint64_t phash;
+    char* optimized;                    // NULL if not smaller
+    size_t optimized_size;
+};
+
+// the body of a request received in memory, written as do_insert() does, but as a stream that can
+// be given an optimized content; to be called with the store lock held
+static int stream_in_memory(const struct http_message* msg, struct imgfs_insert_stream* stream,
+                            struct imgfs_file* fs_file)
+{
+    int ret = do_insert_begin(msg->body.len, stream, fs_file);
+    if (ret != ERR_NONE) {
+        return ret;
+    }
+    ret = do_insert_append(msg->body.val, msg->body.len, stream, fs_file);
+    if (ret != ERR_NONE) {
+        do_insert_abort(stream, fs_file);
+    }
+    return ret;
+}
+
+// what prepare_upload() needs from the store; to be called with the store lock held
+static int snapshot_upload(struct insert_task* task)
+{
+    struct imgfs_file* const fs_file = &task->store->fs_file;
+    // read back from the file descriptor, bypassing the stream buffer
+    if (task->body == NULL && fflush(fs_file->file)) {
+        return ERR_IO;
+    }
+    if (!task->store->optimize_jpeg) {
+        return ERR_NONE;
+    }
+    unsigned char SHA[SHA256_DIGEST_LENGTH];
+    int ret = do_insert_sha(task->stream, SHA);
+    for (size_t i = 0; ret == ERR_NONE && !task->duplicate && i < fs_file->header.max_files; ++i) {
+        const struct img_metadata* const metadata = &fs_file->metadata[i];
+        task->duplicate = metadata->is_valid == NON_EMPTY && memcmp(metadata->SHA, SHA, SHA256_DIGEST_LENGTH) == 0;
+    }
+    return ret;
+}
+
+// hashes and optimizes an upload, as an executor_task: an upload that cannot be is inserted as usual
+static int prepare_upload(void* arg)
+{
+    struct insert_task* const task = arg;
+    const struct imgfs_store* const store = task->store;
+    const size_t size = task->stream->size;
+    const char* content = task->body;
+    char* copy = NULL;
+    if (content == NULL) {
+        copy = malloc(size);
+        if (copy == NULL ||
+            pread(fileno(store->fs_file.file), copy, size, (off_t) task->stream->offset) != (ssize_t) size) {
+            free(copy);
+            return ERR_NONE;
+        }
+        content = copy;
+    }
+    task->hashed = store->near_duplicates != NEAR_OFF && image_phash(content, size, &task->phash) == ERR_NONE;
+    // e.g. not an image the optimizer knows: stored as received
+    if (store->optimize_jpeg && !task->duplicate &&
+        (optimize_jpeg(content, size, &task->optimized, &task->optimized_size) != ERR_NONE ||
+         task->optimized_size >= size)) {
+        free(task->optimized);
+        task->optimized = NULL;
+    }
+    free(copy);
+    return ERR_NONE;
+}
+
+// stores an upload whose hash is known, or gives its ID to an image that looks the same
+static int insert_hashed(struct insert_task* task)
+{
+    struct imgfs_store* const store = task->store;
+    struct similar_match* matches = NULL;
+    size_t nb_matches = 0;
+    uint64_t phash = task->phash;
+    int ret = ERR_NONE;
+    if (store->near_duplicates != NEAR_INDEX) {
+        ret = find_similar(store, phash, store->near_distance, &matches, &nb_matches);
+    }
+    if (ret == ERR_NONE && nb_matches > 0 && store->near_duplicates == NEAR_REJECT) {
+        ret = ERR_NEAR_DUPLICATE;
+    }
+    if (ret != ERR_NONE) {
+        do_insert_abort(task->stream, &store->fs_file);
+        free(matches);
+        return ret;
+    }
+
+    if (nb_matches > 0) {
+        phash = store->ext[matches[0].index].phash;
+        ret = do_insert_alias(task->name, matches[0].index, task->stream, &store->fs_file);
+    } else {
+        ret = do_insert_commit(task->name, task->stream, &store->fs_file);
+    }
+    free(matches);
+    size_t index = 0;
+    if (ret == ERR_NONE && do_find(task->name, &store->fs_file, &index) == ERR_NONE &&
+        record_phash(store, index, phash) != ERR_NONE) {
+        // hashed again when the server restarts
+        debug_printf("insert_hashed(): the hash of %s could not be recorded\n", task->name);
+    }
+    return ret;
+}
+
+// ends the insertion of a prepared upload, which releases its stream; to be called with the
+// store lock held
+static int commit_upload(struct insert_task* task)
+{
+    struct imgfs_store* const store = task->store;
+    if (task->optimized != NULL) {
+        // written by do_insert_commit(), and freed with the stream
+        task->stream->optimized = task->optimized;
+        task->stream->optimized_size = task->optimized_size;
+        task->optimized = NULL;
+    }
+    const int ret = task->hashed ? insert_hashed(task) : do_insert_commit(task->name, task->stream, &store->fs_file);
+    size_t index = 0;
+    if (ret == ERR_NONE && store->placeholders && do_find(task->name, &store->fs_file, &index) == ERR_NONE &&
+        inherit_placeholder(store, index) != ERR_NONE) {
+        debug_printf("commit_upload(): the placeholder of %s could not be recorded\n", task->name);
+    }
+    return ret;
+}
+
+static int handle_insert_call(struct imgfs_store* store, struct http_message* msg, int connection)
+{
+    struct insert_upload* upload = msg->body_ctx;
     char name[MAX_IMG_ID + 1];
     int ret = http_get_var(&msg->uri, "name", name, MAX_IMG_ID + 1);
     if (ret == 0) ret = ERR_NOT_ENOUGH_ARGUMENTS;
     if (ret <= 0) {
+        if (upload != NULL) insert_upload_abort(upload);
         return reply_error_msg(connection, ret);
     }
-    size_t image_size = msg->body.len;
-    char* image_buffer = malloc(image_size);
-    if (image_buffer == NULL) {
-        return reply_error_msg(connection, ERR_OUT_OF_MEMORY);
+    if (upload != NULL && upload->err != ERR_NONE) {
+        ret = upload->err;
+        insert_upload_abort(upload);
+        return reply_error_msg(connection, ret);
     }
-    memcpy(image_buffer, msg->body.val, image_size);
-    if (pthread_mutex_lock(&mutex)) {
-        free(image_buffer);
+
+    struct imgfs_insert_stream in_memory;
+    struct insert_task task;
+    zero_init_var(task);
+    task.store  = store;
+    task.name   = name;
+    task.stream = upload != NULL ? &upload->stream : &in_memory;
+    task.body   = upload != NULL ? NULL : msg->body.val;
+    if (pthread_mutex_lock(&store->mutex)) {
+        if (upload != NULL) insert_upload_abort(upload);
         return ERR_THREADING;
     }
-    ret = do_insert(image_buffer, image_size, name, &fs_file);
-    if (pthread_mutex_unlock(&mutex)) {
-        free(image_buffer);
-        return ERR_THREADING;
+    ret = upload != NULL ? ERR_NONE : stream_in_memory(msg, &in_memory, &store->fs_file);
+    // whether the stream is still to be released
+    bool started = ret == ERR_NONE;
+    if (ret == ERR_NONE && (store->near_duplicates != NEAR_OFF || store->optimize_jpeg)) {
+        ret = snapshot_upload(&task);
+        if (ret == ERR_NONE) {
+            pthread_mutex_unlock(&store->mutex);
+            ret = executor_run(prepare_upload, &task);
+            // not checked: the stream must be released whatever happens
+            pthread_mutex_lock(&store->mutex);
+        }
     }
-    free(image_buffer);
+    if (ret == ERR_NONE) {
+        ret = commit_upload(&task);
+        started = false;
+    }
+    if (started) {
+        do_insert_abort(task.stream, &store->fs_file);
+    }
+    pthread_mutex_unlock(&store->mutex);
+    free(task.optimized);
+    free(upload);
     if (ret != ERR_NONE) {
         return reply_error_msg(connection, ret);
     }
+    pregen_submit(store, name);
     ret = reply_302_msg(connection);
     return ret;
 }
 
+/**********************************************************************
+ * Lists the images that look like one, closest first. Only the hashes
+ * recorded are used: *json is left NULL for an image never hashed (e.g.
+ * that could not be decoded when uploaded).
+ ********************************************************************** */
+static int similar_json(struct imgfs_store* store, const char* img_id, unsigned max_distance, char** json)
+{
+    size_t index = 0;
+    uint64_t phash = 0;
+    struct similar_match* matches = NULL;
+    size_t nb_matches = 0;
+    int ret = do_find(img_id, &store->fs_file, &index);
+    if (ret == ERR_NONE) {
+        ret = recorded_phash(store, index, &phash);
+    }
+    if (ret != ERR_NONE || phash == 0) {
+        return ret;
+    }
+    ret = find_similar(store, phash, max_distance, &matches, &nb_matches);
+    if (ret != ERR_NONE) {
+        return ret;
+    }
+    struct json_object* const json_array = json_object_new_array();
+    struct json_object* const json_obj = json_object_new_object();
+    if (json_array == NULL || json_obj == NULL || json_object_object_add(json_obj, "Images", json_array) == -1) {
+        json_object_put(json_array);
+        json_object_put(json_obj);
+        free(matches);
+        return ERR_RUNTIME;
+    }
+    for (size_t i = 0; ret == ERR_NONE && i < nb_matches; ++i) {
+        if (matches[i].index != index) {
+            struct json_object* const json_id = json_object_new_string(store->fs_file.metadata[matches[i].index].img_id);
+            if (json_id == NULL || json_object_array_add(json_array, json_id) == -1) {
+                json_object_put(json_id);
+                ret = ERR_RUNTIME;
+            }
+        }
+    }
+    free(matches);
+    if (ret == ERR_NONE) {
+        *json = strdup(json_object_to_json_string(json_obj));
+        ret = *json == NULL ? ERR_OUT_OF_MEMORY : ERR_NONE;
+    }
+    json_object_put(json_obj);
+    return ret;
+}
+
+static int handle_similar_call(struct imgfs_store* store, struct http_message* msg, int connection)
+{
+    if (store->near_duplicates == NEAR_OFF) {
+        return reply_error_msg(connection, ERR_INVALID_COMMAND);
+    }
+    char img_id[MAX_IMG_ID + 1];
+    int ret = http_get_var(&msg->uri, "img_id", img_id, MAX_IMG_ID + 1);
+    if (ret == 0) ret = ERR_NOT_ENOUGH_ARGUMENTS;
+    if (ret <= 0) {
+        return reply_error_msg(connection, ret);
+    }
+    // by default, as close as the near-duplicates
+    unsigned max_distance = store->near_distance;
+    char distance[8];
+    ret = http_get_var(&msg->uri, "distance", distance, sizeof(distance));
+    if (ret > 0) {
+        max_distance = atouint16(distance);
+        if ((max_distance == 0 && strcmp(distance, "0") != 0) || max_distance > PHASH_BITS) {
+            ret = ERR_INVALID_ARGUMENT;
+        }
+    }
+    if (ret < 0) {
+        return reply_error_msg(connection, ret);
+    }
+
+    char* json = NULL;
+    if (pthread_mutex_lock(&store->mutex)) {
+        return ERR_THREADING;
+    }
+    ret = similar_json(store, img_id, max_distance, &json);
+    if (pthread_mutex_unlock(&store->mutex)) {
+        free(json);
+        return ERR_THREADING;
+    }
+    if (ret != ERR_NONE) {
+        return reply_error_msg(connection, ret);
+    }
+    if (json == NULL) {
+        static const char not_hashed[] = "Error: image not hashed\n";
+        return http_reply(connection, HTTP_UNPROCESSABLE_CONTENT, "", not_hashed, strlen(not_hashed));
+    }
+    ret = http_reply(connection, HTTP_OK, "Content-Type: application/json" HTTP_LINE_DELIM, json, strlen(json));
+    free(json);
+    return ret;
+}
+
 /**********************************************************************
  * Simple handling of http message.
  ********************************************************************** */
@@ -177,75 +1379,387 @@ int handle_http_message(struct http_message* msg, int connection)
 {
     M_REQUIRE_NON_NULL(msg);
     if (http_match_verb(&msg->uri, "/") || http_match_uri(msg, "/index.html")) {
-        return http_serve_file(connection, BASE_FILE);
+        return static_cache_serve(connection, msg, BASE_FILE);
     }
     debug_printf("handle_http_message() on connection %d. URI: %.*s\n",
                  connection,
                  (int) msg->uri.len, msg->uri.val);
-    if (http_match_uri(msg, URI_ROOT "/list")) {
-        return handle_list_call(connection);
-    } else if (http_match_uri(msg, URI_ROOT "/read")) {
-        return handle_read_call(msg, connection);
-    } else if (http_match_uri(msg, URI_ROOT "/delete")) {
-        return handle_delete_call(msg, connection);
-    } else if (http_match_uri(msg, URI_ROOT "/insert") &&  http_match_verb(&msg->method, "POST")) {
-        return handle_insert_call(msg, connection);
+    struct http_string action;
+    struct imgfs_store* const store = find_store(msg, &action);
+    if (store == NULL) {
+        return reply_error_msg(connection, ERR_INVALID_COMMAND);
+    }
+    if (match_action(&action, "/list")) {
+        return handle_list_call(store, msg, connection);
+    } else if (match_action(&action, "/read")) {
+        return handle_read_call(store, msg, connection);
+    } else if (match_action(&action, "/delete")) {
+        return handle_delete_call(store, msg, connection);
+    } else if (match_action(&action, "/similar")) {
+        return handle_similar_call(store, msg, connection);
+    } else if (match_action(&action, "/insert") &&  http_match_verb(&msg->method, "POST")) {
+        return handle_insert_call(store, msg, connection);
     } else {
         return reply_error_msg(connection, ERR_INVALID_COMMAND);
     }
 }
 
-static void close_all_and_free(bool destroy_mutex, bool close_imgfs_file){
+/********************************************************************
+ * Opens an imgFS file and adds it to the served stores.
+ ********************************************************************** */
+static int open_store(const char* name, const char* imgfs_filename)
+{
+    if (nb_stores >= MAX_STORES) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    // the name is part of the URIs of the store
+    const size_t name_len = strlen(name);
+    if (name_len > MAX_STORE_NAME || (nb_stores > 0 && name_len == 0) ||
+        strspn(name, "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_-") != name_len) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    for (size_t i = 0; i < nb_stores; ++i) {
+        if (strcmp(stores[i].name, name) == 0) {
+            return ERR_INVALID_ARGUMENT;
+        }
+    }
+
+    struct imgfs_store* const store = &stores[nb_stores];
+    zero_init_ptr(store);
+    strncpy(store->name, name, MAX_STORE_NAME);
+    int ret = do_open(imgfs_filename, "rb+", &store->fs_file);
+    if (ret != ERR_NONE) {
+        return ret;
+    }
+    if (pthread_mutex_init(&store->mutex, NULL)) {
+        do_close(&store->fs_file);
+        return ERR_THREADING;
+    }
+    if (pthread_cond_init(&store->resize_done, NULL)) {
+        pthread_mutex_destroy(&store->mutex);
+        do_close(&store->fs_file);
+        return ERR_THREADING;
+    }
+    ++nb_stores;
+    print_header(&store->fs_file.header);
+    if (name_len > 0) {
+        printf("served under " URI_ROOT "/%s/\n", name);
+    }
+    return ERR_NONE;
+}
+
+static void close_stores(void)
+{
+    for (; nb_stores > 0; --nb_stores) {
+        do_close(&stores[nb_stores - 1].fs_file);
+        free(stores[nb_stores - 1].ext);
+        similar_index_free(&stores[nb_stores - 1].similar);
+        pthread_mutex_destroy(&stores[nb_stores - 1].mutex);
+        pthread_cond_destroy(&stores[nb_stores - 1].resize_done);
+    }
+}
+
+static void close_all_and_free(void)
+{
     fprintf(stderr, "Shutting down...\n");
     http_close();
+    pregen_stop();
+    executor_stop();
     vips_shutdown();
-    if (close_imgfs_file) do_close(&fs_file);
-    if (destroy_mutex) pthread_mutex_destroy(&mutex);
+    close_stores();
+    variant_cache_free();
+    static_cache_free();
+}
+
+/********************************************************************
+ * Gets the FORMAT_* of a format name, or -1.
+ ********************************************************************** */
+static int format_atoi(const char* str)
+{
+    if (!strcmp(str, "jpeg") || !strcmp(str, "jpg")) {
+        return FORMAT_JPEG;
+    } else if (!strcmp(str, "webp")) {
+        return FORMAT_WEBP;
+    } else if (!strcmp(str, "avif")) {
+        return FORMAT_AVIF;
+    }
+    return -1;
+}
+
+/********************************************************************
+ * Gets the NEAR_* policy of a name, or NEAR_OFF.
+ ********************************************************************** */
+static enum near_policy near_policy_atoi(const char* str)
+{
+    if (!strcmp(str, "index")) {
+        return NEAR_INDEX;
+    } else if (!strcmp(str, "reject")) {
+        return NEAR_REJECT;
+    } else if (!strcmp(str, "alias")) {
+        return NEAR_ALIAS;
+    }
+    return NEAR_OFF;
+}
+
+/********************************************************************
+ * Parses a comma-separated list of increasing sizes.
+ ********************************************************************** */
+static int parse_size_buckets(const char* list)
+{
+    size_t nb = 0;
+    uint16_t buckets[MAX_SIZE_BUCKETS];
+    while (*list != '\0') {
+        const size_t len = strcspn(list, ",");
+        char size_string[8];
+        if (nb == MAX_SIZE_BUCKETS || len == 0 || len >= sizeof(size_string)) {
+            return ERR_INVALID_ARGUMENT;
+        }
+        memcpy(size_string, list, len);
+        size_string[len] = '\0';
+        buckets[nb] = atouint16(size_string);
+        if (buckets[nb] == 0 || (nb > 0 && buckets[nb] <= buckets[nb - 1])) {
+            return ERR_INVALID_ARGUMENT;
+        }
+        ++nb;
+        list += len;
+        if (*list == ',') {
+            ++list;
+        }
+    }
+    if (nb == 0) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    memcpy(size_buckets, buckets, nb * sizeof(uint16_t));
+    nb_size_buckets = nb;
+    return ERR_NONE;
 }
 
 /********************************************************************//**
  * Startup function. Create imgFS file and load in-memory structure.
  * Pass the imgFS file name as argv[1] and optionnaly port number as argv[2]
+ * Option -no_sendfile reads images in memory before sending them
+ * Option -store <name> <imgFS file> also serves that file under URI_ROOT/<name>/
+ * Option -variant_format <jpeg|webp|avif> sets the format of the resized
+ * images of the store given before it (the first one if none)
+ * Option -variant_budget <thumb bytes> <small bytes> makes the JPEG resized
+ * images of that store fit in these sizes, with the highest quality possible
+ * Option -box_filter <thumb|small> resizes that resolution of that store
+ * with a box filter, faster but not as good as libvips
+ * Option -optimize_jpeg stores the uploads to that store without their
+ * metadata and with optimal Huffman tables, losslessly
+ * Option -near_duplicates <distance> <index|reject|alias> indexes the
+ * perceptual hashes of the images of that store, for URI_ROOT/similar, and
+ * keeps, rejects or gives the ID of the existing image to the uploads whose
+ * hash differs from the one of an image by at most distance bits
+ * Option -placeholders makes the blurhash of the images of that store when
+ * they are first resized, given by URI_ROOT/list?placeholders=1
+ * Option -pregen <nb_workers> creates the resized images of uploads in the
+ * background, pausing while the load average exceeds the number of CPUs
+ * Option -size_buckets <s1,s2,...> sets the sizes read?w=&h= are rounded to
+ * Option -variant_cache <MB> bounds the memory of the images of such sizes
+ * Option -http_workers <n> sets the number of threads serving the requests
+ * (one per CPU by default)
+ * Option -io_uring does the I/O of the connections with io_uring rather than
+ * with epoll and a system call per operation
+ * Option -idle_timeout <seconds> sets how long a connection is kept open
+ * waiting for its next request (DEFAULT_IDLE_TIMEOUT by default)
+ * Option -max_upload <MB> sets the size of the largest upload, larger ones
+ * being refused before any space is reserved (DEFAULT_MAX_BODY by default)
+ * Option -image_threads <n> sets the number of threads processing images
+ * (one per CPU by default), -image_queue <n> the number of requests that
+ * may wait for them (as many as threads by default) before being refused
  ********************************************************************** */
 int server_startup (int argc, char **argv)
 {
     if (VIPS_INIT(argv[0])) {
-        close_all_and_free(false, false);
+        close_all_and_free();
         return ERR_IMGLIB;
     }
-    if (pthread_mutex_init(&mutex, NULL)) {
-        close_all_and_free(false, false);
-        return ERR_THREADING;
-    }
     if (argc < 2){
-        close_all_and_free(true, false);
+        close_all_and_free();
         return ERR_NOT_ENOUGH_ARGUMENTS;
-    } 
-    if (argc > 3){
-        close_all_and_free(true, false);
-        return ERR_INVALID_COMMAND;
-    } 
-    int ret = do_open(argv[1], "rb+", &fs_file);
+    }
+    int ret = open_store("", argv[1]);
     if (ret != ERR_NONE) {
-        close_all_and_free(true, false);
+        close_all_and_free();
         return ret;
     }
-    print_header(&fs_file.header);
-    if (argc == 3) {
-        server_port = atouint16(argv[2]);
-        // case where server_port overflows or is not in the range of valid port numbers
-        if (server_port < STARTING_VALID_PORT) {
-            close_all_and_free(true, true);
-            return ERR_INVALID_ARGUMENT;
+    server_port = DEFAULT_LISTENING_PORT;
+    uint16_t pregen_workers = 0;
+    uint16_t variant_cache_mb = DEFAULT_VARIANT_CACHE_MB;
+    uint16_t image_threads = 0;
+    uint16_t image_queue = 0;
+    uint16_t http_workers = 0;
+    uint16_t idle_timeout = DEFAULT_IDLE_TIMEOUT;
+    uint16_t max_upload = DEFAULT_MAX_BODY;
+    for (int i = 2; i < argc && ret == ERR_NONE; ++i) {
+        if (strcmp(argv[i], "-no_sendfile") == 0) {
+            use_sendfile = false;
+        } else if (strcmp(argv[i], "-io_uring") == 0) {
+            ret = http_set_io_uring();
+        } else if (strcmp(argv[i], "-idle_timeout") == 0) {
+            if (i + 1 >= argc) {
+                ret = ERR_NOT_ENOUGH_ARGUMENTS;
+            } else {
+                idle_timeout = atouint16(argv[++i]);
+                ret = idle_timeout == 0 ? ERR_INVALID_ARGUMENT : ERR_NONE;
+            }
+        } else if (strcmp(argv[i], "-max_upload") == 0) {
+            if (i + 1 >= argc) {
+                ret = ERR_NOT_ENOUGH_ARGUMENTS;
+            } else {
+                max_upload = atouint16(argv[++i]);
+                ret = max_upload == 0 ? ERR_INVALID_ARGUMENT : ERR_NONE;
+            }
+        } else if (strcmp(argv[i], "-pregen") == 0) {
+            if (i + 1 >= argc) {
+                ret = ERR_NOT_ENOUGH_ARGUMENTS;
+            } else {
+                pregen_workers = atouint16(argv[++i]);
+                ret = pregen_workers == 0 ? ERR_INVALID_ARGUMENT : ERR_NONE;
+            }
+        } else if (strcmp(argv[i], "-size_buckets") == 0) {
+            if (i + 1 >= argc) {
+                ret = ERR_NOT_ENOUGH_ARGUMENTS;
+            } else {
+                ret = parse_size_buckets(argv[++i]);
+            }
+        } else if (strcmp(argv[i], "-variant_cache") == 0) {
+            if (i + 1 >= argc) {
+                ret = ERR_NOT_ENOUGH_ARGUMENTS;
+            } else {
+                variant_cache_mb = atouint16(argv[++i]);
+                ret = variant_cache_mb == 0 && strcmp(argv[i], "0") != 0 ? ERR_INVALID_ARGUMENT : ERR_NONE;
+            }
+        } else if (strcmp(argv[i], "-http_workers") == 0) {
+            if (i + 1 >= argc) {
+                ret = ERR_NOT_ENOUGH_ARGUMENTS;
+            } else {
+                http_workers = atouint16(argv[++i]);
+                ret = http_workers == 0 ? ERR_INVALID_ARGUMENT : ERR_NONE;
+            }
+        } else if (strcmp(argv[i], "-image_threads") == 0 || strcmp(argv[i], "-image_queue") == 0) {
+            if (i + 1 >= argc) {
+                ret = ERR_NOT_ENOUGH_ARGUMENTS;
+            } else {
+                uint16_t* const value = strcmp(argv[i], "-image_threads") == 0 ? &image_threads : &image_queue;
+                *value = atouint16(argv[++i]);
+                ret = *value == 0 ? ERR_INVALID_ARGUMENT : ERR_NONE;
+            }
+        } else if (strcmp(argv[i], "-variant_budget") == 0) {
+            if (i + 2 >= argc) {
+                ret = ERR_NOT_ENOUGH_ARGUMENTS;
+            } else {
+                // for the store opened last
+                for (int res = 0; res < ORIG_RES; ++res) {
+                    stores[nb_stores - 1].budget[res] = atouint32(argv[++i]);
+                    if (stores[nb_stores - 1].budget[res] == 0) {
+                        ret = ERR_INVALID_ARGUMENT;
+                    }
+                }
+            }
+        } else if (strcmp(argv[i], "-box_filter") == 0) {
+            if (i + 1 >= argc) {
+                ret = ERR_NOT_ENOUGH_ARGUMENTS;
+            } else {
+                // for the store opened last
+                const int res = resolution_atoi(argv[++i]);
+                if (res < 0 || res == ORIG_RES) {
+                    ret = ERR_RESOLUTIONS;
+                } else {
+                    stores[nb_stores - 1].box_filter[res] = true;
+                }
+            }
+        } else if (strcmp(argv[i], "-placeholders") == 0) {
+            // for the store opened last
+            stores[nb_stores - 1].placeholders = true;
+        } else if (strcmp(argv[i], "-optimize_jpeg") == 0) {
+            // for the store opened last
+            stores[nb_stores - 1].optimize_jpeg = true;
+        } else if (strcmp(argv[i], "-near_duplicates") == 0) {
+            if (i + 2 >= argc) {
+                ret = ERR_NOT_ENOUGH_ARGUMENTS;
+            } else {
+                // for the store opened last
+                struct imgfs_store* const store = &stores[nb_stores - 1];
+                const char* const distance = argv[++i];
+                store->near_distance = atouint16(distance);
+                store->near_duplicates = near_policy_atoi(argv[++i]);
+                if (store->near_duplicates == NEAR_OFF || store->near_distance > PHASH_BITS ||
+                    (store->near_distance == 0 && strcmp(distance, "0") != 0)) {
+                    ret = ERR_INVALID_ARGUMENT;
+                }
+            }
+        } else if (strcmp(argv[i], "-variant_format") == 0) {
+            if (i + 1 >= argc) {
+                ret = ERR_NOT_ENOUGH_ARGUMENTS;
+            } else {
+                // for the store opened last
+                stores[nb_stores - 1].format = format_atoi(argv[++i]);
+                ret = stores[nb_stores - 1].format < 0 ? ERR_INVALID_ARGUMENT : ERR_NONE;
+            }
+        } else if (strcmp(argv[i], "-store") == 0) {
+            if (i + 2 >= argc) {
+                ret = ERR_NOT_ENOUGH_ARGUMENTS;
+            } else {
+                ret = open_store(argv[i + 1], argv[i + 2]);
+                i += 2;
+            }
+        } else if (i == 2) {
+            server_port = atouint16(argv[i]);
+            // case where server_port overflows or is not in the range of valid port numbers
+            if (server_port < STARTING_VALID_PORT) {
+                ret = ERR_INVALID_ARGUMENT;
+            }
+        } else {
+            ret = ERR_INVALID_COMMAND;
+        }
+    }
+    if (ret != ERR_NONE) {
+        close_all_and_free();
+        return ret;
+    }
+    for (size_t i = 0; i < nb_stores && ret == ERR_NONE; ++i) {
+        if (stores[i].near_duplicates != NEAR_OFF || stores[i].placeholders) {
+            ret = load_ext(&stores[i]);
+        }
+        if (ret == ERR_NONE && stores[i].near_duplicates != NEAR_OFF) {
+            ret = index_store(&stores[i]);
+        }
+    }
+    if (ret != ERR_NONE) {
+        close_all_and_free();
+        return ret;
+    }
+    variant_cache_init((size_t) variant_cache_mb << 20);
+    // served from memory, precompressed; the server starts without it, as it did
+    ret = static_cache_add(BASE_FILE, "text/html; charset=utf-8");
+    if (ret != ERR_NONE && ret != ERR_IO) {
+        close_all_and_free();
+        return ret;
+    }
+    ret = executor_start(image_threads, image_queue);
+    if (ret != ERR_NONE) {
+        close_all_and_free();
+        return ret;
+    }
+    if (pregen_workers > 0) {
+        const long nb_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        ret = pregen_start(pregen_workers, (double) nb_cpus, pregen_resized_images);
+        if (ret != ERR_NONE) {
+            close_all_and_free();
+            return ret;
         }
-    } else {
-        server_port = DEFAULT_LISTENING_PORT;
     }
+    http_set_workers(http_workers);
+    http_set_idle_timeout(idle_timeout);
+    http_set_max_body(max_upload);
     ret = http_init(server_port, handle_http_message);
     if (ret < 0) {
-        close_all_and_free(true, true);
+        close_all_and_free();
         return ret;
     }
+    http_set_body_handler(&insert_upload_handler);
     printf("ImgFS server started on http://localhost:%u\n", server_port);
 
     return 0;
@@ -260,7 +1774,10 @@ void server_shutdown (void)
 {
     fprintf(stderr, "Shutting down...\n");
     http_close();
-    do_close(&fs_file);
+    pregen_stop();
+    executor_stop();
+    close_stores();
+    variant_cache_free();
+    static_cache_free();
     vips_shutdown();
-    pthread_mutex_destroy(&mutex);
 }
@@ -120,6 +120,59 @@ void do_close(struct imgfs_file *imgfs_file)
     }
 }
 
+/*******************************************************************
+ * Extension records.
+ */
+int do_read_ext(const struct imgfs_file *imgfs_file, struct img_ext *records)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(records);
+    const struct imgfs_header *header = &imgfs_file->header;
+    if (header->unused_64 == 0) {
+        memset(records, 0, header->max_files * sizeof(struct img_ext));
+        return ERR_NONE;
+    }
+    if (header->unused_32 != sizeof(struct img_ext) ||
+        fseek(imgfs_file->file, (long) header->unused_64, SEEK_SET) ||
+        fread(records, sizeof(struct img_ext), header->max_files, imgfs_file->file) != header->max_files) {
+        return ERR_IO;
+    }
+    return ERR_NONE;
+}
+
+int do_write_ext(struct imgfs_file *imgfs_file, uint32_t index, const struct img_ext *record)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(record);
+    struct imgfs_header *header = &imgfs_file->header;
+    if (index >= header->max_files) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    if (header->unused_64 == 0) {
+        // writing the last byte of the table reserves it, zeroed
+        long end = 0;
+        if (fseek(imgfs_file->file, 0, SEEK_END) || (end = ftell(imgfs_file->file)) < 0 ||
+            fseek(imgfs_file->file, (long) (header->max_files * sizeof(struct img_ext)) - 1, SEEK_CUR) ||
+            fputc(0, imgfs_file->file) == EOF) {
+            return ERR_IO;
+        }
+        header->unused_32 = sizeof(struct img_ext);
+        header->unused_64 = (uint64_t) end;
+        if (fseek(imgfs_file->file, 0, SEEK_SET) ||
+            fwrite(header, sizeof(struct imgfs_header), 1, imgfs_file->file) != 1) {
+            header->unused_32 = 0;
+            header->unused_64 = 0;
+            return ERR_IO;
+        }
+    } else if (header->unused_32 != sizeof(struct img_ext)) {
+        return ERR_IO;
+    }
+    if (fseek(imgfs_file->file, (long) (header->unused_64 + index * sizeof(struct img_ext)), SEEK_SET) ||
+        fwrite(record, sizeof(struct img_ext), 1, imgfs_file->file) != 1) {
+        return ERR_IO;
+    }
+    return ERR_NONE;
+}
 
 int resolution_atoi (const char* str)
 {
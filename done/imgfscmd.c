@@ -28,7 +28,8 @@ static const struct command_mapping commands[] = {
     {"help", help},
     {"delete", do_delete_cmd},
     {"insert", do_insert_cmd},
-    {"read", do_read_cmd}
+    {"read", do_read_cmd},
+    {"reresize", do_reresize_cmd}
 };
 static size_t COMMANDS_SIZE = (sizeof(commands) / sizeof(commands[0]));
 
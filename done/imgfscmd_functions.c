@@ -8,6 +8,7 @@
 #include "error.h"
 #include "imgfs.h"
 #include "imgfscmd_functions.h"
+#include "image_content.h" // for do_reresize()
 #include "util.h"   // for _unused
 
 #include <stdio.h>
@@ -15,6 +16,9 @@
 #include <string.h>
 #include <inttypes.h>
 #include <stdint.h>
+#include <time.h>
+#include <unistd.h> // for sysconf()
+#include <vips/vips.h> // for vips_concurrency_set()
 
 // default values
 static const uint32_t default_max_files = 128;
@@ -92,6 +96,23 @@ static int read_disk_image(const char *path, char **image_buffer, uint32_t *imag
     return ERR_NONE;
 }
 
+/********************************************************************
+ * Parses the <X_RES> <Y_RES> of the -thumb_res or -small_res option at
+ * argv[*i], moving i to the last of them.
+ */
+static int parse_res_option(int argc, char** argv, int* i, uint16_t max_res, uint16_t* width, uint16_t* height)
+{
+    if (*i + 2 >= argc) {
+        return ERR_NOT_ENOUGH_ARGUMENTS;
+    }
+    *width  = atouint16(argv[++*i]);
+    *height = atouint16(argv[++*i]);
+    if (*width == 0 || *width > max_res || *height == 0 || *height > max_res) {
+        return ERR_RESOLUTIONS;
+    }
+    return ERR_NONE;
+}
+
 /**********************************************************************
  * Displays some explanations.
  ********************************************************************** */
@@ -115,7 +136,11 @@ int help(int useless _unused, char** useless_too _unused)
            "      read an image from the imgFS and save it to a file.\n"
            "      default resolution is \"original\".\n"
            "  insert <imgFS_filename> <imgID> <filename>: insert a new image in the imgFS.\n"
-           "  delete <imgFS_filename> <imgID>: delete image imgID from imgFS.\n",
+           "  delete <imgFS_filename> <imgID>: delete image imgID from imgFS.\n"
+           "  reresize <imgFS_filename> [options]: change the resolutions of the resized images\n"
+           "      and recreate all of them.\n"
+           "      options are -thumb_res and -small_res, as for create;\n"
+           "      the current value is kept for the ones not given.\n",
            default_max_files, default_thumb_res, default_thumb_res, MAX_THUMB_RES, MAX_THUMB_RES,
            default_small_res, default_small_res, MAX_SMALL_RES, MAX_SMALL_RES);
     return ERR_NONE;
@@ -166,24 +191,14 @@ int do_create_cmd(int argc, char** argv)
                 return ERR_MAX_FILES;
             }
         } else if (strcmp(argv[i], "-thumb_res") == 0) {
-            if (i + 2 >= argc) {
-                return ERR_NOT_ENOUGH_ARGUMENTS;
-            }
-            thumb_res_width = atouint16(argv[++i]);
-            thumb_res_height = atouint16(argv[++i]);
-            if (thumb_res_width == 0 || thumb_res_width > MAX_THUMB_RES ||
-                thumb_res_height == 0 || thumb_res_height > MAX_THUMB_RES) {
-                return ERR_RESOLUTIONS;
+            const int ret = parse_res_option(argc, argv, &i, MAX_THUMB_RES, &thumb_res_width, &thumb_res_height);
+            if (ret != ERR_NONE) {
+                return ret;
             }
         } else if (strcmp(argv[i], "-small_res") == 0) {
-            if (i + 2 >= argc) {
-                return ERR_NOT_ENOUGH_ARGUMENTS;
-            }
-            small_res_width = atouint16(argv[++i]);
-            small_res_height = atouint16(argv[++i]);
-            if (small_res_width == 0 || small_res_width > MAX_SMALL_RES ||
-                small_res_height == 0 || small_res_height > MAX_SMALL_RES) {
-                return ERR_RESOLUTIONS;
+            const int ret = parse_res_option(argc, argv, &i, MAX_SMALL_RES, &small_res_width, &small_res_height);
+            if (ret != ERR_NONE) {
+                return ret;
             }
         } else {
             return ERR_INVALID_ARGUMENT;
@@ -289,3 +304,55 @@ int do_insert_cmd(int argc, char **argv)
 }
 
 
+
+/**********************************************************************
+ * Changes the resolutions of the resized images and recreates them.
+ ********************************************************************** */
+int do_reresize_cmd(int argc, char** argv)
+{
+    M_REQUIRE_NON_NULL(argv);
+    if (argc < 1) return ERR_NOT_ENOUGH_ARGUMENTS;
+
+    // 0: kept as in the imgFS
+    uint16_t resized_res[2 * (NB_RES - 1)] = { 0 };
+    for (int i = 1; i < argc; ++i) {
+        int ret = ERR_NONE;
+        if (strcmp(argv[i], "-thumb_res") == 0) {
+            ret = parse_res_option(argc, argv, &i, MAX_THUMB_RES,
+                                   &resized_res[2 * THUMB_RES], &resized_res[2 * THUMB_RES + 1]);
+        } else if (strcmp(argv[i], "-small_res") == 0) {
+            ret = parse_res_option(argc, argv, &i, MAX_SMALL_RES,
+                                   &resized_res[2 * SMALL_RES], &resized_res[2 * SMALL_RES + 1]);
+        } else {
+            ret = ERR_INVALID_ARGUMENT;
+        }
+        if (ret != ERR_NONE) {
+            return ret;
+        }
+    }
+
+    struct imgfs_file myfile;
+    zero_init_var(myfile);
+    int error = do_open(argv[0], "rb+", &myfile);
+    if (error != ERR_NONE) return error;
+    for (int i = 0; i < 2 * (NB_RES - 1); ++i) {
+        if (resized_res[i] == 0) {
+            resized_res[i] = myfile.header.resized_res[i];
+        }
+    }
+
+    // one resize per CPU, each on a single thread
+    const long nb_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    vips_concurrency_set(1);
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    size_t nb_images = 0;
+    error = do_reresize(resized_res, nb_cpus > 0 ? (size_t) nb_cpus : 1, &myfile, &nb_images);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    do_close(&myfile);
+
+    const double seconds = (double) (end.tv_sec - start.tv_sec) + (double) (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("%zu images resized in %.2f s (%.1f images/s)\n", nb_images, seconds,
+           seconds > 0 ? (double) nb_images / seconds : 0.0);
+    return error;
+}
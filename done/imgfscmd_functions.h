@@ -36,3 +36,8 @@ int do_insert_cmd(int argc, char* argv[]);
  * Reads an image from the imgFS.
  *******************************************************************/
 int do_read_cmd(int argc, char* argv[]);
+
+/********************************************************************
+ * Changes the resolutions of the resized images and recreates them.
+ *******************************************************************/
+int do_reresize_cmd(int argc, char* argv[]);
@@ -0,0 +1,441 @@
+/*
+ * @file resize-bench.c
+ * @brief Measures the CPU time needed to create a thumbnail of a JPEG image
+ *
+ * Compares a full decode followed by a resize, the shrink-on-load pipeline
+ * used by imgFS, and the same pipeline starting from a small version. Also
+ * compares the two ways of getting the resolution of an image at insert,
+ * and the thumbnails of imgFS made by libvips and by its box filter, for
+ * speed and quality (PSNR against a full decode resized by libvips).
+ *
+ * With -budget, reports instead the average size of the thumbnails of
+ * several images, with the default JPEG quality and fitted to a budget.
+ *
+ * With -optimize, reports instead the storage saved by the lossless
+ * optimization of several images at insert, its CPU time, and the CPU time
+ * of a thumbnail of the images as received and as stored.
+ */
+
+#include "error.h"
+#include "image_content.h"
+#include "image_optimize.h"
+#include "util.h"
+
+#include <fcntl.h> // open()
+#include <inttypes.h> // PRIu32
+#include <math.h> // log10()
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <vips/vips.h>
+
+#define DEFAULT_ITERATIONS 20
+#define SMALL_SIZE 256
+
+// one thumbnail, from the whole image decoded at full resolution
+static int full_decode(void* buffer, size_t size, int width, int height)
+{
+    VipsImage* image_in = NULL;
+    VipsImage* image_out = NULL;
+    void* buffer_out = NULL;
+    size_t buffer_out_len = 0;
+    int ret = vips_jpegload_buffer(buffer, size, &image_in, NULL) == -1 ||
+              vips_thumbnail_image(image_in, &image_out, width, "height", height, NULL) == -1 ||
+              vips_jpegsave_buffer(image_out, &buffer_out, &buffer_out_len, NULL) == -1 ? ERR_IMGLIB : ERR_NONE;
+    g_free(buffer_out);
+    if (image_in != NULL) g_object_unref(VIPS_OBJECT(image_in));
+    if (image_out != NULL) g_object_unref(VIPS_OBJECT(image_out));
+    return ret;
+}
+
+// one thumbnail, downscaled while decoding; the result is kept if out is not NULL
+static int shrink_on_load(void* buffer, size_t size, int width, int height, void** out, size_t* out_len)
+{
+    VipsImage* image_out = NULL;
+    void* buffer_out = NULL;
+    size_t buffer_out_len = 0;
+    int ret = vips_thumbnail_buffer(buffer, size, &image_out, width, "height", height, NULL) == -1 ||
+              vips_jpegsave_buffer(image_out, &buffer_out, &buffer_out_len, NULL) == -1 ? ERR_IMGLIB : ERR_NONE;
+    if (image_out != NULL) g_object_unref(VIPS_OBJECT(image_out));
+    if (ret == ERR_NONE && out != NULL) {
+        *out = buffer_out;
+        *out_len = buffer_out_len;
+    } else {
+        g_free(buffer_out);
+    }
+    return ret;
+}
+
+// the resolution, as get_resolution() did before reading the JPEG frame header itself
+static int vips_resolution(uint32_t* height, uint32_t* width, void* buffer, size_t size)
+{
+    VipsImage* image = NULL;
+    if (vips_jpegload_buffer(buffer, size, &image, NULL) == -1) {
+        return ERR_IMGLIB;
+    }
+    *height = (uint32_t) vips_image_get_height(image);
+    *width  = (uint32_t) vips_image_get_width(image);
+    g_object_unref(VIPS_OBJECT(image));
+    return ERR_NONE;
+}
+
+static double wall_seconds(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double) now.tv_sec + (double) now.tv_nsec / 1e9;
+}
+
+static int report_resolution(char* buffer, size_t size, unsigned iterations)
+{
+    uint32_t height = 0;
+    uint32_t width = 0;
+    double start = wall_seconds();
+    for (unsigned i = 0; i < iterations; ++i) {
+        if (vips_resolution(&height, &width, buffer, size) != ERR_NONE) {
+            return ERR_IMGLIB;
+        }
+    }
+    printf("%-16s %8.2f us per resolution\n", "libvips load", (wall_seconds() - start) * 1e6 / iterations);
+    start = wall_seconds();
+    for (unsigned i = 0; i < iterations; ++i) {
+        if (jpeg_header_resolution(&height, &width, buffer, size) != ERR_NONE) {
+            return ERR_IMGLIB;
+        }
+    }
+    printf("%-16s %8.2f us per resolution\n", "frame header", (wall_seconds() - start) * 1e6 / iterations);
+    return ERR_NONE;
+}
+
+static double cpu_seconds(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &now);
+    return (double) now.tv_sec + (double) now.tv_nsec / 1e9;
+}
+
+static int report(const char* name, void* buffer, size_t size, int width, int height, unsigned iterations,
+                  int (*make)(void*, size_t, int, int))
+{
+    const double start = cpu_seconds();
+    for (unsigned i = 0; i < iterations; ++i) {
+        int ret = make(buffer, size, width, height);
+        if (ret != ERR_NONE) {
+            return ret;
+        }
+    }
+    printf("%-16s %8.2f ms CPU per thumbnail\n", name, (cpu_seconds() - start) * 1e3 / iterations);
+    return ERR_NONE;
+}
+
+static int make_shrink_on_load(void* buffer, size_t size, int width, int height)
+{
+    return shrink_on_load(buffer, size, width, height, NULL, NULL);
+}
+
+// one thumbnail of a JPEG file, as created by imgFS; it is kept in out if not NULL
+static int thumbnail(int fd, uint32_t size, int width, int height, uint32_t budget, bool box_filter,
+                     size_t* len, uint8_t* encoding, void** out)
+{
+    struct resize_job job;
+    zero_init_var(job);
+    job.fd = fd;
+    job.src_size = size;
+    job.width [THUMB_RES] = (uint16_t) width;
+    job.height[THUMB_RES] = (uint16_t) height;
+    job.budget[THUMB_RES] = budget;
+    job.box_filter[THUMB_RES] = box_filter;
+    int ret = resize_run(&job);
+    *len = job.buffer_out_len[THUMB_RES];
+    *encoding = job.encoding[THUMB_RES];
+    if (ret == ERR_NONE && out != NULL) {
+        *out = job.buffer_out[THUMB_RES];
+        job.buffer_out[THUMB_RES] = NULL;
+    }
+    resize_release(&job);
+    return ret;
+}
+
+// the pixels of an image, or NULL
+static uint8_t* pixels(VipsImage* image, int* width, int* height, int* bands, size_t* len)
+{
+    *width  = vips_image_get_width(image);
+    *height = vips_image_get_height(image);
+    *bands  = vips_image_get_bands(image);
+    return vips_image_write_to_memory(image, len);
+}
+
+static double scale(int to, int from)
+{
+    return (double) to / from;
+}
+
+// peak signal-to-noise ratio of a JPEG image against reference pixels, or a negative value if not comparable
+static double psnr(void* jpeg, size_t jpeg_len, const uint8_t* reference, int width, int height, int bands)
+{
+    VipsImage* image = NULL;
+    if (vips_jpegload_buffer(jpeg, jpeg_len, &image, NULL) == -1) {
+        return -1;
+    }
+    int image_width = 0;
+    int image_height = 0;
+    int image_bands = 0;
+    size_t len = 0;
+    uint8_t* const decoded = pixels(image, &image_width, &image_height, &image_bands, &len);
+    g_object_unref(VIPS_OBJECT(image));
+    double result = -1;
+    if (decoded != NULL && image_width == width && image_height == height && image_bands == bands) {
+        double squares = 0;
+        for (size_t i = 0; i < len; ++i) {
+            const double diff = (double) decoded[i] - (double) reference[i];
+            squares += diff * diff;
+        }
+        result = squares > 0 ? 10 * log10(255.0 * 255.0 * (double) len / squares) : 99;
+    }
+    g_free(decoded);
+    return result;
+}
+
+static int report_box(const char* filename, void* buffer, size_t size, int width, int height, unsigned iterations)
+{
+    const int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        return ERR_IO;
+    }
+    void* out[2] = { NULL, NULL };
+    size_t out_len[2] = { 0, 0 };
+    double seconds[2] = { 0, 0 };
+    int ret = ERR_NONE;
+    for (int box = 0; ret == ERR_NONE && box < 2; ++box) {
+        uint8_t encoding = 0;
+        const double start = cpu_seconds();
+        for (unsigned i = 0; ret == ERR_NONE && i < iterations; ++i) {
+            ret = thumbnail(fd, (uint32_t) size, width, height, 0, box, &out_len[box], &encoding,
+                            i + 1 == iterations ? &out[box] : NULL);
+        }
+        seconds[box] = cpu_seconds() - start;
+    }
+    close(fd);
+
+    // the reference: the whole image resized by libvips to the size of its thumbnail
+    VipsImage* full = NULL;
+    VipsImage* thumb = NULL;
+    VipsImage* reference = NULL;
+    uint8_t* reference_pixels = NULL;
+    int ref_width = 0;
+    int ref_height = 0;
+    int ref_bands = 0;
+    size_t ref_len = 0;
+    if (ret == ERR_NONE &&
+        (vips_jpegload_buffer(out[0], out_len[0], &thumb, NULL) == -1 ||
+         vips_jpegload_buffer(buffer, size, &full, NULL) == -1 ||
+         vips_resize(full, &reference, scale(vips_image_get_width(thumb), vips_image_get_width(full)),
+                     "vscale", scale(vips_image_get_height(thumb), vips_image_get_height(full)), NULL) == -1 ||
+         (reference_pixels = pixels(reference, &ref_width, &ref_height, &ref_bands, &ref_len)) == NULL)) {
+        ret = ERR_IMGLIB;
+    }
+    for (int box = 0; ret == ERR_NONE && box < 2; ++box) {
+        printf("%-16s %8.2f ms CPU per thumbnail, PSNR %.2f dB\n", box ? "box filter" : "libvips",
+               seconds[box] * 1e3 / iterations,
+               psnr(out[box], out_len[box], reference_pixels, ref_width, ref_height, ref_bands));
+    }
+    g_free(reference_pixels);
+    if (full != NULL) g_object_unref(VIPS_OBJECT(full));
+    if (thumb != NULL) g_object_unref(VIPS_OBJECT(thumb));
+    if (reference != NULL) g_object_unref(VIPS_OBJECT(reference));
+    free(out[0]);
+    free(out[1]);
+    return ret;
+}
+
+static int report_budget(int argc, char* argv[])
+{
+    const uint32_t budget = atouint32(argv[2]);
+    const int width  = atouint16(argv[3]);
+    const int height = atouint16(argv[4]);
+    if (budget == 0 || width == 0 || height == 0) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    size_t total_default = 0;
+    size_t total_budget = 0;
+    size_t nb_over = 0;
+    int nb_files = 0;
+    for (int i = 5; i < argc; ++i) {
+        struct stat st;
+        const int fd = open(argv[i], O_RDONLY);
+        if (fd < 0 || fstat(fd, &st) || st.st_size <= 0 || st.st_size > UINT32_MAX) {
+            if (fd >= 0) close(fd);
+            return ERR_IO;
+        }
+        size_t default_len = 0;
+        size_t budget_len = 0;
+        uint8_t encoding = 0;
+        int ret = thumbnail(fd, (uint32_t) st.st_size, width, height, 0, false, &default_len, &encoding, NULL);
+        if (ret == ERR_NONE) {
+            ret = thumbnail(fd, (uint32_t) st.st_size, width, height, budget, false, &budget_len, &encoding, NULL);
+        }
+        close(fd);
+        if (ret != ERR_NONE) {
+            return ret;
+        }
+        printf("%-40s %8zu bytes default, %8zu bytes at quality %d%s\n", argv[i], default_len, budget_len,
+               ENCODING_QUALITY(encoding), encoding & ENCODING_PROGRESSIVE ? " progressive" : "");
+        total_default += default_len;
+        total_budget  += budget_len;
+        nb_over += budget_len > budget;
+        ++nb_files;
+    }
+    printf("average: %zu bytes default, %zu bytes with a budget of %" PRIu32 " (%zu of %d over it)\n",
+           total_default / (size_t) nb_files, total_budget / (size_t) nb_files, budget, nb_over, nb_files);
+    return ERR_NONE;
+}
+
+// the whole content of a file, allocated
+static int read_whole_file(const char* filename, char** buffer, size_t* size)
+{
+    FILE* file = fopen(filename, "rb");
+    if (file == NULL) {
+        return ERR_IO;
+    }
+    long end = 0;
+    int ret = fseek(file, 0, SEEK_END) || (end = ftell(file)) <= 0 ? ERR_IO : ERR_NONE;
+    if (ret == ERR_NONE) {
+        *size = (size_t) end;
+        *buffer = malloc(*size);
+        ret = *buffer == NULL ? ERR_OUT_OF_MEMORY :
+              fseek(file, 0, SEEK_SET) || fread(*buffer, *size, 1, file) != 1 ? ERR_IO : ERR_NONE;
+        if (ret == ERR_IO) {
+            free(*buffer);
+        }
+    }
+    fclose(file);
+    return ret;
+}
+
+// CPU time of a thumbnail, in ms
+static double thumbnail_ms(void* buffer, size_t size, int* ret)
+{
+    const double start = cpu_seconds();
+    for (unsigned i = 0; *ret == ERR_NONE && i < DEFAULT_ITERATIONS; ++i) {
+        *ret = shrink_on_load(buffer, size, SMALL_SIZE, SMALL_SIZE, NULL, NULL);
+    }
+    return (cpu_seconds() - start) * 1e3 / DEFAULT_ITERATIONS;
+}
+
+static int report_optimize(int argc, char* argv[])
+{
+    size_t total_size = 0;
+    size_t total_optimized = 0;
+    for (int i = 2; i < argc; ++i) {
+        char* buffer = NULL;
+        size_t size = 0;
+        int ret = read_whole_file(argv[i], &buffer, &size);
+        if (ret != ERR_NONE) {
+            return ret;
+        }
+        char* optimized = NULL;
+        size_t optimized_size = 0;
+        const double start = cpu_seconds();
+        ret = optimize_jpeg(buffer, size, &optimized, &optimized_size);
+        const double optimize_ms = (cpu_seconds() - start) * 1e3;
+        // stored as received otherwise
+        if (ret == ERR_NONE && optimized_size >= size) {
+            free(optimized);
+            optimized = NULL;
+            optimized_size = size;
+        }
+        const double original_ms  = thumbnail_ms(buffer, size, &ret);
+        const double optimized_ms = optimized == NULL ? original_ms : thumbnail_ms(optimized, optimized_size, &ret);
+        free(buffer);
+        free(optimized);
+        if (ret != ERR_NONE) {
+            return ret;
+        }
+        printf("%-40s %8zu -> %8zu bytes (%5.1f%% saved) in %6.2f ms, thumbnail %6.2f -> %6.2f ms CPU\n",
+               argv[i], size, optimized_size, 100.0 * (double) (size - optimized_size) / (double) size,
+               optimize_ms, original_ms, optimized_ms);
+        total_size += size;
+        total_optimized += optimized_size;
+    }
+    printf("total: %zu -> %zu bytes (%.1f%% saved)\n", total_size, total_optimized,
+           100.0 * (double) (total_size - total_optimized) / (double) total_size);
+    return ERR_NONE;
+}
+
+int main(int argc, char* argv[])
+{
+    if ((argc >= 6 && strcmp(argv[1], "-budget") == 0) || (argc >= 3 && strcmp(argv[1], "-optimize") == 0)) {
+        if (VIPS_INIT(argv[0])) {
+            return ERR_IMGLIB;
+        }
+        const int ret = argv[1][1] == 'b' ? report_budget(argc, argv) : report_optimize(argc, argv);
+        if (ret != ERR_NONE) {
+            fprintf(stderr, "ERROR: %s\n", ERR_MSG(ret));
+        }
+        vips_shutdown();
+        return ret;
+    }
+    if (argc < 4 || argc > 5) {
+        fprintf(stderr, "Usage: %s <JPEG file> <width> <height> [iterations]\n"
+                "       %s -budget <bytes> <width> <height> <JPEG file>...\n"
+                "       %s -optimize <JPEG file>...\n", argv[0], argv[0], argv[0]);
+        return ERR_NOT_ENOUGH_ARGUMENTS;
+    }
+    const int width  = atouint16(argv[2]);
+    const int height = atouint16(argv[3]);
+    const unsigned iterations = argc == 5 ? atouint32(argv[4]) : DEFAULT_ITERATIONS;
+    if (width == 0 || height == 0 || iterations == 0) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    if (VIPS_INIT(argv[0])) {
+        return ERR_IMGLIB;
+    }
+
+    size_t size = 0;
+    char* buffer = NULL;
+    FILE* file = fopen(argv[1], "rb");
+    int ret = file == NULL ? ERR_IO : ERR_NONE;
+    if (ret == ERR_NONE && (fseek(file, 0, SEEK_END) || ftell(file) <= 0)) {
+        ret = ERR_IO;
+    }
+    if (ret == ERR_NONE) {
+        size = (size_t) ftell(file);
+        buffer = malloc(size);
+        ret = buffer == NULL ? ERR_OUT_OF_MEMORY :
+              fseek(file, 0, SEEK_SET) || fread(buffer, size, 1, file) != 1 ? ERR_IO : ERR_NONE;
+    }
+    if (file != NULL) {
+        fclose(file);
+    }
+
+    void* small = NULL;
+    size_t small_size = 0;
+    if (ret == ERR_NONE) {
+        ret = report_resolution(buffer, size, iterations);
+    }
+    if (ret == ERR_NONE) {
+        ret = report("full decode", buffer, size, width, height, iterations, full_decode);
+    }
+    if (ret == ERR_NONE) {
+        ret = report("shrink-on-load", buffer, size, width, height, iterations, make_shrink_on_load);
+    }
+    if (ret == ERR_NONE) {
+        ret = shrink_on_load(buffer, size, SMALL_SIZE, SMALL_SIZE, &small, &small_size);
+    }
+    if (ret == ERR_NONE) {
+        ret = report("from small", small, small_size, width, height, iterations, make_shrink_on_load);
+    }
+    if (ret == ERR_NONE) {
+        ret = report_box(argv[1], buffer, size, width, height, iterations);
+    }
+    if (ret != ERR_NONE) {
+        fprintf(stderr, "ERROR: %s\n", ERR_MSG(ret));
+    }
+    g_free(small);
+    free(buffer);
+    vips_shutdown();
+    return ret;
+}
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE // accept4()
 #include "socket_layer.h"
 #include "error.h"
 #include "util.h"
@@ -8,7 +9,8 @@
 #include <unistd.h>
 #include <sys/types.h>
 
-static const int LISTEN_BACKLOG = 20;
+// bursts of new connections wait to be accepted rather than being retried by the clients
+static const int LISTEN_BACKLOG = SOMAXCONN;
 
 int tcp_server_init(uint16_t port)
 {
@@ -50,6 +52,11 @@ int tcp_accept(int passive_socket)
     return accept(passive_socket, NULL, NULL);
 }
 
+int tcp_accept_nonblocking(int passive_socket)
+{
+    return accept4(passive_socket, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+}
+
 ssize_t tcp_read(int active_socket, char *buf, size_t buflen)
 {
     M_REQUIRE_NON_NULL(buf);
@@ -67,3 +74,16 @@ ssize_t tcp_send(int active_socket, const char *response, size_t response_len)
     }
     return send(active_socket, response, response_len, 0);
 }
+
+ssize_t tcp_sendv(int active_socket, const struct iovec* iov, int iovcnt, int more)
+{
+    M_REQUIRE_NON_NULL(iov);
+    if (active_socket < 0 || iovcnt <= 0) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    struct msghdr msg;
+    zero_init_var(msg);
+    msg.msg_iov = (struct iovec*) (uintptr_t) iov;
+    msg.msg_iovlen = (size_t) iovcnt;
+    return sendmsg(active_socket, &msg, more ? MSG_MORE : 0);
+}
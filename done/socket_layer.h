@@ -10,6 +10,7 @@
 #include <stddef.h> // size_t
 #include <stdint.h> // uint16_t
 #include <sys/types.h> // ssize_t
+#include <sys/uio.h> // struct iovec
 
 int tcp_server_init(uint16_t port);
 
@@ -18,9 +19,25 @@ int tcp_server_init(uint16_t port);
  */
 int tcp_accept(int passive_socket);
 
+/**
+ * @brief Non-blocking call that accepts a new TCP connection, itself
+ *        non-blocking; -1 with errno EAGAIN if none is pending
+ */
+int tcp_accept_nonblocking(int passive_socket);
+
 /**
  * @brief Blocking call that reads the active socket once and stores the output in buf
  */
 ssize_t tcp_read(int active_socket, char* buf, size_t buflen);
 
 ssize_t tcp_send(int active_socket, const char* response, size_t response_len);
+
+/**
+ * @brief Sends the buffers of iov one after the other, as a single send
+ *
+ * @param more Whether more bytes are to follow at once, for the kernel not
+ *        to push these out on their own (MSG_MORE)
+ * @return The number of bytes sent, possibly fewer than all of them; -1 with
+ *         errno on error, as send()
+ */
+ssize_t tcp_sendv(int active_socket, const struct iovec* iov, int iovcnt, int more);
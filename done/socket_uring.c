@@ -0,0 +1,606 @@
+/*
+ * @file socket_uring.c
+ * @brief io_uring transport of the sockets, on the system calls of io_uring
+ *        (see io_uring(7)): the rings are mapped and filled here.
+ */
+
+#include "socket_uring.h"
+#include "error.h"
+#include "util.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <linux/io_uring.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#define THREAD_RING_ENTRIES 8
+#define LOOP_RING_ENTRIES 1024
+#define LOOP_BUFFERS 256 // a power of 2
+#define LOOP_BUFFER_SIZE 4096
+#define LOOP_BUFFER_GROUP 0
+
+// user_data of the operations of the event loop which are not receives
+#define ACCEPT_DATA UINT64_MAX
+#define WAKE_DATA (UINT64_MAX - 1)
+
+struct uring {
+    int fd;
+    unsigned entries;
+    void* rings;
+    size_t rings_size;
+    // submission queue, shared with the kernel
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    struct io_uring_sqe* sqes;
+    unsigned to_submit;
+    // completion queue, shared with the kernel
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    struct io_uring_cqe* cqes;
+};
+
+/********************************************************************//**
+ * The rings
+ */
+
+static int uring_init(struct uring* ring, unsigned entries)
+{
+    struct io_uring_params params;
+    zero_init_var(params);
+    ring->fd = (int) syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd < 0) {
+        return ERR_IO;
+    }
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+        close(ring->fd);
+        return ERR_IO;
+    }
+
+    // one mapping for both queues, and one for the entries of the submission queue
+    size_t rings_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    const size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (cq_size > rings_size) {
+        rings_size = cq_size;
+    }
+    char* const rings = mmap(NULL, rings_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                             ring->fd, IORING_OFF_SQ_RING);
+    if (rings == MAP_FAILED) {
+        close(ring->fd);
+        return ERR_IO;
+    }
+    ring->sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        munmap(rings, rings_size);
+        close(ring->fd);
+        return ERR_IO;
+    }
+
+    ring->entries = params.sq_entries;
+    ring->rings = rings;
+    ring->rings_size = rings_size;
+    ring->sq_head = (unsigned*) (rings + params.sq_off.head);
+    ring->sq_tail = (unsigned*) (rings + params.sq_off.tail);
+    ring->sq_mask = (unsigned*) (rings + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned*) (rings + params.sq_off.array);
+    ring->to_submit = 0;
+    ring->cq_head = (unsigned*) (rings + params.cq_off.head);
+    ring->cq_tail = (unsigned*) (rings + params.cq_off.tail);
+    ring->cq_mask = (unsigned*) (rings + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*) (rings + params.cq_off.cqes);
+    return ERR_NONE;
+}
+
+static void uring_exit(struct uring* ring)
+{
+    munmap(ring->sqes, ring->entries * sizeof(struct io_uring_sqe));
+    munmap(ring->rings, ring->rings_size);
+    close(ring->fd);
+}
+
+static int uring_enter(struct uring* ring, unsigned min_complete)
+{
+    const unsigned flags = min_complete > 0 ? IORING_ENTER_GETEVENTS : 0;
+    while (1) {
+        const long ret = syscall(__NR_io_uring_enter, ring->fd, ring->to_submit, min_complete, flags, NULL, 0);
+        if (ret >= 0) {
+            ring->to_submit -= (unsigned) ret;
+            return ERR_NONE;
+        }
+        if (errno != EINTR) {
+            return ERR_IO;
+        }
+    }
+}
+
+// uring_enter() for one completion, but giving up after timeout_ms (unless it is -1) or on a signal
+static int uring_wait(struct uring* ring, int timeout_ms)
+{
+    struct __kernel_timespec timeout;
+    zero_init_var(timeout);
+    timeout.tv_sec = timeout_ms / 1000;
+    timeout.tv_nsec = (long long) (timeout_ms % 1000) * 1000000;
+    struct io_uring_getevents_arg arg;
+    zero_init_var(arg);
+    arg.ts = timeout_ms < 0 ? 0 : (uintptr_t) &timeout;
+    const long ret = syscall(__NR_io_uring_enter, ring->fd, ring->to_submit, 1,
+                             IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+    if (ret >= 0) {
+        ring->to_submit -= (unsigned) ret;
+        return ERR_NONE;
+    }
+    return errno == ETIME || errno == EINTR ? ERR_NONE : ERR_IO;
+}
+
+// a cleared entry at the tail of the submission queue, NULL if it is full and cannot be submitted
+static struct io_uring_sqe* uring_get_sqe(struct uring* ring)
+{
+    unsigned tail = *ring->sq_tail;
+    if (tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) == ring->entries) {
+        if (uring_enter(ring, 0) != ERR_NONE
+            || tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) == ring->entries) {
+            return NULL;
+        }
+    }
+    const unsigned index = tail & *ring->sq_mask;
+    struct io_uring_sqe* const sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ++ring->to_submit;
+    return sqe;
+}
+
+// the oldest completion, NULL if there is none
+static struct io_uring_cqe* uring_peek_cqe(struct uring* ring)
+{
+    const unsigned head = *ring->cq_head;
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+    return &ring->cqes[head & *ring->cq_mask];
+}
+
+static void uring_cqe_seen(struct uring* ring)
+{
+    __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+/********************************************************************//**
+ * The calls of socket_layer.h: one operation (or one link of them) at a
+ * time on a ring of the calling thread, submitted and waited for at once.
+ */
+
+static int op_timeout_ms = -1;
+
+static _Thread_local struct uring thread_ring;
+static _Thread_local int thread_ring_state; // 0: not set up yet, 1: set up, -1: failed
+
+static struct uring* get_thread_ring(void)
+{
+    if (thread_ring_state == 0) {
+        thread_ring_state = uring_init(&thread_ring, THREAD_RING_ENTRIES) == ERR_NONE ? 1 : -1;
+    }
+    return thread_ring_state > 0 ? &thread_ring : NULL;
+}
+
+void uring_set_timeout(int timeout_ms)
+{
+    op_timeout_ms = timeout_ms;
+}
+
+static uint64_t now_ms(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000 + (uint64_t) now.tv_nsec / 1000000;
+}
+
+// submits the entries prepared on active_socket and waits for as many completions, whose results are
+// put in results; past the timeout, the socket is shut down, which completes them at once.
+// All of them are reaped before it returns, for none to be taken as the result of the next operation:
+// when the ring fails, the socket is shut down too, and the ring is given up if it fails again
+static int thread_ring_run(struct uring* ring, int active_socket, int* results, unsigned nb)
+{
+    bool limited = op_timeout_ms >= 0;
+    int ret = ERR_NONE;
+    // most complete while submitted: the clock is only read for those which do not
+    if (limited && uring_enter(ring, 0) != ERR_NONE) {
+        ret = ERR_IO;
+        shutdown(active_socket, SHUT_RDWR);
+        limited = false;
+    }
+    uint64_t deadline = 0;
+    for (unsigned i = 0; i < nb; ++i) {
+        struct io_uring_cqe* cqe;
+        while ((cqe = uring_peek_cqe(ring)) == NULL) {
+            const uint64_t now = limited ? now_ms() : 0;
+            if (limited && deadline == 0) {
+                deadline = now + (uint64_t) op_timeout_ms;
+            }
+            if (limited && now >= deadline) {
+                shutdown(active_socket, SHUT_RDWR);
+                limited = false;
+            }
+            if ((limited ? uring_wait(ring, (int) MIN(deadline - now, INT_MAX)) : uring_enter(ring, 1)) == ERR_NONE) {
+                continue;
+            }
+            if (ret != ERR_NONE) {
+                uring_exit(ring);
+                thread_ring_state = -1;
+                return ERR_IO;
+            }
+            ret = ERR_IO;
+            shutdown(active_socket, SHUT_RDWR);
+            limited = false;
+        }
+        if (cqe->user_data < nb) {
+            results[cqe->user_data] = cqe->res;
+        }
+        uring_cqe_seen(ring);
+    }
+    return ret;
+}
+
+static void prep_send(struct io_uring_sqe* sqe, int active_socket, const char* buf, size_t len)
+{
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = active_socket;
+    sqe->addr = (uintptr_t) buf;
+    sqe->len = (unsigned) len;
+    sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL; // short sends are carried on by the kernel
+}
+
+// the results of system calls, from those of io_uring
+static ssize_t syscall_result(int res)
+{
+    if (res < 0) {
+        errno = -res;
+        return -1;
+    }
+    return res;
+}
+
+// the result of a call that failed on the ring rather than on the socket
+static ssize_t ring_failed(void)
+{
+    errno = EIO;
+    return -1;
+}
+
+ssize_t uring_read(int active_socket, char* buf, size_t buflen)
+{
+    struct uring* const ring = get_thread_ring();
+    if (ring == NULL) {
+        return ring_failed();
+    }
+    struct io_uring_sqe* const sqe = uring_get_sqe(ring);
+    if (sqe == NULL) {
+        return ring_failed();
+    }
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = active_socket;
+    sqe->addr = (uintptr_t) buf;
+    sqe->len = (unsigned) buflen;
+    sqe->user_data = 0;
+    int res = 0;
+    if (thread_ring_run(ring, active_socket, &res, 1) != ERR_NONE) {
+        return ring_failed();
+    }
+    return syscall_result(res);
+}
+
+ssize_t uring_send(int active_socket, const char* response, size_t response_len)
+{
+    struct uring* const ring = get_thread_ring();
+    if (ring == NULL) {
+        return ring_failed();
+    }
+    struct io_uring_sqe* const sqe = uring_get_sqe(ring);
+    if (sqe == NULL) {
+        return ring_failed();
+    }
+    prep_send(sqe, active_socket, response, response_len);
+    sqe->user_data = 0;
+    int res = 0;
+    if (thread_ring_run(ring, active_socket, &res, 1) != ERR_NONE) {
+        return ring_failed();
+    }
+    return syscall_result(res);
+}
+
+ssize_t uring_sendv(int active_socket, const struct iovec* iov, int iovcnt, int more)
+{
+    struct uring* const ring = get_thread_ring();
+    if (ring == NULL) {
+        return ring_failed();
+    }
+    // each send starts once the previous one is complete, and is cancelled if it is not;
+    // all but the last are not pushed on their own, to be followed at once
+    unsigned nb = (unsigned) MIN(iovcnt, THREAD_RING_ENTRIES);
+    struct io_uring_sqe* previous = NULL;
+    for (unsigned i = 0; i < nb; ++i) {
+        struct io_uring_sqe* const sqe = uring_get_sqe(ring);
+        if (sqe == NULL) {
+            if (previous == NULL) {
+                return ring_failed();
+            }
+            // the ones already queued are sent, the rest is left to the caller as for a short send
+            previous->flags = 0;
+            nb = i;
+            break;
+        }
+        previous = sqe;
+        prep_send(sqe, active_socket, iov[i].iov_base, iov[i].iov_len);
+        if (i + 1 < nb) {
+            sqe->msg_flags |= MSG_MORE;
+            sqe->flags = IOSQE_IO_LINK;
+        } else if (more || nb < (unsigned) iovcnt) {
+            sqe->msg_flags |= MSG_MORE;
+        }
+        sqe->user_data = i;
+    }
+    int res[THREAD_RING_ENTRIES];
+    if (thread_ring_run(ring, active_socket, res, nb) != ERR_NONE) {
+        return ring_failed();
+    }
+    ssize_t sent = 0;
+    for (unsigned i = 0; i < nb && res[i] >= 0; ++i) {
+        sent += res[i];
+        if ((size_t) res[i] < iov[i].iov_len) {
+            break;
+        }
+    }
+    return sent > 0 ? sent : syscall_result(res[0]);
+}
+
+int uring_probe(void)
+{
+    struct uring ring;
+    int ret = uring_init(&ring, THREAD_RING_ENTRIES);
+    if (ret != ERR_NONE) {
+        return ret;
+    }
+    // provided buffer rings came last among what is used here
+    struct io_uring_buf_ring* const buffer_ring = mmap(NULL, sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+                                                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buffer_ring == MAP_FAILED) {
+        ret = ERR_OUT_OF_MEMORY;
+    } else {
+        struct io_uring_buf_reg reg;
+        zero_init_var(reg);
+        reg.ring_addr = (uintptr_t) buffer_ring;
+        reg.ring_entries = 1;
+        if (syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+            ret = ERR_IO;
+        }
+    }
+    uring_exit(&ring);
+    if (buffer_ring != MAP_FAILED) {
+        munmap(buffer_ring, sizeof(struct io_uring_buf));
+    }
+    return ret;
+}
+
+/********************************************************************//**
+ * The event loop
+ */
+
+static struct {
+    struct uring ring;
+    struct io_uring_buf_ring* buffer_ring;
+    char* buffers;
+    unsigned short buffers_tail;
+    unsigned short released[LOOP_BUFFERS];
+    size_t nb_released; // buffers of the events of the last call, given back at the next one
+    int passive_socket;
+    int wake_fd;
+    uint64_t wake_count;
+    // the multishot accept, and the read of wake_fd, to be submitted again
+    bool rearm_accept;
+    bool rearm_wake;
+} loop;
+
+static void provide_buffer(unsigned short id)
+{
+    struct io_uring_buf* const buf = &loop.buffer_ring->bufs[loop.buffers_tail & (LOOP_BUFFERS - 1)];
+    buf->addr = (uintptr_t) (loop.buffers + (size_t) id * LOOP_BUFFER_SIZE);
+    buf->len = LOOP_BUFFER_SIZE;
+    buf->bid = id;
+    ++loop.buffers_tail;
+}
+
+static void publish_buffers(void)
+{
+    __atomic_store_n(&loop.buffer_ring->tail, loop.buffers_tail, __ATOMIC_RELEASE);
+}
+
+static int submit_accept(void)
+{
+    struct io_uring_sqe* const sqe = uring_get_sqe(&loop.ring);
+    if (sqe == NULL) {
+        return ERR_IO;
+    }
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = loop.passive_socket;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT; // one completion per connection, until it fails
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data = ACCEPT_DATA;
+    return ERR_NONE;
+}
+
+static int submit_wake_read(void)
+{
+    struct io_uring_sqe* const sqe = uring_get_sqe(&loop.ring);
+    if (sqe == NULL) {
+        return ERR_IO;
+    }
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = loop.wake_fd;
+    sqe->addr = (uintptr_t) &loop.wake_count;
+    sqe->len = sizeof(loop.wake_count);
+    sqe->user_data = WAKE_DATA;
+    return ERR_NONE;
+}
+
+#define LOOP_BUFFER_RING_SIZE (LOOP_BUFFERS * sizeof(struct io_uring_buf))
+
+// what uring_loop_start() set up, when it fails
+static void loop_release(void)
+{
+    uring_exit(&loop.ring);
+    if (loop.buffer_ring != MAP_FAILED) {
+        munmap(loop.buffer_ring, LOOP_BUFFER_RING_SIZE);
+    }
+    free(loop.buffers);
+    loop.buffers = NULL;
+    if (loop.wake_fd != -1) {
+        close(loop.wake_fd);
+    }
+}
+
+// submits again what completed for good, if the ring has room; else, at the next call
+static void rearm(void)
+{
+    if (loop.rearm_accept && submit_accept() == ERR_NONE) {
+        loop.rearm_accept = false;
+    }
+    if (loop.rearm_wake && submit_wake_read() == ERR_NONE) {
+        loop.rearm_wake = false;
+    }
+}
+
+int uring_loop_start(int passive_socket)
+{
+    if (uring_init(&loop.ring, LOOP_RING_ENTRIES) != ERR_NONE) {
+        return ERR_IO;
+    }
+    loop.passive_socket = passive_socket;
+    loop.wake_fd = -1;
+
+    // the buffers, and the ring where they are given to the kernel
+    loop.buffer_ring = mmap(NULL, LOOP_BUFFER_RING_SIZE, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    loop.buffers = malloc((size_t) LOOP_BUFFERS * LOOP_BUFFER_SIZE);
+    if (loop.buffer_ring == MAP_FAILED || loop.buffers == NULL) {
+        loop_release();
+        return ERR_OUT_OF_MEMORY;
+    }
+    struct io_uring_buf_reg reg;
+    zero_init_var(reg);
+    reg.ring_addr = (uintptr_t) loop.buffer_ring;
+    reg.ring_entries = LOOP_BUFFERS;
+    reg.bgid = LOOP_BUFFER_GROUP;
+    if (syscall(__NR_io_uring_register, loop.ring.fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        loop_release();
+        return ERR_IO;
+    }
+    loop.buffers_tail = 0;
+    for (unsigned short id = 0; id < LOOP_BUFFERS; ++id) {
+        provide_buffer(id);
+    }
+    publish_buffers();
+    loop.nb_released = 0;
+    loop.rearm_accept = false;
+    loop.rearm_wake = false;
+
+    loop.wake_fd = eventfd(0, EFD_CLOEXEC);
+    int ret = loop.wake_fd == -1 ? ERR_IO : submit_accept();
+    if (ret == ERR_NONE) {
+        ret = submit_wake_read();
+    }
+    if (ret != ERR_NONE) {
+        loop_release();
+    }
+    return ret;
+}
+
+int uring_loop_recv(int active_socket, size_t max_len, void* ctx)
+{
+    struct io_uring_sqe* const sqe = uring_get_sqe(&loop.ring);
+    if (sqe == NULL) {
+        return ERR_IO;
+    }
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = active_socket;
+    sqe->len = (unsigned) (max_len < LOOP_BUFFER_SIZE ? max_len : LOOP_BUFFER_SIZE);
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = LOOP_BUFFER_GROUP;
+    sqe->user_data = (uintptr_t) ctx;
+    return ERR_NONE;
+}
+
+int uring_loop_wait(struct uring_event* events, size_t max_events, size_t* nb_events, int timeout_ms)
+{
+    M_REQUIRE_NON_NULL(events);
+    M_REQUIRE_NON_NULL(nb_events);
+    *nb_events = 0;
+
+    if (loop.nb_released > 0) {
+        for (size_t i = 0; i < loop.nb_released; ++i) {
+            provide_buffer(loop.released[i]);
+        }
+        publish_buffers();
+        loop.nb_released = 0;
+    }
+    rearm();
+
+    struct io_uring_cqe* cqe = uring_peek_cqe(&loop.ring);
+    if (cqe == NULL) {
+        if (uring_wait(&loop.ring, timeout_ms) != ERR_NONE) {
+            return ERR_IO;
+        }
+    } else if (loop.ring.to_submit > 0 && uring_enter(&loop.ring, 0) != ERR_NONE) {
+        return ERR_IO;
+    }
+
+    size_t nb = 0;
+    // each event holds at most one buffer, and only so many can be out
+    if (max_events > LOOP_BUFFERS) {
+        max_events = LOOP_BUFFERS;
+    }
+    while (nb < max_events && (cqe = uring_peek_cqe(&loop.ring)) != NULL) {
+        struct uring_event* const event = &events[nb++];
+        event->result = cqe->res;
+        event->ctx = NULL;
+        event->data = NULL;
+        if (cqe->user_data == ACCEPT_DATA) {
+            event->type = URING_ACCEPTED;
+            loop.rearm_accept |= !(cqe->flags & IORING_CQE_F_MORE);
+        } else if (cqe->user_data == WAKE_DATA) {
+            event->type = URING_WOKEN;
+            loop.rearm_wake = true;
+        } else {
+            event->type = URING_RECEIVED;
+            event->ctx = (void*) (uintptr_t) cqe->user_data;
+            if (cqe->flags & IORING_CQE_F_BUFFER) {
+                const unsigned short id = (unsigned short) (cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+                event->data = loop.buffers + (size_t) id * LOOP_BUFFER_SIZE;
+                loop.released[loop.nb_released++] = id;
+            }
+        }
+        uring_cqe_seen(&loop.ring);
+    }
+    // the events collected are reported, whether or not there is room to submit again
+    rearm();
+    *nb_events = nb;
+    return ERR_NONE;
+}
+
+int uring_loop_wake(void)
+{
+    const uint64_t one = 1;
+    return write(loop.wake_fd, &one, sizeof(one)) == sizeof(one) ? ERR_NONE : ERR_IO;
+}
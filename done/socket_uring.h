@@ -0,0 +1,99 @@
+/**
+ * @file socket_uring.h
+ * @brief io_uring transport of the sockets: the calls of socket_layer.h, used
+ *        by http_net.c instead when it is selected, and the event loop of the
+ *        server.
+ *
+ * Each thread calling uring_read() or uring_send() gets a small ring of its own.
+ * The event loop has one ring, where a multishot accept keeps accepting the
+ * connections, and the receives pick their buffer in a ring of buffers
+ * provided to the kernel: the connections waiting for a request take none.
+ * Only the thread running the event loop submits to its ring.
+ */
+
+#pragma once
+
+#include <stddef.h> // size_t
+#include <sys/types.h> // ssize_t
+#include <sys/uio.h> // struct iovec
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Whether io_uring can be used, with what this transport needs.
+ *
+ * @return Some error code. 0 if it can.
+ */
+int uring_probe(void);
+
+/**
+ * @brief tcp_read(), tcp_send() and tcp_sendv() on a ring of the
+ *        calling thread, with the same results.
+ */
+ssize_t uring_read(int active_socket, char* buf, size_t buflen);
+ssize_t uring_send(int active_socket, const char* response, size_t response_len);
+ssize_t uring_sendv(int active_socket, const struct iovec* iov, int iovcnt, int more);
+
+/**
+ * @brief Sets how long uring_read(), uring_send() and uring_sendv() wait,
+ *        in milliseconds, -1 (the default) for no limit. Past it, the
+ *        socket is shut down and the call fails. Before the calls start.
+ */
+void uring_set_timeout(int timeout_ms);
+
+enum uring_event_type {
+    URING_ACCEPTED, // result: the new connection, or -errno
+    URING_RECEIVED, // result: the number of bytes received in data, 0 if the peer closed, or -errno
+    URING_WOKEN     // by uring_loop_wake()
+};
+
+struct uring_event {
+    enum uring_event_type type;
+    int result;
+    void* ctx;        // as given to uring_loop_recv()
+    const char* data; // valid until the next call to uring_loop_wait()
+};
+
+/**
+ * @brief Sets up the ring of the event loop and starts accepting the
+ *        connections of a (blocking) passive socket. The connections are
+ *        blocking: the ring waits for them.
+ *
+ * @return Some error code. 0 if no error.
+ */
+int uring_loop_start(int passive_socket);
+
+/**
+ * @brief Receives once from a connection, at most max_len bytes, into a
+ *        buffer provided to the kernel. From the thread of the event loop.
+ *
+ * @return Some error code. 0 if no error.
+ */
+int uring_loop_recv(int active_socket, size_t max_len, void* ctx);
+
+/**
+ * @brief Submits the receives and waits for at least one event, or for a
+ *        timeout or a signal (with no event then).
+ *
+ * @param events Where to put the events
+ * @param max_events Their maximum number
+ * @param nb_events Where to put their number
+ * @param timeout_ms How long to wait at most, in milliseconds; -1 for no limit
+ * @return Some error code. 0 if no error: the events reaped are always
+ *         reported, an accept that cannot be submitted again at once being
+ *         submitted at the next call.
+ */
+int uring_loop_wait(struct uring_event* events, size_t max_events, size_t* nb_events, int timeout_ms);
+
+/**
+ * @brief Makes the event loop return a URING_WOKEN event. From any thread.
+ *
+ * @return Some error code. 0 if no error.
+ */
+int uring_loop_wake(void);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,379 @@
+/*
+ * @file static_cache.c
+ * @brief Static files served from memory, as they are and precompressed.
+ */
+
+#include "static_cache.h"
+#include "error.h"
+#include "http_net.h"
+#include "util.h" // zero_init_var
+
+#include <brotli/encode.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#define MAX_STATIC_FILES 16
+#define STATIC_HEADERS_SIZE 512
+
+enum static_encoding { IDENTITY, GZIP, BROTLI, NB_ENCODINGS };
+
+// the value of Content-Encoding of each, the last accepted by the client being sent
+static const char* const CONTENT_ENCODINGS[NB_ENCODINGS] = { NULL, "gzip", "br" };
+
+// the content of a file as read once, never changed afterwards
+struct static_version {
+    unsigned refs;                  // the cache holds one while it is the current version
+    struct timespec mtime;
+    off_t size;
+    ino_t inode;
+    struct {
+        char* header;               // NULL if this encoding is not smaller than the file
+        size_t header_len;
+        char* body;
+        size_t body_len;
+    } encodings[NB_ENCODINGS];
+};
+
+struct static_file {
+    char* filename;
+    char* content_type;
+    time_t checked;                 // when it was last compared to the file on disk
+    struct static_version* version; // NULL while the file cannot be read
+};
+
+static struct {
+    pthread_mutex_t mutex;
+    struct static_file files[MAX_STATIC_FILES];
+    size_t nb_files;
+} cache = { .mutex = PTHREAD_MUTEX_INITIALIZER };
+
+static void free_version(struct static_version* version)
+{
+    for (int encoding = IDENTITY; encoding < NB_ENCODINGS; ++encoding) {
+        free(version->encodings[encoding].header);
+        free(version->encodings[encoding].body);
+    }
+    free(version);
+}
+
+// to be called with the mutex held
+static void release_locked(struct static_version* version)
+{
+    if (version != NULL && --version->refs == 0) {
+        free_version(version);
+    }
+}
+
+static void release(struct static_version* version)
+{
+    pthread_mutex_lock(&cache.mutex);
+    release_locked(version);
+    pthread_mutex_unlock(&cache.mutex);
+}
+
+// to be called with the mutex held
+static struct static_file* find_file(const char* filename)
+{
+    for (size_t i = 0; i < cache.nb_files; ++i) {
+        if (strcmp(cache.files[i].filename, filename) == 0) {
+            return &cache.files[i];
+        }
+    }
+    return NULL;
+}
+
+static bool same_file(const struct stat* st, const struct static_version* version)
+{
+    return st->st_mtim.tv_sec == version->mtime.tv_sec && st->st_mtim.tv_nsec == version->mtime.tv_nsec
+           && st->st_size == version->size && st->st_ino == version->inode;
+}
+
+// reads the whole file in an allocated buffer (never NULL, even if the file is empty)
+static int read_file(const char* filename, struct stat* st, char** content)
+{
+    const int fd = open(filename, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return ERR_IO;
+    }
+    if (fstat(fd, st) == -1 || !S_ISREG(st->st_mode)) {
+        close(fd);
+        return ERR_IO;
+    }
+    const size_t size = (size_t) st->st_size;
+    char* const buffer = malloc(size + 1);
+    if (buffer == NULL) {
+        close(fd);
+        return ERR_OUT_OF_MEMORY;
+    }
+    size_t done = 0;
+    while (done < size) {
+        const ssize_t len = read(fd, buffer + done, size - done);
+        if (len <= 0) {
+            free(buffer);
+            close(fd);
+            return ERR_IO;
+        }
+        done += (size_t) len;
+    }
+    close(fd);
+    *content = buffer;
+    return ERR_NONE;
+}
+
+// gzip (RFC 1952) with the highest level of zlib
+static int compress_gzip(const char* in, size_t len, char** out, size_t* out_len)
+{
+    if (len > UINT_MAX) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    z_stream stream;
+    zero_init_var(stream);
+    // 16 more than the window bits for a gzip header and trailer rather than zlib ones
+    if (deflateInit2(&stream, Z_BEST_COMPRESSION, Z_DEFLATED, MAX_WBITS + 16, 9, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    const uLong bound = deflateBound(&stream, (uLong) len);
+    char* const buffer = malloc(bound);
+    if (buffer == NULL) {
+        deflateEnd(&stream);
+        return ERR_OUT_OF_MEMORY;
+    }
+    stream.next_in = (Bytef*) (uintptr_t) in;
+    stream.avail_in = (uInt) len;
+    stream.next_out = (Bytef*) buffer;
+    stream.avail_out = (uInt) bound;
+    const int ret = deflate(&stream, Z_FINISH);
+    *out_len = stream.total_out;
+    deflateEnd(&stream);
+    if (ret != Z_STREAM_END) {
+        free(buffer);
+        return ERR_IO;
+    }
+    *out = buffer;
+    return ERR_NONE;
+}
+
+// brotli (RFC 7932) with its highest quality, affordable once per change of a small file
+static int compress_brotli(const char* in, size_t len, bool text, char** out, size_t* out_len)
+{
+    size_t size = BrotliEncoderMaxCompressedSize(len);
+    if (size == 0) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    char* const buffer = malloc(size);
+    if (buffer == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    if (!BrotliEncoderCompress(BROTLI_MAX_QUALITY, BROTLI_DEFAULT_WINDOW,
+                               text ? BROTLI_MODE_TEXT : BROTLI_MODE_GENERIC,
+                               len, (const uint8_t*) in, &size, (uint8_t*) buffer)) {
+        free(buffer);
+        return ERR_IO;
+    }
+    *out = buffer;
+    *out_len = size;
+    return ERR_NONE;
+}
+
+// reads the file, compresses it and formats the headers of its replies
+static int load_version(const char* filename, const char* content_type, struct static_version** out)
+{
+    struct stat st;
+    char* content = NULL;
+    int ret = read_file(filename, &st, &content);
+    if (ret != ERR_NONE) {
+        fprintf(stderr, "static_cache: failed to read \"%s\"\n", filename);
+        return ret;
+    }
+    struct static_version* const version = calloc(1, sizeof(*version));
+    if (version == NULL) {
+        free(content);
+        return ERR_OUT_OF_MEMORY;
+    }
+    version->refs = 1;
+    version->mtime = st.st_mtim;
+    version->size = st.st_size;
+    version->inode = st.st_ino;
+    version->encodings[IDENTITY].body = content;
+    version->encodings[IDENTITY].body_len = (size_t) st.st_size;
+
+    const size_t len = (size_t) st.st_size;
+    if (len > 0) {
+        // a compression that fails only leaves its encoding out
+        compress_gzip(content, len, &version->encodings[GZIP].body, &version->encodings[GZIP].body_len);
+        compress_brotli(content, len, strncmp(content_type, "text/", 5) == 0,
+                        &version->encodings[BROTLI].body, &version->encodings[BROTLI].body_len);
+    }
+    for (int encoding = IDENTITY; encoding < NB_ENCODINGS; ++encoding) {
+        if (encoding != IDENTITY && version->encodings[encoding].body_len >= len) {
+            free(version->encodings[encoding].body);
+            version->encodings[encoding].body = NULL;
+        }
+        if (version->encodings[encoding].body == NULL) {
+            continue;
+        }
+        // even the file as it is varies with Accept-Encoding for the caches on the way
+        char headers[STATIC_HEADERS_SIZE];
+        const int headers_len = snprintf(headers, sizeof(headers), "Content-Type: %s%s%s%s%sVary: Accept-Encoding%s",
+                                         content_type, HTTP_LINE_DELIM,
+                                         encoding == IDENTITY ? "" : "Content-Encoding: ",
+                                         encoding == IDENTITY ? "" : CONTENT_ENCODINGS[encoding],
+                                         encoding == IDENTITY ? "" : HTTP_LINE_DELIM, HTTP_LINE_DELIM);
+        if (headers_len < 0 || (size_t) headers_len >= sizeof(headers)) {
+            free_version(version);
+            return ERR_INVALID_ARGUMENT;
+        }
+        version->encodings[encoding].header = http_format_reply_header(HTTP_OK, headers,
+                                              version->encodings[encoding].body_len,
+                                              &version->encodings[encoding].header_len);
+        if (version->encodings[encoding].header == NULL) {
+            free_version(version);
+            return ERR_OUT_OF_MEMORY;
+        }
+    }
+    *out = version;
+    return ERR_NONE;
+}
+
+// makes fresh (which may be NULL) the current version of file if old still is
+static void replace(struct static_file* file, struct static_version* old, struct static_version* fresh)
+{
+    pthread_mutex_lock(&cache.mutex);
+    if (file->version == old) {
+        file->version = fresh;
+        if (fresh != NULL) {
+            ++fresh->refs;
+        }
+        release_locked(old);
+    }
+    pthread_mutex_unlock(&cache.mutex);
+}
+
+// reads the file again if it changed on disk since version (NULL if none) was read;
+// returns the version to send, with a reference taken
+static struct static_version* refresh(struct static_file* file, struct static_version* version)
+{
+    struct stat st;
+    if (stat(file->filename, &st) == -1) {
+        // removed: not found, as on disk
+        if (version != NULL) {
+            replace(file, version, NULL);
+            release(version);
+        }
+        return NULL;
+    }
+    if (version != NULL && same_file(&st, version)) {
+        return version;
+    }
+    struct static_version* fresh = NULL;
+    if (load_version(file->filename, file->content_type, &fresh) != ERR_NONE) {
+        // the previous content is kept while the new one cannot be read
+        return version;
+    }
+    replace(file, version, fresh);
+    release(version);
+    return fresh;
+}
+
+int static_cache_add(const char* filename, const char* content_type)
+{
+    M_REQUIRE_NON_NULL(filename);
+    M_REQUIRE_NON_NULL(content_type);
+
+    struct static_version* version = NULL;
+    const int ret = load_version(filename, content_type, &version);
+    if (ret != ERR_NONE && ret != ERR_IO) {
+        return ret;
+    }
+
+    pthread_mutex_lock(&cache.mutex);
+    if (find_file(filename) != NULL) {
+        pthread_mutex_unlock(&cache.mutex);
+        release(version);
+        return ret;
+    }
+    if (cache.nb_files == MAX_STATIC_FILES) {
+        pthread_mutex_unlock(&cache.mutex);
+        release(version);
+        return ERR_MAX_FILES;
+    }
+    struct static_file* const file = &cache.files[cache.nb_files];
+    file->filename = strdup(filename);
+    file->content_type = strdup(content_type);
+    if (file->filename == NULL || file->content_type == NULL) {
+        free(file->filename);
+        free(file->content_type);
+        pthread_mutex_unlock(&cache.mutex);
+        release(version);
+        return ERR_OUT_OF_MEMORY;
+    }
+    file->checked = time(NULL);
+    file->version = version;
+    ++cache.nb_files;
+    pthread_mutex_unlock(&cache.mutex);
+    return ret;
+}
+
+int static_cache_serve(int connection, const struct http_message* msg, const char* filename)
+{
+    M_REQUIRE_NON_NULL(msg);
+    M_REQUIRE_NON_NULL(filename);
+
+    pthread_mutex_lock(&cache.mutex);
+    struct static_file* const file = find_file(filename);
+    if (file == NULL) {
+        pthread_mutex_unlock(&cache.mutex);
+        return http_serve_file(connection, filename);
+    }
+    // a single request a second looks at the file on disk, the others send what is cached
+    const time_t now = time(NULL);
+    const bool check = file->checked != now;
+    file->checked = now;
+    struct static_version* version = file->version;
+    if (version != NULL) {
+        ++version->refs;
+    }
+    pthread_mutex_unlock(&cache.mutex);
+
+    if (check) {
+        version = refresh(file, version);
+    }
+    if (version == NULL) {
+        return http_reply(connection, "404 Not Found", "", "", 0);
+    }
+
+    int encoding = NB_ENCODINGS - 1;
+    while (encoding > IDENTITY && (version->encodings[encoding].header == NULL ||
+                                   http_accepts_encoding(msg, CONTENT_ENCODINGS[encoding]) <= 0)) {
+        --encoding;
+    }
+    const int ret = http_reply_prebuilt(connection, version->encodings[encoding].header,
+                                        version->encodings[encoding].header_len,
+                                        version->encodings[encoding].body,
+                                        version->encodings[encoding].body_len);
+    release(version);
+    return ret;
+}
+
+void static_cache_free(void)
+{
+    pthread_mutex_lock(&cache.mutex);
+    for (size_t i = 0; i < cache.nb_files; ++i) {
+        free(cache.files[i].filename);
+        free(cache.files[i].content_type);
+        release_locked(cache.files[i].version);
+    }
+    zero_init_var(cache.files);
+    cache.nb_files = 0;
+    pthread_mutex_unlock(&cache.mutex);
+}
@@ -0,0 +1,50 @@
+/**
+ * @file static_cache.h
+ * @brief Static files (e.g. index.html) served from memory.
+ *
+ * Each file is read when it is added, with its gzip and brotli versions
+ * (kept when smaller), and again once a request finds that it changed on
+ * disk, which is checked at most once a second. Every version comes with
+ * the whole header of its reply, formatted once; the one sent is chosen
+ * from the Accept-Encoding header of the request.
+ */
+
+#pragma once
+
+#include "http_prot.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Adds a file to the cache and reads it.
+ *
+ * A file that cannot be read is kept in the cache anyway: it is answered
+ * "404 Not Found" until it can be read.
+ *
+ * @param filename The path of the file, also the key of the cache
+ * @param content_type Its "Content-Type"
+ * @return ERR_NONE, ERR_IO if the file cannot be read yet,
+ *         ERR_OUT_OF_MEMORY or ERR_MAX_FILES when it is not added
+ */
+int static_cache_add(const char* filename, const char* content_type);
+
+/**
+ * @brief Answers a request with a file, from the cache if it was added.
+ *
+ * @param connection The connection
+ * @param msg The request, for its Accept-Encoding header
+ * @param filename The path of the file
+ * @return as http_reply()
+ */
+int static_cache_serve(int connection, const struct http_message* msg, const char* filename);
+
+/**
+ * @brief Empties the cache. Versions still being sent are freed once sent.
+ */
+void static_cache_free(void);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,171 @@
+/*
+ * @file variant_cache.c
+ * @brief In-memory cache of the images resized to any resolution.
+ */
+
+#include "variant_cache.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define VARIANT_CACHE_BUCKETS 1024
+
+static struct {
+    pthread_mutex_t mutex;
+    struct variant* buckets[VARIANT_CACHE_BUCKETS];
+    struct variant* most_recent;
+    struct variant* least_recent;
+    size_t bytes;
+    size_t max_bytes;
+} cache = { .mutex = PTHREAD_MUTEX_INITIALIZER };
+
+static size_t bucket_of(const unsigned char* SHA, uint16_t width, uint16_t height, int format)
+{
+    size_t hash = 0;
+    memcpy(&hash, SHA, sizeof(hash));
+    return (hash ^ ((size_t) width << 16) ^ height ^ ((size_t) format << 8)) % VARIANT_CACHE_BUCKETS;
+}
+
+static void free_variant(struct variant* variant)
+{
+    free(variant->data);
+    free(variant);
+}
+
+static void lru_unlink(struct variant* variant)
+{
+    if (variant->lru_prev != NULL) {
+        variant->lru_prev->lru_next = variant->lru_next;
+    } else {
+        cache.most_recent = variant->lru_next;
+    }
+    if (variant->lru_next != NULL) {
+        variant->lru_next->lru_prev = variant->lru_prev;
+    } else {
+        cache.least_recent = variant->lru_prev;
+    }
+    variant->lru_prev = variant->lru_next = NULL;
+}
+
+static void lru_push(struct variant* variant)
+{
+    variant->lru_next = cache.most_recent;
+    if (cache.most_recent != NULL) {
+        cache.most_recent->lru_prev = variant;
+    } else {
+        cache.least_recent = variant;
+    }
+    cache.most_recent = variant;
+}
+
+// removes an entry from the cache; it is freed once no longer in use
+static void evict(struct variant* variant)
+{
+    struct variant** link = &cache.buckets[bucket_of(variant->SHA, variant->width, variant->height, variant->format)];
+    while (*link != variant) {
+        link = &(*link)->next;
+    }
+    *link = variant->next;
+    lru_unlink(variant);
+    cache.bytes -= variant->size;
+    if (--variant->refs == 0) {
+        free_variant(variant);
+    }
+}
+
+static struct variant* lookup(const unsigned char* SHA, uint16_t width, uint16_t height, int format)
+{
+    struct variant* variant = cache.buckets[bucket_of(SHA, width, height, format)];
+    while (variant != NULL && (variant->width != width || variant->height != height || variant->format != format ||
+                               memcmp(variant->SHA, SHA, SHA256_DIGEST_LENGTH) != 0)) {
+        variant = variant->next;
+    }
+    return variant;
+}
+
+void variant_cache_init(size_t max_bytes)
+{
+    pthread_mutex_lock(&cache.mutex);
+    cache.max_bytes = max_bytes;
+    while (cache.bytes > cache.max_bytes) {
+        evict(cache.least_recent);
+    }
+    pthread_mutex_unlock(&cache.mutex);
+}
+
+struct variant* variant_cache_get(const unsigned char* SHA, uint16_t width, uint16_t height, int format)
+{
+    if (SHA == NULL) {
+        return NULL;
+    }
+    pthread_mutex_lock(&cache.mutex);
+    struct variant* variant = lookup(SHA, width, height, format);
+    if (variant != NULL) {
+        lru_unlink(variant);
+        lru_push(variant);
+        ++variant->refs;
+    }
+    pthread_mutex_unlock(&cache.mutex);
+    return variant;
+}
+
+struct variant* variant_cache_add(const unsigned char* SHA, uint16_t width, uint16_t height, int format,
+                                  void* data, size_t size)
+{
+    struct variant* variant = calloc(1, sizeof(struct variant));
+    if (SHA == NULL || data == NULL || variant == NULL) {
+        free(data);
+        free(variant);
+        return NULL;
+    }
+    memcpy(variant->SHA, SHA, SHA256_DIGEST_LENGTH);
+    variant->width  = width;
+    variant->height = height;
+    variant->format = format;
+    variant->data   = data;
+    variant->size   = size;
+    variant->refs   = 1;
+
+    pthread_mutex_lock(&cache.mutex);
+    struct variant* const existing = lookup(SHA, width, height, format);
+    if (existing != NULL) {
+        // created concurrently: keep the first one
+        ++existing->refs;
+        pthread_mutex_unlock(&cache.mutex);
+        free_variant(variant);
+        return existing;
+    }
+    if (size <= cache.max_bytes) {
+        while (cache.bytes + size > cache.max_bytes) {
+            evict(cache.least_recent);
+        }
+        const size_t bucket = bucket_of(SHA, width, height, format);
+        variant->next = cache.buckets[bucket];
+        cache.buckets[bucket] = variant;
+        lru_push(variant);
+        cache.bytes += size;
+        ++variant->refs;
+    }
+    pthread_mutex_unlock(&cache.mutex);
+    return variant;
+}
+
+void variant_cache_release(struct variant* variant)
+{
+    if (variant == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&cache.mutex);
+    const bool unused = --variant->refs == 0;
+    pthread_mutex_unlock(&cache.mutex);
+    if (unused) {
+        free_variant(variant);
+    }
+}
+
+void variant_cache_free(void)
+{
+    variant_cache_init(0);
+}
@@ -0,0 +1,90 @@
+/**
+ * @file variant_cache.h
+ * @brief In-memory cache of the images resized to any resolution.
+ *
+ * Such versions are not stored in the imgFS file: they are kept here, up
+ * to a total number of bytes, the least recently used being evicted first.
+ * They are identified by the SHA of the original content, with their size
+ * and format, so the entries of deleted images are never found again and
+ * simply age out.
+ */
+
+#pragma once
+
+#include <openssl/sha.h> // for SHA256_DIGEST_LENGTH
+#include <stddef.h> // for size_t
+#include <stdint.h> // for uint16_t
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief One cached version, valid until released.
+ */
+struct variant {
+    unsigned char SHA[SHA256_DIGEST_LENGTH];
+    uint16_t width;
+    uint16_t height;
+    int format;               // FORMAT_* of the content
+    void* data;
+    size_t size;
+    // internal
+    unsigned refs;            // the cache itself holds one while the entry is in it
+    struct variant* next;     // in its hash bucket
+    struct variant* lru_prev; // towards the most recently used
+    struct variant* lru_next; // towards the least recently used
+};
+
+/**
+ * @brief Sets the size of the cache. 0 disables it.
+ *
+ * @param max_bytes Maximum total size of the cached versions
+ */
+void variant_cache_init(size_t max_bytes);
+
+/**
+ * @brief Looks for a version in the cache.
+ *
+ * @param SHA The SHA of the original content
+ * @param width The requested resolution
+ * @param height
+ * @param format The FORMAT_* of the content
+ * @return The version, to be released with variant_cache_release(), or NULL
+ */
+struct variant* variant_cache_get(const unsigned char* SHA, uint16_t width, uint16_t height, int format);
+
+/**
+ * @brief Adds a version to the cache, which takes ownership of data.
+ *
+ * If the version was added in the meantime, data is freed and the cached
+ * one is returned. When the cache is disabled or data is larger than the
+ * whole cache, the version is returned without being kept.
+ *
+ * @param SHA The SHA of the original content
+ * @param width The requested resolution
+ * @param height
+ * @param format The FORMAT_* of the content
+ * @param data The (allocated) content
+ * @param size Its size
+ * @return The version, to be released with variant_cache_release(), or NULL
+ *         if out of memory (data is then freed)
+ */
+struct variant* variant_cache_add(const unsigned char* SHA, uint16_t width, uint16_t height, int format,
+                                  void* data, size_t size);
+
+/**
+ * @brief Releases a version returned by variant_cache_get() or variant_cache_add().
+ *
+ * @param variant The version
+ */
+void variant_cache_release(struct variant* variant);
+
+/**
+ * @brief Empties the cache. Versions still in use are freed once released.
+ */
+void variant_cache_free(void);
+
+#ifdef __cplusplus
+}
+#endif